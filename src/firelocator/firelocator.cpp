@@ -62,7 +62,6 @@ namespace sc = fire::security;
 
 namespace
 {
-    const size_t THREAD_SLEEP = 100; //in milliseconds
     const size_t POOL_SIZE = 10; //small pool size for now
 }
 
@@ -336,11 +335,7 @@ int main(int argc, char *argv[])
     try
     {
         n::endpoint ep;
-        if(!con.receive(ep, data))
-        {
-            u::sleep_thread(THREAD_SLEEP);
-            continue;
-        }
+        if(!con.receive(ep, data, true)) continue;
 
         //decrypt message
         auto sid = n::make_address_str(ep);
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+
+#include "fireperf/allocations.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+    std::atomic<size_t> count{0};
+}
+
+//replaces the global allocation functions for all of fireperf.
+//Kept in their own file so the compiler never inlines them next to 
+//a new expression.
+void* operator new(std::size_t s)
+{
+    count++;
+    auto p = std::malloc(s > 0 ? s : 1);
+    if(!p) throw std::bad_alloc{};
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+//the standard library may be built with sized deallocation
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace fire
+{
+    namespace perf
+    {
+        size_t allocations()
+        {
+            return count.load();
+        }
+    }
+}
@@ -31,21 +31,33 @@
 
 #include <string>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <sstream>
 #include <termios.h>
+#include <sys/resource.h>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
 
 #include <boost/asio/ip/host_name.hpp>
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
 
+#include "fireperf/allocations.hpp"
+#include "fireperf/histogram.hpp"
 #include "network/connection_manager.hpp"
+#include "network/loopback.hpp"
 #include "message/message.hpp"
 #include "messages/greeter.hpp"
 #include "util/bytes.hpp"
+#include "util/thread.hpp"
 #include "util/dbc.hpp"
 #include "util/log.hpp"
 
+#include <boost/lexical_cast.hpp>
+
 #include <botan/botan.h>
 
 namespace po = boost::program_options;
@@ -55,14 +67,111 @@ namespace n = fire::network;
 namespace m = fire::message;
 namespace ms = fire::messages;
 namespace u = fire::util;
+namespace p = fire::perf;
 
 namespace
 {
     const size_t THREAD_SLEEP = 100; //in milliseconds
     const size_t POOL_SIZE = 1; //small pool size for now
-    n::port_type SRC_PORT = 7170;
-    n::port_type DST_PORT = 7171;
-    const std::string DST_ADDR = "udp://localhost:7171";
+    const n::port_type FIRST_PORT = 7170;
+
+    //each message starts with the sender, sequence and send time
+    const size_t HEADER_SIZE = 16;
+
+    using steady = std::chrono::steady_clock;
+
+    struct mode
+    {
+        std::string name;
+        std::string protocol;
+        bool robust;
+    };
+    using modes = std::vector<mode>;
+    using sizes = std::vector<size_t>;
+
+    struct config
+    {
+        size_t messages;
+        size_t senders;
+        size_t window;
+        std::chrono::milliseconds timeout;
+        bool loopback;
+        n::link_params link;
+        n::queue_options src_udp_options;
+        n::queue_options dst_udp_options;
+    };
+
+    struct result
+    {
+        mode how;
+        size_t size = 0;
+        size_t senders = 0;
+        size_t window = 0;
+        size_t sent = 0;
+        size_t delivered = 0;
+        size_t duplicates = 0;
+        size_t would_block = 0;
+        size_t dropped = 0;
+        double seconds = 0;
+        double cpu_seconds = 0;
+        size_t allocations = 0;
+        p::histogram latency; //in nanoseconds
+        n::udp_stats src_stats;
+        n::udp_stats dst_stats;
+    };
+    using results = std::vector<result>;
+
+    using connection_manager_uptr = std::unique_ptr<n::connection_manager>;
+    using connection_managers = std::vector<connection_manager_uptr>;
+
+    //shared by the senders and the receiver of one run
+    struct run_state
+    {
+        const config* c;
+        mode how;
+        size_t size;
+        std::string to;
+
+        connection_manager_uptr dst;
+        connection_managers srcs;
+
+        std::mutex mutex;
+        std::condition_variable progress;
+        std::vector<size_t> received;
+        size_t total_received = 0;
+        steady::time_point last_received;
+
+        std::atomic<size_t> would_block{0};
+        std::atomic<size_t> dropped{0};
+
+        //only touched by the receiver thread
+        p::histogram latency;
+        std::vector<std::vector<bool>> seen;
+        size_t duplicates = 0;
+    };
+
+    uint64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                steady::now().time_since_epoch()).count();
+    }
+
+    double cpu_seconds()
+    {
+        rusage r;
+        getrusage(RUSAGE_SELF, &r);
+        return r.ru_utime.tv_sec + r.ru_stime.tv_sec + 
+            (r.ru_utime.tv_usec + r.ru_stime.tv_usec) / 1000000.0;
+    }
+
+    std::vector<std::string> split(const std::string& s)
+    {
+        std::vector<std::string> r;
+        std::stringstream ss{s};
+        std::string part;
+        while(std::getline(ss, part, ',')) if(!part.empty()) r.push_back(part);
+        return r;
+    }
 }
 
 po::options_description create_descriptions()
@@ -73,9 +182,23 @@ po::options_description create_descriptions()
 
     d.add_options()
         ("help", "prints help")
-        ("messages", po::value<int>()->default_value(100000), "Number of messages")
-        ("robust", po::value<bool>()->default_value(true), "Are messages robust?")
-        ("size", po::value<int>()->default_value(512), "Message size in bytes");
+        ("messages", po::value<int>()->default_value(100000), "Number of messages each sender sends")
+        ("robust", po::value<bool>()->default_value(true), "Are messages robust? Used when no modes are given")
+        ("modes", po::value<std::string>()->default_value(""), "Comma separated runs of udp, udp-robust and tcp")
+        ("size", po::value<int>()->default_value(512), "Message size in bytes")
+        ("sizes", po::value<std::string>()->default_value(""), "Comma separated message sizes to run each mode with")
+        ("senders", po::value<int>()->default_value(1), "Peers sending to one receiver at the same time")
+        ("window", po::value<int>()->default_value(1), "Messages a sender has on their way before it waits")
+        ("fec", po::value<int>()->default_value(0), "Data chunks per parity chunk for unreliable messages, 0 is off")
+        ("loss", po::value<double>()->default_value(0), "Percent of sent udp packets to drop")
+        ("bundle-delay", po::value<double>()->default_value(0), "Microseconds small udp frames wait to share a datagram")
+        ("timeout", po::value<int>()->default_value(100), "Milliseconds to wait for an unreliable message")
+        ("loopback", po::bool_switch(), "Send over an in-process network instead of sockets")
+        ("latency", po::value<double>()->default_value(0), "Milliseconds each loopback message takes")
+        ("jitter", po::value<double>()->default_value(0), "Up to this many milliseconds added to each loopback message")
+        ("reorder", po::value<double>()->default_value(0), "Percent of loopback udp messages held back")
+        ("bandwidth", po::value<double>()->default_value(0), "Loopback bytes per second, 0 is unlimited")
+        ("json", po::value<std::string>()->default_value(""), "Write results as json to this file, - for standard out");
 
     return d;
 }
@@ -89,64 +212,400 @@ po::variables_map parse_options(int argc, char* argv[], po::options_description&
     return v;
 }
 
-int main(int argc, char *argv[])
+modes parse_modes(const po::variables_map& vm)
 {
-    auto desc = create_descriptions();
-    auto vm = parse_options(argc, argv, desc);
-    if(vm.count("help"))
+    const auto names = split(vm["modes"].as<std::string>());
+    if(names.empty()) 
+        return vm["robust"].as<bool>() ? 
+            modes{{"udp-robust", n::UDP, true}} : 
+            modes{{"udp", n::UDP, false}};
+
+    modes r;
+    for(const auto& name : names)
+        if(name == "udp") r.push_back({name, n::UDP, false});
+        else if(name == "udp-robust") r.push_back({name, n::UDP, true});
+        else if(name == "tcp") r.push_back({name, n::TCP, true});
+        else throw std::runtime_error{"unknown mode `" + name + "'"};
+    return r;
+}
+
+sizes parse_sizes(const po::variables_map& vm)
+{
+    const auto parts = split(vm["sizes"].as<std::string>());
+    if(parts.empty()) return {static_cast<size_t>(vm["size"].as<int>())};
+
+    sizes r;
+    for(const auto& s : parts) r.push_back(boost::lexical_cast<size_t>(s));
+    return r;
+}
+
+void sender(run_state* s, size_t i)
+try
+{
+    REQUIRE(s);
+    REQUIRE_LESS(i, s->srcs.size());
+
+    auto& src = *s->srcs[i];
+    const auto& c = *s->c;
+    u::bytes data(s->size, 'm');
+    const uint32_t id = i;
+
+    //messages never coming back that the window stops waiting for
+    size_t lost = 0;
+
+    for(size_t seq = 0; seq < c.messages; seq++)
     {
-        std::cout << desc << std::endl;
-        return 1;
+        //keep at most a window of messages on their way
+        {
+            std::unique_lock<std::mutex> l(s->mutex);
+            auto outstanding = [&]() -> size_t 
+            { 
+                const auto done = s->received[i] + lost;
+                return seq > done ? seq - done : 0;
+            };
+            if(!s->progress.wait_for(l, c.timeout, [&] { return outstanding() < c.window; }))
+                lost += outstanding();
+        }
+
+        const uint32_t n32 = seq;
+        const auto sent = now_ns();
+        std::memcpy(&data[0], &id, sizeof(id));
+        std::memcpy(&data[4], &n32, sizeof(n32));
+        std::memcpy(&data[8], &sent, sizeof(sent));
+
+        while(true)
+        {
+            auto r = src.send(s->to, data, s->how.robust);
+            if(r == n::send_queued) break;
+            if(r == n::send_dropped) 
+            {
+                s->dropped++;
+                lost++;
+                break;
+            }
+            s->would_block++;
+            std::this_thread::yield();
+        }
     }
+}
+catch(std::exception& e)
+{
+    LOG << "error sending messages: " << e.what() << std::endl;
+}
+catch(...)
+{
+    LOG << "unknown error sending messages" << std::endl;
+}
 
-    Botan::LibraryInitializer init;
+void receiver(run_state* s)
+try
+{
+    REQUIRE(s);
+
+    n::endpoint ep;
+    u::bytes data;
+    while(s->dst->receive(ep, data, true))
+    {
+        const auto now = now_ns();
+        if(data.size() < HEADER_SIZE) continue;
 
-    auto iterations = vm["messages"].as<int>();
-    auto total_iterations = iterations;
-    auto robust = vm["robust"].as<bool>();
-    size_t bytes_per_message = vm["size"].as<int>();
+        uint32_t id;
+        uint32_t seq;
+        uint64_t sent;
+        std::memcpy(&id, &data[0], sizeof(id));
+        std::memcpy(&seq, &data[4], sizeof(seq));
+        std::memcpy(&sent, &data[8], sizeof(sent));
+        if(id >= s->seen.size() || seq >= s->seen[id].size()) continue;
 
-    n::connection_manager src{POOL_SIZE, static_cast<n::port_type>(SRC_PORT)};
-    n::connection_manager dst{POOL_SIZE, static_cast<n::port_type>(DST_PORT)};
+        CHECK_EQUAL(data.size(), s->size);
 
+        //robust messages can arrive again when an ack was lost
+        if(s->seen[id][seq])
+        {
+            s->duplicates++;
+            continue;
+        }
+        s->seen[id][seq] = true;
 
-    auto data = u::to_bytes(std::string(bytes_per_message, 'm'));
+        s->latency.record(now > sent ? now - sent : 0);
+        {
+            std::lock_guard<std::mutex> l(s->mutex);
+            s->received[id]++;
+            s->total_received++;
+            s->last_received = steady::now();
+        }
+        s->progress.notify_all();
+    }
+}
+catch(std::exception& e)
+{
+    LOG << "error getting messages: " << e.what() << std::endl;
+}
+catch(...)
+{
+    LOG << "unknown error getting messages" << std::endl;
+}
+
+void add_stats(n::udp_stats& total, const n::udp_stats& s)
+{
+    total.dropped += s.dropped;
+    total.bytes_sent += s.bytes_sent;
+    total.bytes_recv += s.bytes_recv;
+    total.packets_sent += s.packets_sent;
+    total.packets_recv += s.packets_recv;
+    total.send_calls += s.send_calls;
+    total.recv_calls += s.recv_calls;
+    total.retransmits += s.retransmits;
+    total.acks_sent += s.acks_sent;
+    total.acks_recv += s.acks_recv;
+    total.parity_sent += s.parity_sent;
+    total.fec_recovered += s.fec_recovered;
+    total.simulated_drops += s.simulated_drops;
+    total.bundled += s.bundled;
+}
 
-    u::bytes got_data;
+result run(const config& c, const mode& how, size_t size, n::port_type& port)
+{
+    REQUIRE_GREATER(c.senders, 0);
+    REQUIRE_GREATER(c.window, 0);
 
+    //on the loopback network the link simulates the loss instead
+    n::loopback_network_ptr network;
+    if(c.loopback) network = std::make_shared<n::loopback_network>(c.link);
+    auto transports = [&](n::port_type p, const n::queue_options& o)
+    {
+        return c.loopback ? 
+            n::loopback_transports(network, "localhost", p) : 
+            n::os_transports(POOL_SIZE, p, true, o);
+    };
+
+    //every run gets its own ports so nothing is left over from the last
+    run_state s;
+    s.c = &c;
+    s.how = how;
+    s.size = std::max(size, HEADER_SIZE);
+    s.to = n::make_address_str(n::endpoint{how.protocol, "localhost", port});
+    s.dst.reset(new n::connection_manager{transports(port++, c.dst_udp_options)});
+    for(size_t i = 0; i < c.senders; i++)
+        s.srcs.emplace_back(new n::connection_manager{transports(port++, c.src_udp_options)});
+    s.received.resize(c.senders);
+    s.seen.assign(c.senders, std::vector<bool>(c.messages));
+
+    //let connections and the path mtu probe finish before measuring
     n::endpoint ep;
+    u::bytes got;
+    for(auto& src : s.srcs) src->send(s.to, u::to_bytes("warmup"), true);
+    for(size_t i = 0; i < s.srcs.size(); i++) s.dst->receive(ep, got, true);
+    u::sleep_thread(THREAD_SLEEP);
+
+    const auto allocations_start = p::allocations();
+    const auto cpu_start = cpu_seconds();
+    const auto start = steady::now();
+    s.last_received = start;
+
+    u::thread_uptr receive_thread{new std::thread{receiver, &s}};
+    std::vector<u::thread_uptr> send_threads;
+    for(size_t i = 0; i < c.senders; i++)
+        send_threads.emplace_back(new std::thread{sender, &s, i});
+    for(auto& t : send_threads) t->join();
+
+    //wait for the rest to arrive until nothing shows up for a timeout
+    steady::time_point end;
+    {
+        const auto expected = c.messages * c.senders - s.dropped;
+        std::unique_lock<std::mutex> l(s.mutex);
+        while(s.total_received < expected)
+        {
+            const auto before = s.total_received;
+            s.progress.wait_for(l, c.timeout);
+            if(s.total_received == before) break;
+        }
+        end = s.last_received;
+    }
+
+    result r;
+    r.cpu_seconds = cpu_seconds() - cpu_start;
+    r.allocations = p::allocations() - allocations_start;
+
+    s.dst->done();
+    receive_thread->join();
+
+    r.how = how;
+    r.size = s.size;
+    r.senders = c.senders;
+    r.window = c.window;
+    r.sent = c.messages * c.senders;
+    r.delivered = s.total_received;
+    r.duplicates = s.duplicates;
+    r.would_block = s.would_block;
+    r.dropped = s.dropped;
+    r.seconds = std::chrono::duration<double>(end - start).count();
+    r.latency = s.latency;
+
+    for(const auto& src : s.srcs) add_stats(r.src_stats, src->get_udp_stats());
+    const auto first = s.srcs.front()->get_udp_stats();
+    r.src_stats.cwnd = first.cwnd;
+    r.src_stats.srtt = first.srtt;
+    r.src_stats.rto = first.rto;
+    r.src_stats.packet_size = first.packet_size;
+    r.dst_stats = s.dst->get_udp_stats();
+
+    return r;
+}
+
+double per_message(double v, const result& r)
+{
+    return r.delivered > 0 ? v / r.delivered : 0.0;
+}
 
-    auto start = std::chrono::high_resolution_clock::now();
-    while(iterations)
-    try
+void print_text(std::ostream& o, const result& r)
+{
+    const auto bytes = r.delivered * r.size;
+    const auto& src_stats = r.src_stats;
+    const auto& dst_stats = r.dst_stats;
+
+    o << "mode: " << r.how.name << " size: " << r.size << " senders: " << r.senders << " window: " << r.window << std::endl;
+    o << "messages: " << r.sent << " time: " << r.seconds << "s" << std::endl;
+    o << "delivered: " << r.delivered << "/" << r.sent << " (" 
+        << (100.0 * r.delivered / r.sent) << "%)" << std::endl;
+    o << "messages per sec: " << (r.seconds > 0 ? r.delivered / r.seconds : 0) << std::endl;
+    o << "kb per sec: " << (r.seconds > 0 ? (bytes / 1024) / r.seconds : 0) << std::endl;
+    o << "latency us p50: " << r.latency.percentile(50) / 1000.0 
+        << " p90: " << r.latency.percentile(90) / 1000.0 
+        << " p99: " << r.latency.percentile(99) / 1000.0 
+        << " p999: " << r.latency.percentile(99.9) / 1000.0 
+        << " max: " << r.latency.max() / 1000.0 << std::endl;
+    o << "cpu/message: " << per_message(r.cpu_seconds * 1000000, r) << "us" << std::endl;
+    o << "allocations/message: " << per_message(r.allocations, r) << std::endl;
+    o << "duplicates: " << r.duplicates << " would block: " << r.would_block << " dropped: " << r.dropped << std::endl;
+
+    if(r.how.protocol == n::UDP)
     {
-        src.send(DST_ADDR, data, robust);
-        while(!dst.receive(ep, got_data)); //spin until we get something
+        auto packets_per_send = src_stats.send_calls > 0 ? 
+            static_cast<double>(src_stats.packets_sent) / src_stats.send_calls : 0.0;
+        auto packets_per_recv = dst_stats.recv_calls > 0 ? 
+            static_cast<double>(dst_stats.packets_recv) / dst_stats.recv_calls : 0.0;
+        o << "udp packets sent: " << src_stats.packets_sent << " in " << src_stats.send_calls << " syscalls" << std::endl;
+        o << "udp packets recv: " << dst_stats.packets_recv << " in " << dst_stats.recv_calls << " syscalls" << std::endl;
+        o << "packets/send syscall: " << packets_per_send << std::endl;
+        o << "packets/recv syscall: " << packets_per_recv << std::endl;
+        o << "retransmits: " << src_stats.retransmits << std::endl;
+        o << "acks sent: " << dst_stats.acks_sent << " for " << dst_stats.packets_recv << " packets" << std::endl;
+        o << "cwnd: " << src_stats.cwnd << " chunks" << std::endl;
+        o << "srtt: " << src_stats.srtt << "ms rto: " << src_stats.rto << "ms" << std::endl;
+        o << "packet size: " << src_stats.packet_size << " bytes" << std::endl;
+        o << "bundled frames: " << src_stats.bundled << " sent " << dst_stats.bundled << " acked" << std::endl;
 
-        CHECK(got_data == data);
-        iterations--;
+        auto data_packets = src_stats.packets_sent + src_stats.simulated_drops - src_stats.parity_sent;
+        auto fec_overhead = data_packets > 0 ? 
+            static_cast<double>(src_stats.parity_sent) / data_packets : 0.0;
+        o << "simulated drops: " << src_stats.simulated_drops << std::endl;
+        o << "fec parity sent: " << src_stats.parity_sent << " overhead: " << (100.0 * fec_overhead) << "%" << std::endl;
+        o << "fec chunks recovered: " << dst_stats.fec_recovered << std::endl;
     }
-    catch(std::exception& e)
+    o << std::endl;
+}
+
+void print_json(std::ostream& o, const results& rs)
+{
+    o << "{\"runs\": [";
+    bool first = true;
+    for(const auto& r : rs)
     {
-        LOG << "error getting message: " << e.what() << std::endl;
+        if(!first) o << ",";
+        first = false;
+
+        o << "\n  {\"mode\": \"" << r.how.name << "\""
+            << ", \"protocol\": \"" << r.how.protocol << "\""
+            << ", \"robust\": " << (r.how.robust ? "true" : "false")
+            << ", \"size\": " << r.size
+            << ", \"senders\": " << r.senders
+            << ", \"window\": " << r.window
+            << ", \"sent\": " << r.sent
+            << ", \"delivered\": " << r.delivered
+            << ", \"duplicates\": " << r.duplicates
+            << ", \"seconds\": " << r.seconds
+            << ", \"messages_per_sec\": " << (r.seconds > 0 ? r.delivered / r.seconds : 0)
+            << ", \"latency_ns\": {"
+                << "\"min\": " << r.latency.min()
+                << ", \"mean\": " << r.latency.mean()
+                << ", \"p50\": " << r.latency.percentile(50)
+                << ", \"p90\": " << r.latency.percentile(90)
+                << ", \"p99\": " << r.latency.percentile(99)
+                << ", \"p999\": " << r.latency.percentile(99.9)
+                << ", \"max\": " << r.latency.max() << "}"
+            << ", \"cpu_us_per_message\": " << per_message(r.cpu_seconds * 1000000, r)
+            << ", \"allocations_per_message\": " << per_message(r.allocations, r)
+            << ", \"would_block\": " << r.would_block
+            << ", \"dropped\": " << r.dropped
+            << ", \"udp\": {"
+                << "\"packets_sent\": " << r.src_stats.packets_sent
+                << ", \"packets_recv\": " << r.dst_stats.packets_recv
+                << ", \"send_calls\": " << r.src_stats.send_calls
+                << ", \"recv_calls\": " << r.dst_stats.recv_calls
+                << ", \"retransmits\": " << r.src_stats.retransmits
+                << ", \"simulated_drops\": " << r.src_stats.simulated_drops
+                << ", \"parity_sent\": " << r.src_stats.parity_sent
+                << ", \"fec_recovered\": " << r.dst_stats.fec_recovered << "}}";
     }
-    catch(...)
+    o << "\n]}" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    auto desc = create_descriptions();
+    auto vm = parse_options(argc, argv, desc);
+    if(vm.count("help"))
     {
-        LOG << "unknown error getting message: " << std::endl;
+        std::cout << desc << std::endl;
+        return 1;
     }
 
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end-start).count();
-    auto sec = duration / 1000000000.0;
-    auto total_bytes_sent = total_iterations * data.size();
-    auto time_per_byte = duration / total_bytes_sent;
-    auto kb_per_sec = (total_bytes_sent/1024) / sec;
-    auto time_per_message = (duration / total_iterations) / 1000000.0;
-    std::cout << "messages: " << total_iterations << " time: " << sec << "s" << std::endl;
-    std::cout << "bytes per message: " << bytes_per_message << std::endl;
-    std::cout << "sent bytes: " << total_bytes_sent<< std::endl;
-    std::cout << "kb per sec: " << kb_per_sec << std::endl;
-    std::cout << "time/byte: " << time_per_byte << "ns" << std::endl;
-    std::cout << "time/message: " << time_per_message << "ms" << std::endl;
+    Botan::LibraryInitializer init;
+
+    auto fec = vm["fec"].as<int>();
+    auto loss = vm["loss"].as<double>();
+    auto bundle_delay = boost::lexical_cast<std::string>(vm["bundle-delay"].as<double>());
+    auto json = vm["json"].as<std::string>();
 
+    config c;
+    c.messages = vm["messages"].as<int>();
+    c.senders = vm["senders"].as<int>();
+    c.window = vm["window"].as<int>();
+    c.timeout = std::chrono::milliseconds(vm["timeout"].as<int>());
+    c.loopback = vm["loopback"].as<bool>();
+    c.link.latency = vm["latency"].as<double>();
+    c.link.jitter = vm["jitter"].as<double>();
+    c.link.loss = loss;
+    c.link.reorder = vm["reorder"].as<double>();
+    c.link.bandwidth = vm["bandwidth"].as<double>();
+
+    //loss is simulated on the sending side only
+    c.src_udp_options = {
+        {"fec", boost::lexical_cast<std::string>(fec)},
+        {"loss", boost::lexical_cast<std::string>(loss)},
+        {"bundle_delay", bundle_delay}};
+    c.dst_udp_options = {{"bundle_delay", bundle_delay}};
+
+    if(c.messages == 0 || c.senders == 0 || c.window == 0)
+    {
+        std::cerr << "messages, senders and window must be more than 0" << std::endl;
+        return 1;
+    }
+
+    results rs;
+    auto port = FIRST_PORT;
+    for(const auto& how : parse_modes(vm))
+        for(auto size : parse_sizes(vm))
+        {
+            rs.emplace_back(run(c, how, size, port));
+            if(json != "-") print_text(std::cout, rs.back());
+        }
+
+    if(json == "-") print_json(std::cout, rs);
+    else if(!json.empty())
+    {
+        std::ofstream o{json};
+        print_json(o, rs);
+    }
 }
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+
+#include "fireperf/histogram.hpp"
+
+#include "util/dbc.hpp"
+
+#include <algorithm>
+
+namespace fire
+{
+    namespace perf
+    {
+        namespace
+        {
+            const size_t SUB_BITS = 5;
+            const uint64_t SUB_BUCKETS = 1 << SUB_BITS;
+            const uint64_t EXACT = 2 * SUB_BUCKETS;
+            const size_t BUCKETS = EXACT + (64 - SUB_BITS - 1) * SUB_BUCKETS;
+
+            size_t top_bit(uint64_t v)
+            {
+                size_t b = 0;
+                while(v >>= 1) b++;
+                return b;
+            }
+
+            size_t bucket_for(uint64_t v)
+            {
+                if(v < EXACT) return v;
+
+                const auto b = top_bit(v);
+                const auto shift = b - SUB_BITS;
+                return EXACT + (b - SUB_BITS - 1) * SUB_BUCKETS + ((v >> shift) - SUB_BUCKETS);
+            }
+
+            //middle of the values a bucket holds
+            uint64_t value_for(size_t i)
+            {
+                if(i < EXACT) return i;
+
+                const auto b = (i - EXACT) / SUB_BUCKETS + SUB_BITS + 1;
+                const auto shift = b - SUB_BITS;
+                const auto low = (SUB_BUCKETS + (i - EXACT) % SUB_BUCKETS) << shift;
+                return low + ((uint64_t{1} << shift) >> 1);
+            }
+        }
+
+        histogram::histogram() : _buckets(BUCKETS) {}
+
+        void histogram::record(uint64_t v)
+        {
+            const auto i = bucket_for(v);
+            CHECK_LESS(i, _buckets.size());
+
+            _buckets[i]++;
+            _min = _count == 0 ? v : std::min(_min, v);
+            _max = std::max(_max, v);
+            _sum += v;
+            _count++;
+        }
+
+        void histogram::merge(const histogram& o)
+        {
+            REQUIRE_EQUAL(_buckets.size(), o._buckets.size());
+            if(o._count == 0) return;
+
+            for(size_t i = 0; i < _buckets.size(); i++) _buckets[i] += o._buckets[i];
+            _min = _count == 0 ? o._min : std::min(_min, o._min);
+            _max = std::max(_max, o._max);
+            _sum += o._sum;
+            _count += o._count;
+        }
+
+        uint64_t histogram::count() const
+        {
+            return _count;
+        }
+
+        uint64_t histogram::min() const
+        {
+            return _min;
+        }
+
+        uint64_t histogram::max() const
+        {
+            return _max;
+        }
+
+        double histogram::mean() const
+        {
+            return _count > 0 ? _sum / _count : 0;
+        }
+
+        uint64_t histogram::percentile(double p) const
+        {
+            REQUIRE_BETWEEN(p, 0, 100);
+            if(_count == 0) return 0;
+
+            //rank of the value, counted from one
+            const auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(p / 100.0 * _count + 0.5));
+
+            uint64_t seen = 0;
+            for(size_t i = 0; i < _buckets.size(); i++)
+            {
+                seen += _buckets[i];
+                if(seen >= rank) return std::min(std::max(value_for(i), _min), _max);
+            }
+            return _max;
+        }
+    }
+}
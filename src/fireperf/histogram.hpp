@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+#ifndef FIRESTR_PERF_HISTOGRAM_H
+#define FIRESTR_PERF_HISTOGRAM_H
+
+#include <cstdint>
+#include <vector>
+
+namespace fire
+{
+    namespace perf
+    {
+        //counts values in buckets that grow with the value like an HDR
+        //histogram. Values below 64 are exact, above that each power of
+        //two is split in 32 buckets, so a bucket is within about 3% of
+        //the values it holds.
+        class histogram
+        {
+            public:
+                histogram();
+
+            public:
+                void record(uint64_t v);
+                void merge(const histogram&);
+
+                uint64_t count() const;
+                uint64_t min() const;
+                uint64_t max() const;
+                double mean() const;
+
+                //value at or below which p percent of the values are
+                uint64_t percentile(double p) const;
+
+            private:
+                std::vector<uint64_t> _buckets;
+                uint64_t _count = 0;
+                uint64_t _min = 0;
+                uint64_t _max = 0;
+                double _sum = 0;
+        };
+    }
+}
+
+#endif
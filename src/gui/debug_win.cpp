@@ -173,7 +173,7 @@ namespace fire
                 m::post_office_ptr p,
                 us::user_service_ptr us, 
                 s::conversation_service_ptr ss, 
-                const n::udp_stats& udps,
+                udp_stats_getter udps,
                 QWidget* parent) :
             QDialog{parent},
             _post{p},
@@ -184,6 +184,7 @@ namespace fire
             REQUIRE(p);
             REQUIRE(us);
             REQUIRE(ss);
+            REQUIRE(_udp_stats);
 
             //main layout
             auto* layout = new QVBoxLayout{this};
@@ -280,20 +281,26 @@ namespace fire
             INVARIANT(_udp_stat_text);
             std::stringstream s;
 
+            const auto udps = _udp_stats();
+
             double bytes_sent_per_second = 
-                (_udp_stats.bytes_sent - _prev_udp_stats.bytes_sent) * GRAPH_UPDATES_PER_SECOND;
+                (udps.bytes_sent - _prev_udp_stats.bytes_sent) * GRAPH_UPDATES_PER_SECOND;
 
             double bytes_recv_per_second = 
-                (_udp_stats.bytes_recv - _prev_udp_stats.bytes_recv) * GRAPH_UPDATES_PER_SECOND;
+                (udps.bytes_recv - _prev_udp_stats.bytes_recv) * GRAPH_UPDATES_PER_SECOND;
 
             double dropped_per_second = 
-                (_udp_stats.dropped - _prev_udp_stats.dropped) * GRAPH_UPDATES_PER_SECOND;
-
-            s << " sent: " << (_udp_stats.bytes_sent / 1024) << "kb (" << (bytes_sent_per_second / 1024) << "/s)" 
-              << " recv: " << (_udp_stats.bytes_recv / 1024) << " kb (" << (bytes_recv_per_second / 1024) << "/s)"
-              << " dropped: " << _udp_stats.dropped << " (" << dropped_per_second << "/s)";
+                (udps.dropped - _prev_udp_stats.dropped) * GRAPH_UPDATES_PER_SECOND;
+
+            s << " sent: " << (udps.bytes_sent / 1024) << "kb (" << (bytes_sent_per_second / 1024) << "/s)" 
+              << " recv: " << (udps.bytes_recv / 1024) << " kb (" << (bytes_recv_per_second / 1024) << "/s)"
+              << " dropped: " << udps.dropped << " (" << dropped_per_second << "/s)"
+              << " resent: " << udps.retransmits
+              << " cwnd: " << udps.cwnd
+              << " srtt: " << udps.srtt << "ms"
+              << " rto: " << udps.rto << "ms";
             _udp_stat_text->setText(s.str().c_str());
-            _prev_udp_stats = _udp_stats;
+            _prev_udp_stats = udps;
         }
 
         void debug_win::update_log()
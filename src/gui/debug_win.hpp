@@ -40,6 +40,7 @@
 #include "gui/list.hpp"
 
 #include <fstream>
+#include <functional>
 #include <set>
 
 #include <QDialog>
@@ -85,6 +86,7 @@ namespace fire
         };
 
         using added_mailboxes = std::set<std::string>;
+        using udp_stats_getter = std::function<network::udp_stats()>;
 
         class debug_win : public QDialog
         {
@@ -94,7 +96,7 @@ namespace fire
                         fire::message::post_office_ptr,
                         user::user_service_ptr, 
                         conversation::conversation_service_ptr, 
-                        const network::udp_stats&,
+                        udp_stats_getter,
                         QWidget* parent = nullptr);
 
             public slots:
@@ -124,7 +126,7 @@ namespace fire
                 conversation::conversation_service_ptr _conversation_service;
 
                 //stats
-                const network::udp_stats& _udp_stats;
+                udp_stats_getter _udp_stats;
                 network::udp_stats _prev_udp_stats;
         };
     }
@@ -740,11 +740,17 @@ namespace fire
             REQUIRE(_user_service);
             REQUIRE(_conversation_service);
 
+            auto master = _master;
             auto db = new debug_win{
                 _master,
                 _user_service, 
                 _conversation_service, 
-                dynamic_cast<m::master_post_office*>(_master.get())->get_udp_stats()};
+                [master]() 
+                { 
+                    auto mp = dynamic_cast<m::master_post_office*>(master.get());
+                    CHECK(mp);
+                    return mp->get_udp_stats(); 
+                }};
             db->setAttribute(Qt::WA_DeleteOnClose);
             db->show();
             db->raise();
@@ -47,9 +47,6 @@ namespace fire
 
         namespace
         {
-            const double MIN_THREAD_SLEEP = 1; //in milliseconds 
-            const double MAX_THREAD_SLEEP = 51; //in milliseconds 
-            const double SLEEP_STEP = 5;
             const double QUIT_SLEEP = 500;
             const size_t POOL_SIZE = 30; //small pool size for now
         }
@@ -73,21 +70,13 @@ namespace fire
             REQUIRE(o);
             REQUIRE(o->_encrypted_channels);
 
-            double thread_sleep = MIN_THREAD_SLEEP;
-
             n::endpoint ep;
             while(!o->_done)
             try
             {
-                //get data from outside world
+                //get data from outside world, waits until something arrives
                 u::bytes data;
-                if(!o->_connections.receive(ep, data))
-                {
-                    u::sleep_thread(thread_sleep);
-                    thread_sleep = std::min(MAX_THREAD_SLEEP, thread_sleep + SLEEP_STEP);
-                    continue;
-                }
-                thread_sleep = MIN_THREAD_SLEEP;
+                if(!o->_connections.receive(ep, data, true)) continue;
 
                 if(o->_outside_stats.on) o->_outside_stats.in_push_count++;
 
@@ -106,13 +95,14 @@ namespace fire
                 //unable to decompress, skip
                 if(data.empty()) continue;
 
+                //skip bad message before decoding all of it
+                const auto to = peek_to(data);
+                if(!to.is_array() || to.size() == 0) continue;
+
                 //parse message
                 message m;
                 u::decode(data, m);
 
-                //skip bad message
-                if(m.meta.to.empty()) continue;
-
                 //insert the from_ip, from_port and other metadata
                 m.meta.extra["from_protocol"] = ep.protocol;
                 m.meta.extra["from_ip"] = ep.address;
@@ -207,7 +197,9 @@ namespace fire
                         *o->_encrypted_channels);
 
                 //send message over wire
-                o->_connections.send(outside_queue_address, data, m.meta.robust);
+                auto sent = o->_connections.send(outside_queue_address, data, m.meta.robust);
+                if(sent == n::send_would_block)
+                    LOG << "dropped message to " << outside_queue_address << ", too many waiting to be sent" << std::endl;
 
                 if(o->_outside_stats.on) o->_outside_stats.out_pop_count++;
             }
@@ -229,10 +221,11 @@ namespace fire
         master_post_office::master_post_office(
                 const std::string& in_host,
                 n::port_type in_port,
-                sc::encrypted_channels_ptr sl) : 
+                sc::encrypted_channels_ptr sl,
+                const n::transport_factory& transports) : 
             _in_host(in_host),
             _in_port{in_port},
-            _connections{POOL_SIZE, in_port, false},
+            _connections{transports ? transports : n::os_transports(POOL_SIZE, in_port, false)},
             _encrypted_channels{sl}
         {
             _address = n::make_udp_address(_in_host,_in_port);
@@ -251,6 +244,7 @@ namespace fire
             INVARIANT(_out_thread);
 
             _done = true;
+            _connections.done();
             _out.done();
             _in_thread->join();
             _out_thread->join();
@@ -263,7 +257,7 @@ namespace fire
             return true;
         }
 
-        const network::udp_stats& master_post_office::get_udp_stats() const
+        network::udp_stats master_post_office::get_udp_stats() const
         {
             return _connections.get_udp_stats();
         }
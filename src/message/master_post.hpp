@@ -51,11 +51,12 @@ namespace fire
                 master_post_office(
                         const std::string& in_host,
                         network::port_type in_port,
-                        security::encrypted_channels_ptr);
+                        security::encrypted_channels_ptr,
+                        const network::transport_factory& transports = network::transport_factory{});
                 virtual ~master_post_office();
 
             public:
-                const network::udp_stats& get_udp_stats() const;
+                network::udp_stats get_udp_stats() const;
 
             protected:
                 virtual bool send_outside(const message&);
@@ -39,30 +39,8 @@ namespace fire
     {
         std::ostream& operator<<(std::ostream& o, const message& m)
         {
-            const metadata& meta = m.meta;
-
-            //write out type
-            util::bytes mt = util::to_bytes(meta.type);
-            o << mt;
-
-            //write out extra metadata.
-            //we encode it into a byte string so we can 
-            //skip quickly
-            std::stringstream ms;
-
-            util::array to;
-            for(auto s: meta.to) to.add(s);
-
-            util::array from;
-            for(auto s: meta.from) from.add(s);
-
-            ms << to << from << meta.extra;
-            util::bytes mb = util::to_bytes(ms.str());
-            o << mb;
-
-            //write out data
-            o << m.data;
-
+            const auto b = util::encode(m);
+            o.write(b.data(), b.size());
             return o;
         }
 
@@ -92,6 +70,18 @@ namespace fire
             return i;
         }
 
+        util::value_view peek_to(const util::bytes& b)
+        {
+            util::decoder d{b};
+
+            //skip type
+            d.skip();
+
+            const auto mb = d.next_bytes_view();
+            util::decoder md{mb.data, mb.data + mb.size};
+            return md.next_view();
+        }
+
         std::string external_address(const std::string& host, const std::string& port)
         {
             return "udp://" + host + ":" + port;
@@ -171,6 +161,84 @@ namespace fire
     }
 }
 
+namespace fire
+{
+    namespace util
+    {
+        namespace
+        {
+            size_t address_size(const message::address& a)
+            {
+                size_t n = 2;
+                for(const auto& s : a) n += encoded_size(s);
+                return n;
+            }
+
+            void put_address(encoder& e, const message::address& a)
+            {
+                e.begin_array();
+                for(const auto& s : a) e.put(s);
+                e.end();
+            }
+        }
+
+        template<>
+            bytes encode<message::message>(const message::message& m)
+            {
+                const auto& meta = m.meta;
+
+                //extra metadata is a byte string so it can be skipped 
+                //quickly. It is sized first and written in place.
+                const auto meta_size = 
+                    address_size(meta.to) + 
+                    address_size(meta.from) + 
+                    encoded_size(meta.extra);
+
+                bytes b(
+                        encoded_size(meta.type) + 
+                        encoded_bytes_size(meta_size) + 
+                        encoded_size(m.data));
+
+                encoder e{b};
+                e.put(meta.type);
+
+                e.put_bytes_prefix(meta_size);
+                put_address(e, meta.to);
+                put_address(e, meta.from);
+                e.put(meta.extra);
+
+                e.put(m.data);
+
+                ENSURE(e.done());
+                return b;
+            }
+
+        template<>
+            void decode<message::message>(const bytes& b, message::message& m)
+            {
+                auto& meta = m.meta;
+                decoder d{b};
+
+                //read type
+                const auto type = d.next_bytes_view();
+                meta.type.assign(type.data, type.size);
+
+                //read extra metadata without copying it out first
+                const auto mb = d.next_bytes_view();
+                decoder md{mb.data, mb.data + mb.size};
+                const auto to = md.next_array();
+                const auto from = md.next_array();
+                meta.extra = md.next_dict();
+
+                for(const auto& s : to) meta.to.push_back(s.as_string());
+                for(const auto& s : from) meta.from.push_back(s.as_string());
+
+                //read data
+                m.data = d.next_bytes();
+            }
+    }
+}
+
 namespace std
 {
         std::ostream& operator<<(std::ostream& o, fire::message::address a)
@@ -67,6 +67,10 @@ namespace fire
         std::ostream& operator<<(std::ostream&, const message&);
         std::istream& operator>>(std::istream&, message&);
 
+        //the to array of an encoded message read in place, without 
+        //decoding the rest of the message
+        util::value_view peek_to(const util::bytes&);
+
         std::string external_address(const std::string& host, const std::string& port);
         std::string external_address(const std::string& host_port);
 
@@ -134,6 +138,18 @@ namespace fire
 
 }
 
+namespace fire
+{
+    namespace util
+    {
+        //writes a message straight into one buffer instead of through a stream
+        template<> bytes encode<message::message>(const message::message&);
+
+        //reads a message straight out of the buffer instead of through a stream
+        template<> void decode<message::message>(const bytes&, message::message&);
+    }
+}
+
 namespace std
 {
     std::ostream& operator<<(std::ostream&, fire::message::address);
@@ -78,6 +78,13 @@ namespace fire
             p.block = get_opt(o, "block", 0);
             p.wait = get_opt(o, "wait", 0);
             p.track_incoming = get_opt(o, "track_incoming", 0);
+            p.batch_io = get_opt(o, "batch_io", 0);
+            p.fec_group = get_opt(o, "fec", 0);
+            p.loss = get_opt(o, "loss", 0.0);
+            p.bundle_delay = get_opt(o, "bundle_delay", 0.0);
+            p.write_cap = get_opt(o, "write_cap", 0);
+            p.write_delay = get_opt(o, "write_delay", 0.0);
+            p.shards = get_opt(o, "shards", 1);
 
             return p;
         }
@@ -36,6 +36,8 @@
 #include "network/message_queue.hpp"
 #include "util/thread.hpp"
 
+#include <memory>
+
 namespace fire
 {
     namespace network
@@ -55,6 +57,13 @@ namespace fire
             bool block;
             double wait;
             bool track_incoming;
+            bool batch_io;
+            size_t fec_group; //data chunks per parity chunk for unreliable messages, 0 is off
+            double loss; //percent of outgoing datagrams to drop, for testing
+            double bundle_delay; //in microseconds small udp frames wait to share a datagram
+            size_t write_cap; //bytes gathered into one tcp write, 0 is the default
+            double write_delay; //in microseconds a new tcp write waits for more messages
+            size_t shards; //udp sockets sharing the port, each read by its own thread
         };
 
         class connection
@@ -63,7 +72,10 @@ namespace fire
             virtual bool send(const fire::util::bytes& b, bool block = false) = 0;
             virtual endpoint get_endpoint() const = 0;
             virtual bool is_disconnected() const = 0;
+            virtual size_t backlog() const = 0; //messages waiting to be sent
         };
+        using connection_ptr = std::shared_ptr<connection>;
+        using connection_wptr = std::weak_ptr<connection>;
 
         asio_params parse_params(const address_components& c);
         asio_params::endpoint_type determine_type(const std::string& address);
@@ -30,417 +30,131 @@
  */
 
 #include "network/connection_manager.hpp"
+#include "network/tcp_transport.hpp"
+#include "network/udp_transport.hpp"
 
 #include "util/dbc.hpp"
 #include "util/log.hpp"
 
-#include <boost/lexical_cast.hpp>
-
 namespace u = fire::util;
 
 namespace fire
 {
     namespace network
     {
-        void tcp_send_thread(connection_manager*);
-
-        connection_manager::connection_manager(size_t size, port_type local_port, bool tcp_listen) :
-            _rstate{receive_state::IN_UDP1},
-            _pool(size),
-            _local_port{local_port},
-            _tcp_listen{tcp_listen},
-            _done{false}
-        {
-            teardown_and_repool_tcp_connections();
-            create_udp_endpoint();
-
-            _tcp_send_thread.reset(new std::thread{tcp_send_thread, this});
-
-            ENSURE_FALSE(_pool.empty());
-            ENSURE(!_tcp_listen || _in);
-            ENSURE(_udp_con);
-            ENSURE(_tcp_send_thread);
-        }
-
-        connection_manager::~connection_manager()
+        transport_factory os_transports(
+                size_t size, 
+                port_type local_port, 
+                bool tcp_listen, 
+                const queue_options& udp_options)
         {
-            _done = true;
-            _tcp_send_queue.done();
-            if(_tcp_send_thread) _tcp_send_thread->join();
-        }
-
-        void connection_manager::create_udp_endpoint()
-        {
-            //create listen socket
-            asio_params udp_p = {
-                asio_params::udp, 
-                asio_params::bind, 
-                "", //uri
-                "", //host
-                0, //port
-                _local_port,
-                false, //block;
-                0, // wait;
-                true, //track_incoming;
-            };
-            _udp_con = create_udp_queue(udp_p);
-        }
-        void connection_manager::create_tcp_endpoint()
-        {
-            REQUIRE_FALSE(_in);
-            REQUIRE_GREATER(_local_port, 0);
-
-            auto listen_address = make_tcp_address("*", _local_port);
-
-            queue_options qo = { 
-                {"bnd", "1"},
-                {"block", "0"},
-                {"track_incoming", "1"}};
-
-            _in = create_tcp_queue(listen_address, qo);
-            ENSURE(_in);
-        }
-
-        asio_params connection_manager::create_tcp_params()
-        {
-            //create outgoing params
-            asio_params p = {
-                asio_params::tcp, 
-                asio_params::delayed_connect, 
-                "", //uri
-                "", //host
-                0, //port
-                _local_port,
-                false, //block;
-                0, // wait;
-                false, //track_incoming;
+            return [=](const std::string& protocol, inbound_queue* sink) -> transport_ptr
+            {
+                if(protocol == TCP) return std::make_shared<tcp_transport>(size, local_port, tcp_listen, sink);
+                if(protocol == UDP) return std::make_shared<udp_transport>(local_port, udp_options, sink);
+                return transport_ptr{};
             };
-            return p;
         }
 
-        void connection_manager::create_tcp_pool()
+        connection_manager::connection_manager(
+                size_t size, 
+                port_type local_port, 
+                bool tcp_listen, 
+                const queue_options& udp_options) :
+            connection_manager{os_transports(size, local_port, tcp_listen, udp_options)}
         {
-            auto par = create_tcp_params(); 
-            for(auto& p : _pool) p = std::make_shared<tcp_queue>(par);
         }
 
-        void connection_manager::cleanup_pool()
+        connection_manager::connection_manager(const transport_factory& make)
         {
-            //clean up disconnected connections
-            for(auto& p : _pool)
-                if(p && p->is_disconnected()) 
-                    p.reset();
-
-            auto i = _out.begin();
-            while(i != _out.end())
-            {
-                CHECK_RANGE(i->second, 0, _pool.size());
-                auto& p = _pool[i->second];
-                if(!p) i = _out.erase(i);
-                else i++;
-            }
-        }
+            REQUIRE(make);
 
-        void connection_manager::teardown_and_repool_tcp_connections()
-        {
-            LOG << "creating listening tcp connection and outgoing pool..." << std::endl;
-            _in.reset();
-            _in_connections.clear();
-
-            cleanup_pool();
-
-            if(_tcp_listen)
-            {
-#ifdef __APPLE__
-                create_tcp_endpoint();
-#endif
-                create_tcp_pool();
+            //tcp first so the outgoing pool can bind the port before udp
+            _tcp = make(TCP, &_inbound);
+            _udp = make(UDP, &_inbound);
 
-#ifndef __APPLE__
-                create_tcp_endpoint();
-#endif
-            }
+            ENSURE(_tcp);
+            ENSURE(_udp);
         }
 
-        tcp_queue_ptr connection_manager::get_connected_queue(const std::string& address)
+        connection_manager::~connection_manager()
         {
-            auto p = _out.find(address);
-            if(p != _out.end()) 
-            {
-                auto& c = _pool[p->second];
-                CHECK(c);
-                if(!c->is_disconnected()) 
-                    return c;
-            }
-
-            return tcp_queue_ptr{};
+            _inbound.done();
         }
 
-        size_t connection_manager::find_next_available()
+        transport* connection_manager::transport_for(const std::string& protocol) const
         {
-            size_t next_available = 0;
-            for(;next_available < _pool.size(); next_available++)
-            {
-                auto &p = _pool[next_available];
-                //skip connected connections
-                if(p) continue;
-
-                auto par = create_tcp_params(); 
-                p = std::make_shared<tcp_queue>(par);
-                break;
-            }
-
-            ENSURE(next_available == _pool.size() || _pool[next_available]);
-            return next_available;
+            if(protocol == TCP) return _tcp.get();
+            if(protocol == UDP) return _udp.get();
+            return nullptr;
         }
 
-        tcp_queue_ptr connection_manager::connect(const std::string& address)
+        send_result connection_manager::send(const std::string& to, const u::bytes& b, bool robust)
         try
         {
-            auto next_available = _pool.size();
-            {
-                u::mutex_scoped_lock l(_mutex);
-                auto q = get_connected_queue(address);
-                if(q) return q;
-                next_available = find_next_available();
-            }
-
-
-            //If we ran out of connections in the out pool then we tear down our tcp connections
-            //and repool. Obviously this algorithm won't work well if we have as many greeters
-            //as the pool size. Still figuring this out.
-            if(next_available >= _pool.size()) 
-            {
-                u::mutex_scoped_lock l(_mutex);
-                LOG << "ran out of outgoing tcp connections..." << std::endl;
-                teardown_and_repool_tcp_connections();
-                next_available = find_next_available();
-                if(next_available >= _pool.size()) 
-                {
-                    LOG << "unable to get tcp connection from the pool..." << std::endl;
-                    return tcp_queue_ptr{};
-                }
-            }
-
-            CHECK_RANGE(next_available, 0, _pool.size());
-            CHECK(_pool[next_available]);
-            CHECK(_pool[next_available]->is_disconnected());
-
-            //parse address to host, port
-            auto a = parse_address(address);
-
-            //assign address to socket and connect
-            {
-                u::mutex_scoped_lock l(_mutex);
-                _out[address] = next_available;
-            }
-            _pool[next_available]->connect(a.host, a.port);
-
-            ENSURE_BETWEEN(next_available, 0, _pool.size());
-            return _pool[next_available];
-        }
-        catch(std::exception& e)
-        {
-            LOG << "error connecting to `" << address << "'. " << e.what() << std::endl; 
-            return tcp_queue_ptr{};
-        }
-        catch(...)
-        {
-            LOG << "unknown error connecting to `" << address << "'." << std::endl; 
-            return tcp_queue_ptr{};
-        }
-
-        bool connection_manager::send(const std::string& to, const u::bytes& b, bool robust)
-        try
-        {
-            INVARIANT(_udp_con);
-
             auto type = determine_type(to);
 
-            //if tcp, then push it to the tcp send queue
-            //which is processed by another thread so that
-            //udp connections are not blocked by tcp
-            if(type == asio_params::tcp)
-            {
-                _tcp_send_queue.push({to, b});
-                return true;
-            } else if (type != asio_params::udp) return false;
-
-            CHECK(type == asio_params::udp);
-
-            auto a = parse_address(to);
-            endpoint ep { UDP, a.host, a.port};
-            endpoint_message em{ep, b, robust}; 
-            return _udp_con->send(em);
+            if(type == asio_params::tcp) return _tcp->send(to, b, robust);
+            else if(type == asio_params::udp) return _udp->send(to, b, robust);
+            return send_dropped;
         }
         catch(std::exception& e)
         {
             LOG << "error sending message to `" << to << "' (" << b.size() << " bytes). " << e.what() << std::endl; 
-            return false;
+            return send_dropped;
         }
         catch(...)
         {
             LOG << "unknown error sending message to `" << to << "' (" << b.size() << " bytes)." << std::endl; 
-            return false;
+            return send_dropped;
         }
 
-        void connection_manager::transition_udp_state()
+        bool connection_manager::receive(endpoint& ep, u::bytes& b, bool wait)
         {
-            REQUIRE(_rstate != IN_TCP);
-            REQUIRE(_rstate != OUT_TCP);
+            inbound_message m;
+            if(!_inbound.pop(m, wait)) return false;
 
-            auto ps = _rstate; 
-            switch(_rstate)
-            {
-                case receive_state::IN_UDP1: _rstate = receive_state::IN_UDP2; break;
-                case receive_state::IN_UDP2: _rstate = receive_state::IN_UDP3; break;
-                case receive_state::IN_UDP3: _rstate = receive_state::IN_UDP4; break;
-                case receive_state::IN_UDP4: _rstate = receive_state::IN_UDP5; break;
-                case receive_state::IN_UDP5: _rstate = receive_state::IN_UDP6; break;
-                case receive_state::IN_UDP6: _rstate = receive_state::IN_UDP7; break;
-                case receive_state::IN_UDP7: _rstate = receive_state::IN_UDP8; break;
-                case receive_state::IN_UDP8: 
-                                             _rstate = _tcp_listen ? receive_state::IN_TCP : receive_state::OUT_TCP;
-                                             break;
-                default: CHECK(false && "missed case");
-            }
+            auto t = transport_for(m.ep.protocol);
+            if(t) t->received(m);
 
-            ENSURE(ps != receive_state::IN_UDP8 || _rstate == receive_state::IN_TCP || _rstate == receive_state::OUT_TCP) 
-            ENSURE(_rstate != ps);
+            ep = std::move(m.ep);
+            b = std::move(m.data);
+            return true;
         }
 
-        bool connection_manager::receive(endpoint& ep, u::bytes& b)
+        void connection_manager::set_receive_weights(size_t udp, size_t tcp)
         {
-            //if we quite in prior call and got to done state
-            //or returned with a message in OUT_TCP case, we
-            //reset to IN_UPD and start over
-            if(_rstate == receive_state::DONE) 
-                _rstate = receive_state::IN_UDP1;
-
-            while(_rstate != receive_state::DONE)
-            {
-                switch(_rstate)
-                {
-                    case receive_state::IN_UDP1:
-                    case receive_state::IN_UDP2:
-                    case receive_state::IN_UDP3:
-                    case receive_state::IN_UDP4:
-                    case receive_state::IN_UDP5:
-                    case receive_state::IN_UDP6:
-                    case receive_state::IN_UDP7:
-                    case receive_state::IN_UDP8:
-                        {
-                            endpoint_message um;
-                            transition_udp_state();
-                            if(_udp_con->receive(um))
-                            {
-
-                                ep = um.ep;
-                                b = std::move(um.data);
-                                return true;
-                            }
-                        }
-                        break;
-
-                    case receive_state::IN_TCP:
-                        {
-                            _rstate = receive_state::OUT_TCP;
-                            u::mutex_scoped_lock l(_mutex);
-                            INVARIANT(_in);
-                            if(_in->receive(b)) 
-                            {
-                                auto s = _in->get_socket();
-                                CHECK(s);
-                                ep = s->get_endpoint();
-                                _in_connections[make_address_str(ep)] = s;
-                                return true;
-                            }
-                        }
-                        break;
-
-                    case receive_state::OUT_TCP:
-                        {
-                            _rstate = receive_state::DONE;
-                            u::mutex_scoped_lock l(_mutex);
-                            for(auto p : _out)
-                            {
-                                auto i = p.second;
-                                CHECK_RANGE(i, 0, _pool.size());
-
-                                auto c = _pool[i];
-                                CHECK(c);
-                                if(c->receive(b)) 
-                                {
-                                    auto s = c->get_socket();
-                                    CHECK(s);
-                                    ep = s->get_endpoint();
-                                    return true;
-                                }
-                            }
-                        }
-                        break;
-                    default: CHECK(false && "missed case");
-                }
-            }
+            REQUIRE_GREATER(udp, 0);
+            REQUIRE_GREATER(tcp, 0);
 
-            ENSURE(_rstate == receive_state::DONE);
-            return false;
+            _inbound.set_weight(udp_lane, udp);
+            _inbound.set_weight(tcp_lane, tcp);
         }
 
-        bool connection_manager::is_disconnected(const std::string& addr)
+        void connection_manager::set_send_limit(size_t limit)
         {
-            u::mutex_scoped_lock l(_mutex);
-            auto si = _in_connections.find(addr);
-            if(si == _in_connections.end()) return true;
-            CHECK(si->second);
-            return si->second->is_disconnected();
+            REQUIRE_GREATER(limit, 0);
+            _tcp->set_send_limit(limit);
+            _udp->set_send_limit(limit);
         }
 
-        const udp_stats& connection_manager::get_udp_stats() const
+        void connection_manager::done()
         {
-            INVARIANT(_udp_con);
-            return _udp_con->stats();
+            _inbound.done();
         }
 
-        void tcp_send_thread(connection_manager* m)
+        bool connection_manager::is_disconnected(const std::string& addr)
         {
-            REQUIRE(m);
-            while(!m->_done)
-            try
-            {
-                send_item i;
-                if(!m->_tcp_send_queue.pop(i, true))
-                    continue;
-
-                //first check in tcp_connections for matching address and use that to send
-                //otherwise use outgoing tcp_connection.
-                {
-                    u::mutex_scoped_lock l(m->_mutex);
-
-                    auto inp = m->_in_connections.find(i.to);
-                    if(inp != m->_in_connections.end())
-                    {
-                        auto o = inp->second;
-                        CHECK(o);
-                        if(!o->is_disconnected()) 
-                        {
-                            o->send(i.data);
-                            continue;
-                        }
-                    }
-                }
+            auto type = determine_type(addr);
+            if(type == asio_params::tcp) return _tcp->is_disconnected(addr);
+            else if(type == asio_params::udp) return _udp->is_disconnected(addr);
+            return true;
+        }
 
-                auto o = m->connect(i.to);
-                if(o) o->send(i.data);
-            }
-            catch(std::exception& e)
-            {
-                LOG << "connection_manager: error sending tcp message. " << e.what() << std::endl;
-            }
-            catch(...)
-            {
-                LOG << "connection_manager: error sending tcp message. Unknown reason." << std::endl;
-            }
+        udp_stats connection_manager::get_udp_stats() const
+        {
+            INVARIANT(_udp);
+            return _udp->stats();
         }
     }
 }
@@ -31,86 +31,57 @@
 #ifndef FIRESTR_NETWORK_CONNECTION_MANAGER_H
 #define FIRESTR_NETWORK_CONNECTION_MANAGER_H
 
-#include "network/tcp_queue.hpp"
-#include "network/udp_queue.hpp"
-#include "util/thread.hpp"
+#include "network/inbound_queue.hpp"
+#include "network/transport.hpp"
 
 #include <string>
-#include <unordered_map>
-#include <vector>
 
 namespace fire 
 {
     namespace network 
     {
-        using assignment_map = std::unordered_map<std::string, size_t>; 
-        using tcp_connection_pool = std::vector<tcp_queue_ptr>;
-        using connection_map = std::unordered_map<std::string, connection*>; 
-
-        struct send_item
-        {
-            std::string to;
-            util::bytes data;
-        };
-        using send_queue = util::queue<send_item>;
+        //the tcp and udp transports over the os sockets
+        transport_factory os_transports(
+                size_t size, 
+                port_type local_port, 
+                bool tcp_listen = true, 
+                const queue_options& udp_options = queue_options());
 
         class connection_manager
         {
             public:
-                connection_manager(size_t size, port_type listen_port, bool tcp_listen = true);
+                connection_manager(
+                        size_t size, 
+                        port_type listen_port, 
+                        bool tcp_listen = true, 
+                        const queue_options& udp_options = queue_options());
+                connection_manager(const transport_factory&);
                 ~connection_manager();
 
             public:
-                bool receive(endpoint& ep, util::bytes& b);
-                bool send(const std::string& to, const util::bytes& b, bool robust = true);
+                bool receive(endpoint& ep, util::bytes& b, bool wait = false);
+                send_result send(const std::string& to, const util::bytes& b, bool robust = true);
                 bool is_disconnected(const std::string& addr);
-                const udp_stats& get_udp_stats() const;
+                udp_stats get_udp_stats() const;
 
-            private:
-                tcp_queue_ptr get_connected_queue(const std::string& address);
-                tcp_queue_ptr connect(const std::string& address);
-                void teardown_and_repool_tcp_connections();
-                void create_udp_endpoint();
-                void create_tcp_endpoint();
-                void create_tcp_pool();
-                void cleanup_pool();
-                size_t find_next_available();
-                asio_params create_tcp_params();
+                //messages taken from one transport before the other gets a turn
+                void set_receive_weights(size_t udp, size_t tcp);
 
-            private:
-                enum receive_state { 
-                    IN_UDP1, 
-                    IN_UDP2, 
-                    IN_UDP3, 
-                    IN_UDP4, 
-                    IN_UDP5, 
-                    IN_UDP6, 
-                    IN_UDP7, 
-                    IN_UDP8, 
-                    IN_TCP, 
-                    OUT_TCP, 
-                    DONE};
+                //messages waiting for one tcp destination before send would block
+                void set_send_limit(size_t limit);
 
-                void transition_udp_state();
-            private:
-
-                std::mutex _mutex;
+                //wakes up and stops threads waiting in receive
+                void done();
 
-                receive_state _rstate;
-                assignment_map _out;
-                tcp_connection_pool _pool;
-                port_type _local_port;
-                tcp_queue_ptr _in;
-                udp_queue_ptr _udp_con;
-                bool _tcp_listen;
+            private:
+                transport* transport_for(const std::string& protocol) const;
 
-                connection_map _in_connections;
+            private:
+                //udp and tcp transports deliver here, so it has to outlive them
+                inbound_queue _inbound;
 
-                //to prevent tcp connections from mess'in with udp
-                bool _done;
-                send_queue _tcp_send_queue;
-                util::thread_uptr _tcp_send_thread;
-                friend void tcp_send_thread(connection_manager*);
+                transport_ptr _tcp;
+                transport_ptr _udp;
         };
     }
 }
@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+
+#include "network/connection_table.hpp"
+
+#include "util/dbc.hpp"
+
+#include <chrono>
+#include <functional>
+
+#include <boost/thread/locks.hpp>
+
+namespace fire
+{
+    namespace network
+    {
+        namespace
+        {
+            const size_t SHARDS = 16;
+
+            //outgoing queues unused this long can be evicted, in milliseconds
+            const int64_t OUT_IDLE_EVICT = 60 * 1000;
+
+            int64_t now_ms()
+            {
+                using namespace std::chrono;
+                return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+            }
+
+            using read_lock = boost::shared_lock<boost::shared_mutex>;
+            using write_lock = boost::unique_lock<boost::shared_mutex>;
+        }
+
+        connection_table::connection_table(size_t capacity) :
+            _shard_capacity{std::max<size_t>(1, (capacity + SHARDS - 1) / SHARDS)}
+        {
+            _shards.reserve(SHARDS);
+            for(size_t s = 0; s < SHARDS; s++)
+                _shards.emplace_back(new shard);
+
+            ENSURE_EQUAL(_shards.size(), SHARDS);
+        }
+
+        connection_table::shard& connection_table::shard_for(const std::string& address)
+        {
+            const auto s = std::hash<std::string>{}(address) % _shards.size();
+            CHECK(_shards[s]);
+            return *_shards[s];
+        }
+
+        tcp_queue_ptr connection_table::find_out(const std::string& address)
+        {
+            auto& s = shard_for(address);
+            tcp_queue_ptr dropped;
+            {
+                read_lock l(s.mutex);
+                auto e = s.out.find(address);
+                if(e == s.out.end()) return tcp_queue_ptr{};
+
+                if(!e->second.queue->is_disconnected())
+                {
+                    e->second.used = now_ms();
+                    return e->second.queue;
+                }
+            }
+
+            //disconnected, drop it so a new connection is made
+            {
+                write_lock l(s.mutex);
+                auto e = s.out.find(address);
+                if(e != s.out.end() && e->second.queue->is_disconnected())
+                {
+                    dropped = e->second.queue;
+                    erase_out(s, e);
+                }
+            }
+            return tcp_queue_ptr{};
+        }
+
+        tcp_queue_ptr connection_table::find_or_add_out(const std::string& address, const make_tcp_queue& make)
+        {
+            REQUIRE(make);
+
+            auto& s = shard_for(address);
+
+            //evicted queues are destroyed after the lock is released since
+            //closing them waits on the reactor
+            tcp_queues evicted;
+            tcp_queue_ptr q;
+            {
+                write_lock l(s.mutex);
+                auto e = s.out.find(address);
+                if(e != s.out.end() && !e->second.queue->is_disconnected())
+                {
+                    e->second.used = now_ms();
+                    return e->second.queue;
+                }
+
+                //connecting does not wait, so holding the lock is cheap
+                q = make();
+                CHECK(q);
+
+                if(e != s.out.end())
+                {
+                    evicted.push_back(e->second.queue);
+                    erase_out(s, e);
+                }
+
+                if(s.out.size() >= _shard_capacity) evict_out(s, evicted);
+
+                s.lru.push_front(address);
+                s.out.emplace(std::piecewise_construct, 
+                        std::forward_as_tuple(address), 
+                        std::forward_as_tuple(q, now_ms(), s.lru.begin()));
+            }
+
+            ENSURE(q);
+            return q;
+        }
+
+        void connection_table::evict_out(shard& s, tcp_queues& evicted)
+        {
+            REQUIRE_EQUAL(s.lru.size(), s.out.size());
+
+            //move entries used since they were listed to the front until 
+            //the back is the least recently used. Each use moves an entry
+            //at most once so this is O(1) amortized.
+            if(s.lru.empty()) return;
+            for(size_t moved = 0; moved < s.lru.size(); moved++)
+            {
+                auto& o = s.out.at(s.lru.back());
+                const int64_t used = o.used;
+                if(used == o.listed) break;
+
+                o.listed = used;
+                s.lru.splice(s.lru.begin(), s.lru, o.lru);
+            }
+
+            auto e = s.out.find(s.lru.back());
+            CHECK(e != s.out.end());
+
+            //everything is in use, grow past the capacity
+            const bool evictable = 
+                e->second.queue->is_disconnected() || 
+                now_ms() - e->second.used >= OUT_IDLE_EVICT;
+            if(!evictable) return;
+
+            evicted.push_back(e->second.queue);
+            erase_out(s, e);
+        }
+
+        void connection_table::erase_out(shard& s, out_map::iterator e)
+        {
+            REQUIRE(e != s.out.end());
+            s.lru.erase(e->second.lru);
+            s.out.erase(e);
+            ENSURE_EQUAL(s.lru.size(), s.out.size());
+        }
+
+        void connection_table::set_in(const std::string& address, const connection_wptr& c)
+        {
+            auto& s = shard_for(address);
+            {
+                read_lock l(s.mutex);
+                auto e = s.in.find(address);
+                if(e != s.in.end() && !e->second.owner_before(c) && !c.owner_before(e->second)) 
+                    return;
+            }
+
+            write_lock l(s.mutex);
+            s.in[address] = c;
+            if(s.in.size() >= 2 * s.in_pruned_size) prune_in(s);
+        }
+
+        connection_ptr connection_table::find_in(const std::string& address)
+        {
+            auto& s = shard_for(address);
+            read_lock l(s.mutex);
+
+            auto e = s.in.find(address);
+            if(e == s.in.end()) return connection_ptr{};
+
+            auto c = e->second.lock();
+            if(!c || c->is_disconnected()) return connection_ptr{};
+            return c;
+        }
+
+        void connection_table::prune_in(shard& s)
+        {
+            for(auto e = s.in.begin(); e != s.in.end();)
+                if(e->second.expired()) e = s.in.erase(e);
+                else e++;
+
+            s.in_pruned_size = std::max<size_t>(s.in.size(), _shard_capacity);
+        }
+
+        size_t connection_table::size() const
+        {
+            size_t total = 0;
+            for(const auto& s : _shards)
+            {
+                read_lock l(s->mutex);
+                total += s->out.size();
+            }
+            return total;
+        }
+    }
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+#ifndef FIRESTR_NETWORK_CONNECTION_TABLE_H
+#define FIRESTR_NETWORK_CONNECTION_TABLE_H
+
+#include "network/connection.hpp"
+#include "network/tcp_queue.hpp"
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/thread/shared_mutex.hpp>
+
+namespace fire
+{
+    namespace network
+    {
+        //address to connection lookup split into shards by address hash,
+        //each with its own reader/writer lock so lookups from the send 
+        //and receive paths only contend on the same shard.
+        //
+        //outgoing queues are kept up to a soft capacity. Past it, the least
+        //recently used queue is evicted if it is disconnected or has been 
+        //idle long enough, otherwise the table grows. Lookups only stamp
+        //the entry, entries used since they were last listed are moved to
+        //the front of the lru list when eviction reaches them.
+        //
+        //incoming connections are only remembered weakly so replies can 
+        //use them while they stay open.
+        using make_tcp_queue = std::function<tcp_queue_ptr()>;
+
+        class connection_table
+        {
+            public:
+                connection_table(size_t capacity);
+
+            public:
+                tcp_queue_ptr find_out(const std::string& address);
+
+                //returns the connected queue for the address, or makes one
+                //under the shard's lock so racing senders share it
+                tcp_queue_ptr find_or_add_out(const std::string& address, const make_tcp_queue& make);
+
+                void set_in(const std::string& address, const connection_wptr& c);
+                connection_ptr find_in(const std::string& address);
+
+                size_t size() const;
+
+            private:
+                using lru_list = std::list<std::string>;
+                struct out_entry
+                {
+                    out_entry(tcp_queue_ptr q, int64_t used, lru_list::iterator pos) : 
+                        queue{q}, used{used}, listed{used}, lru{pos} {}
+
+                    tcp_queue_ptr queue;
+                    std::atomic<int64_t> used; //in milliseconds, steady clock
+                    int64_t listed; //used when last moved in the lru list
+                    lru_list::iterator lru;
+                };
+                using out_map = std::unordered_map<std::string, out_entry>;
+                using in_map = std::unordered_map<std::string, connection_wptr>;
+                using tcp_queues = std::vector<tcp_queue_ptr>;
+
+                struct shard
+                {
+                    mutable boost::shared_mutex mutex;
+                    out_map out;
+                    lru_list lru; //most recent first
+                    in_map in;
+                    size_t in_pruned_size = 0;
+                };
+                using shard_ptr = std::unique_ptr<shard>;
+
+            private:
+                shard& shard_for(const std::string& address);
+                void evict_out(shard&, tcp_queues& evicted);
+                void erase_out(shard&, out_map::iterator);
+                void prune_in(shard&);
+
+            private:
+                std::vector<shard_ptr> _shards;
+                size_t _shard_capacity;
+        };
+    }
+}
+
+#endif
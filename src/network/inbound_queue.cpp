@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+
+#include "network/inbound_queue.hpp"
+#include "util/dbc.hpp"
+
+namespace fire
+{
+    namespace network
+    {
+        namespace
+        {
+            //same split the old polling loop had, 8 udp messages for every tcp one
+            const size_t DEFAULT_UDP_WEIGHT = 8;
+            const size_t DEFAULT_TCP_WEIGHT = 1;
+        }
+
+        inbound_queue::inbound_queue()
+        {
+            _weights[udp_lane] = DEFAULT_UDP_WEIGHT;
+            _weights[tcp_lane] = DEFAULT_TCP_WEIGHT;
+            _credit = _weights[_lane];
+        }
+
+        void inbound_queue::push(inbound_lane l, inbound_message& m)
+        {
+            REQUIRE_RANGE(l, 0, INBOUND_LANES);
+
+            std::lock_guard<std::mutex> lock(_m);
+            _lanes[l].emplace_back(std::move(m));
+            _size++;
+            _c.notify_one();
+
+            ENSURE_GREATER(_size, 0);
+        }
+
+        bool inbound_queue::pop(inbound_message& m, bool wait)
+        {
+            std::unique_lock<std::mutex> lock(_m);
+            if(wait) while(_size == 0 && !_done) _c.wait(lock);
+            if(_done) return false;
+
+            return pop_ready(m);
+        }
+
+        bool inbound_queue::pop_ready(inbound_message& m)
+        {
+            //skip empty lanes so a busy transport never waits on an idle one
+            for(size_t tries = 0; tries <= INBOUND_LANES; tries++)
+            {
+                auto& l = _lanes[_lane];
+                if(_credit > 0 && !l.empty())
+                {
+                    m = std::move(l.front());
+                    l.pop_front();
+                    _credit--;
+                    _size--;
+                    return true;
+                }
+
+                _lane = (_lane + 1) % INBOUND_LANES;
+                _credit = _weights[_lane];
+            }
+
+            ENSURE_EQUAL(_size, 0);
+            return false;
+        }
+
+        void inbound_queue::set_weight(inbound_lane l, size_t weight)
+        {
+            REQUIRE_RANGE(l, 0, INBOUND_LANES);
+            REQUIRE_GREATER(weight, 0);
+
+            std::lock_guard<std::mutex> lock(_m);
+            _weights[l] = weight;
+        }
+
+        void inbound_queue::done()
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            _done = true;
+            _c.notify_all();
+        }
+    }
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+#ifndef FIRESTR_NETWORK_INBOUND_QUEUE_H
+#define FIRESTR_NETWORK_INBOUND_QUEUE_H
+
+#include "network/connection.hpp"
+#include "network/endpoint.hpp"
+#include "util/bytes.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace fire
+{
+    namespace network
+    {
+        //message received on any transport. socket is set for messages
+        //that arrived on incoming tcp connections so replies can use them
+        //while the connection is still around.
+        struct inbound_message
+        {
+            endpoint ep;
+            util::bytes data;
+            connection_wptr socket;
+        };
+
+        enum inbound_lane { udp_lane, tcp_lane, INBOUND_LANES };
+
+        //one queue all transports deliver into. Each transport has a lane
+        //and pop takes up to weight messages from a lane before moving
+        //to the next one that has messages.
+        class inbound_queue
+        {
+            public:
+                inbound_queue();
+
+            public:
+                void push(inbound_lane, inbound_message& m);
+                bool pop(inbound_message& m, bool wait = false);
+                void set_weight(inbound_lane, size_t weight);
+                void done();
+
+            private:
+                bool pop_ready(inbound_message& m);
+
+            private:
+                std::deque<inbound_message> _lanes[INBOUND_LANES];
+                size_t _weights[INBOUND_LANES];
+                size_t _lane = 0;
+                size_t _credit = 0;
+                size_t _size = 0;
+                bool _done = false;
+                std::mutex _m;
+                std::condition_variable _c;
+        };
+    }
+}
+
+#endif
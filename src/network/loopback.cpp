@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+
+#include "network/loopback.hpp"
+
+#include "util/dbc.hpp"
+#include "util/log.hpp"
+
+#include <stdexcept>
+
+#include <boost/lexical_cast.hpp>
+
+namespace u = fire::util;
+
+namespace fire
+{
+    namespace network
+    {
+        namespace
+        {
+            std::string loopback_key(const std::string& protocol, port_type port)
+            {
+                return protocol + ":" + boost::lexical_cast<std::string>(port);
+            }
+
+            std::chrono::steady_clock::duration milliseconds(double ms)
+            {
+                return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double, std::milli>(ms));
+            }
+        }
+
+        void loopback_thread(loopback_network*);
+        loopback_network::loopback_network(const link_params& p) :
+            _link(p),
+            _rand{p.seed}
+        {
+            _thread.reset(new std::thread{loopback_thread, this});
+            ENSURE(_thread);
+        }
+
+        loopback_network::~loopback_network()
+        {
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                _done = true;
+            }
+            _wake.notify_all();
+            if(_thread) _thread->join();
+        }
+
+        void loopback_network::set_link(const link_params& p)
+        {
+            std::lock_guard<std::mutex> l(_mutex);
+            _link = p;
+            _rand.seed(p.seed);
+        }
+
+        bool loopback_network::attach(const endpoint& ep, inbound_queue* sink, udp_stats* stats)
+        {
+            REQUIRE(sink);
+            REQUIRE(stats);
+
+            std::lock_guard<std::mutex> l(_mutex);
+            return _attached.emplace(loopback_key(ep.protocol, ep.port), attachment{sink, stats, 0}).second;
+        }
+
+        void loopback_network::detach(const endpoint& ep)
+        {
+            std::lock_guard<std::mutex> l(_mutex);
+            _attached.erase(loopback_key(ep.protocol, ep.port));
+        }
+
+        bool loopback_network::attached(const std::string& key)
+        {
+            std::lock_guard<std::mutex> l(_mutex);
+            return _attached.count(key) > 0;
+        }
+
+        send_result loopback_network::send(
+                const endpoint& from, 
+                const endpoint& to, 
+                const u::bytes& b, 
+                bool robust,
+                size_t limit)
+        {
+            const auto from_key = loopback_key(from.protocol, from.port);
+            const auto to_key = loopback_key(to.protocol, to.port);
+            const bool tcp = to.protocol == TCP;
+
+            std::lock_guard<std::mutex> l(_mutex);
+
+            auto s = _attached.find(from_key);
+            CHECK(s != _attached.end());
+            auto& stats = *s->second.stats;
+
+            auto r = _attached.find(to_key);
+            if(r == _attached.end()) return send_dropped;
+            if(r->second.in_flight >= limit) return send_would_block;
+
+            stats.send_calls++;
+
+            //only draw when needed so a link without loss gets the
+            //same delays as before it was changed
+            std::uniform_real_distribution<double> percent{0, 100};
+            if(!tcp && !robust && _link.loss > 0 && percent(_rand) < _link.loss) 
+            {
+                stats.simulated_drops++;
+                return send_queued;
+            }
+
+            stats.packets_sent++;
+            stats.bytes_sent += b.size();
+
+            //messages leave a sender one after the other at the bandwidth
+            auto at = std::chrono::steady_clock::now();
+            if(_link.bandwidth > 0)
+            {
+                auto& free = _sender_free[from_key];
+                free = std::max(at, free) + milliseconds(1000.0 * b.size() / _link.bandwidth);
+                at = free;
+            }
+
+            double delay = _link.latency;
+            if(_link.jitter > 0) delay += std::uniform_real_distribution<double>{0, _link.jitter}(_rand);
+            if(!tcp && _link.reorder > 0 && percent(_rand) < _link.reorder) delay += std::max(_link.latency, 1.0);
+            at += milliseconds(delay);
+
+            //a tcp stream never overtakes itself
+            if(tcp)
+            {
+                auto& last = _last_tcp[from_key + ">" + to_key];
+                at = std::max(at, last);
+                last = at;
+            }
+
+            delivery d{at, _order++, to_key, inbound_message{from, b}};
+            _deliveries.push(std::move(d));
+            r->second.in_flight++;
+
+            _wake.notify_one();
+            return send_queued;
+        }
+
+        void loopback_network::deliver(delivery& d)
+        {
+            auto r = _attached.find(d.to);
+            if(r == _attached.end()) return;
+
+            auto& a = r->second;
+            CHECK_GREATER(a.in_flight, 0);
+            a.in_flight--;
+
+            a.stats->packets_recv++;
+            a.stats->bytes_recv += d.message.data.size();
+            a.stats->recv_calls++;
+
+            const auto lane = d.message.ep.protocol == TCP ? tcp_lane : udp_lane;
+            a.sink->push(lane, d.message);
+        }
+
+        void loopback_thread(loopback_network* n)
+        {
+            REQUIRE(n);
+
+            std::unique_lock<std::mutex> l(n->_mutex);
+            while(!n->_done)
+            try
+            {
+                if(n->_deliveries.empty()) 
+                {
+                    n->_wake.wait(l);
+                    continue;
+                }
+
+                const auto at = n->_deliveries.top().at;
+                if(at > std::chrono::steady_clock::now())
+                {
+                    n->_wake.wait_until(l, at);
+                    continue;
+                }
+
+                //pop only gives a const reference, the message is moved out 
+                //right before the entry is removed
+                auto d = std::move(const_cast<loopback_network::delivery&>(n->_deliveries.top()));
+                n->_deliveries.pop();
+                n->deliver(d);
+            }
+            catch(std::exception& e)
+            {
+                LOG << "error in loopback thread. " << e.what() << std::endl;
+            }
+            catch(...)
+            {
+                LOG << "unknown error in loopback thread." << std::endl;
+            }
+        }
+
+        loopback_transport::loopback_transport(
+                loopback_network_ptr network, 
+                const endpoint& local, 
+                inbound_queue* sink) :
+            _network{network},
+            _local(local),
+            _send_limit{std::numeric_limits<size_t>::max()}
+        {
+            REQUIRE(network);
+            REQUIRE(sink);
+
+            if(!_network->attach(_local, sink, &_stats))
+                throw std::runtime_error{"loopback port `" + make_address_str(_local) + "' is already in use"};
+
+            INVARIANT(_network);
+        }
+
+        loopback_transport::~loopback_transport()
+        {
+            INVARIANT(_network);
+            _network->detach(_local);
+        }
+
+        send_result loopback_transport::send(const std::string& to, const u::bytes& b, bool robust)
+        {
+            INVARIANT(_network);
+
+            auto a = parse_address(to);
+            endpoint ep{_local.protocol, a.host, a.port};
+            return _network->send(_local, ep, b, robust, _send_limit);
+        }
+
+        bool loopback_transport::is_disconnected(const std::string& address)
+        {
+            INVARIANT(_network);
+            if(_local.protocol != TCP) return true;
+
+            auto a = parse_address(address);
+            return !_network->attached(loopback_key(TCP, a.port));
+        }
+
+        void loopback_transport::set_send_limit(size_t limit)
+        {
+            REQUIRE_GREATER(limit, 0);
+            _send_limit = limit;
+        }
+
+        udp_stats loopback_transport::stats() const
+        {
+            //updated by the network under its lock
+            INVARIANT(_network);
+            std::lock_guard<std::mutex> l(_network->_mutex);
+            return _stats;
+        }
+
+        transport_factory loopback_transports(
+                loopback_network_ptr network, 
+                const std::string& host, 
+                port_type port)
+        {
+            REQUIRE(network);
+            return [=](const std::string& protocol, inbound_queue* sink) -> transport_ptr
+            {
+                return std::make_shared<loopback_transport>(network, endpoint{protocol, host, port}, sink);
+            };
+        }
+    }
+}
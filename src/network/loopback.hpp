@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+#ifndef FIRESTR_NETWORK_LOOPBACK_H
+#define FIRESTR_NETWORK_LOOPBACK_H
+
+#include "network/transport.hpp"
+#include "util/thread.hpp"
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <unordered_map>
+
+namespace fire
+{
+    namespace network
+    {
+        //how messages travel between loopback transports
+        struct link_params
+        {
+            double latency = 0; //in milliseconds
+            double jitter = 0; //in milliseconds, up to this is added at random
+            double loss = 0; //percent of unreliable udp messages dropped
+            double reorder = 0; //percent of udp messages held back by another latency
+            double bandwidth = 0; //in bytes per second out of each transport, 0 is unlimited
+            unsigned int seed = 1; //same seed, same drops and delays
+        };
+
+        //carries messages between transports in this process without 
+        //sockets. Transports are found by protocol and port, any host 
+        //name reaches them. Robust and tcp messages are never lost and 
+        //tcp messages keep their order.
+        class loopback_network
+        {
+            public:
+                loopback_network(const link_params& = link_params());
+                ~loopback_network();
+
+            public:
+                void set_link(const link_params&);
+
+            private:
+                struct attachment
+                {
+                    inbound_queue* sink;
+                    udp_stats* stats;
+                    size_t in_flight;
+                };
+                using attachments = std::unordered_map<std::string, attachment>;
+                using time_point = std::chrono::steady_clock::time_point;
+
+                struct delivery
+                {
+                    time_point at;
+                    size_t order;
+                    std::string to;
+                    inbound_message message;
+
+                    bool operator>(const delivery& o) const 
+                    { 
+                        return at != o.at ? at > o.at : order > o.order;
+                    }
+                };
+                using deliveries = std::priority_queue<delivery, std::vector<delivery>, std::greater<delivery>>;
+                using time_points = std::unordered_map<std::string, time_point>;
+
+            private:
+                bool attach(const endpoint& ep, inbound_queue*, udp_stats*);
+                void detach(const endpoint& ep);
+                bool attached(const std::string& key);
+                send_result send(
+                        const endpoint& from, 
+                        const endpoint& to, 
+                        const util::bytes& b, 
+                        bool robust, 
+                        size_t limit);
+                void deliver(delivery&);
+
+            private:
+                link_params _link;
+                attachments _attached;
+                deliveries _deliveries;
+                time_points _sender_free; //when each sender's bandwidth is free again
+                time_points _last_tcp; //latest tcp delivery per sender and receiver
+                size_t _order = 0;
+                std::minstd_rand _rand;
+                bool _done = false;
+                std::mutex _mutex;
+                std::condition_variable _wake;
+                util::thread_uptr _thread;
+
+            private:
+                friend class loopback_transport;
+                friend void loopback_thread(loopback_network*);
+        };
+
+        using loopback_network_ptr = std::shared_ptr<loopback_network>;
+
+        //one protocol of one node on a loopback_network
+        class loopback_transport : public transport
+        {
+            public:
+                loopback_transport(
+                        loopback_network_ptr, 
+                        const endpoint& local, 
+                        inbound_queue* sink);
+                virtual ~loopback_transport();
+
+            public:
+                virtual send_result send(const std::string& to, const util::bytes& b, bool robust);
+                virtual bool is_disconnected(const std::string& address);
+                virtual void set_send_limit(size_t limit);
+                virtual udp_stats stats() const;
+
+            private:
+                loopback_network_ptr _network;
+                endpoint _local;
+                std::atomic<size_t> _send_limit;
+                udp_stats _stats;
+        };
+
+        //tcp and udp transports for a node at host and port on the network
+        transport_factory loopback_transports(
+                loopback_network_ptr, 
+                const std::string& host, 
+                port_type port);
+    }
+}
+
+#endif
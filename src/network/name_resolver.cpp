@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+
+#include "network/name_resolver.hpp"
+
+#include "util/dbc.hpp"
+#include "util/log.hpp"
+
+#include <chrono>
+#include <boost/bind.hpp>
+
+namespace ba = boost::asio;
+using boost::asio::ip::udp;
+
+namespace fire
+{
+    namespace network
+    {
+        namespace
+        {
+            //senders queued on one name before more are turned away
+            const size_t MAX_WAITING = 1024;
+
+            //the cache is swept once it doubled since the last sweep
+            const size_t MIN_PRUNE_SIZE = 64;
+
+            int64_t now_ms()
+            {
+                using namespace std::chrono;
+                return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+            }
+        }
+
+        const size_t name_resolver::DEFAULT_TTL;
+        const size_t name_resolver::DEFAULT_FAILURE_TTL;
+
+        name_resolver::name_resolver(ba::io_service& io, size_t ttl, size_t failure_ttl) :
+            _resolver{io},
+            _ttl{ttl},
+            _failure_ttl{failure_ttl}
+        {
+        }
+
+        name_resolver::result name_resolver::resolve(const std::string& host, std::string& address, handler h)
+        {
+            REQUIRE_FALSE(host.empty());
+            REQUIRE(h);
+
+            //ip addresses need no lookup
+            boost::system::error_code error;
+            ba::ip::address::from_string(host, error);
+            if(!error)
+            {
+                address = host;
+                return resolved;
+            }
+
+            std::lock_guard<std::mutex> l(_mutex);
+
+            auto& e = _cache[host];
+            if(e.pending)
+            {
+                if(e.waiting.size() >= MAX_WAITING) return failed;
+                e.waiting.emplace_back(std::move(h));
+                return pending;
+            }
+
+            if(e.expires > now_ms())
+            {
+                if(e.address.empty()) return failed;
+                address = e.address;
+                return resolved;
+            }
+
+            e.pending = true;
+            e.waiting.emplace_back(std::move(h));
+
+            //sockets are opened v4 only, so an AAAA answer is no use
+            udp::resolver::query q{udp::v4(), host, "0"};
+            _resolver.async_resolve(q, 
+                    boost::bind(&name_resolver::handle_resolve, this, host,
+                        ba::placeholders::error, ba::placeholders::iterator));
+
+            if(_cache.size() >= 2 * _pruned_size) prune();
+            return pending;
+        }
+
+        void name_resolver::handle_resolve(
+                const std::string& host, 
+                const boost::system::error_code& error, 
+                udp::resolver::iterator i)
+        {
+            std::string address;
+            if(!error && i != udp::resolver::iterator()) 
+                address = i->endpoint().address().to_string();
+            else
+                LOG << "error resolving `" << host << "': " << error.message() << std::endl;
+
+            std::vector<handler> waiting;
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                auto& e = _cache[host];
+                e.address = address;
+                e.expires = now_ms() + (address.empty() ? _failure_ttl : _ttl);
+                e.pending = false;
+                std::swap(waiting, e.waiting);
+            }
+
+            for(auto& h : waiting)
+            try
+            {
+                h(address);
+            }
+            catch(std::exception& e)
+            {
+                LOG << "error handling resolved name `" << host << "'. " << e.what() << std::endl;
+            }
+        }
+
+        void name_resolver::prune()
+        {
+            const auto now = now_ms();
+            for(auto e = _cache.begin(); e != _cache.end();)
+                if(!e->second.pending && e->second.expires <= now) e = _cache.erase(e);
+                else e++;
+
+            _pruned_size = std::max(_cache.size(), MIN_PRUNE_SIZE);
+        }
+    }
+}
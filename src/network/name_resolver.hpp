@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+#ifndef FIRESTR_NETWORK_NAME_RESOLVER_H
+#define FIRESTR_NETWORK_NAME_RESOLVER_H
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+namespace fire
+{
+    namespace network
+    {
+        //resolves host names to ip addresses on an io_service so senders 
+        //never wait on a lookup. 
+        //
+        //answers are cached for a while and failures for a shorter time.
+        //Callers asking for a name that is already being looked up wait
+        //on that lookup instead of starting another one.
+        class name_resolver
+        {
+            public:
+                enum result { resolved, pending, failed };
+
+                //called on the io_service with the address, or empty if the 
+                //name could not be resolved
+                using handler = std::function<void(const std::string& address)>;
+
+            public:
+                name_resolver(
+                        boost::asio::io_service& io, 
+                        size_t ttl = DEFAULT_TTL, 
+                        size_t failure_ttl = DEFAULT_FAILURE_TTL);
+
+            public:
+                //returns resolved with the address set if the host is an ip 
+                //address or the answer is cached, and failed if the name 
+                //recently failed. Otherwise h is called once the lookup is done
+                result resolve(const std::string& host, std::string& address, handler h);
+
+            public:
+                static const size_t DEFAULT_TTL = 5 * 60 * 1000; //in milliseconds
+                static const size_t DEFAULT_FAILURE_TTL = 30 * 1000; //in milliseconds
+
+            private:
+                void handle_resolve(
+                        const std::string& host, 
+                        const boost::system::error_code& error, 
+                        boost::asio::ip::udp::resolver::iterator i);
+                void prune();
+
+            private:
+                struct entry
+                {
+                    std::string address; //empty if the lookup failed
+                    int64_t expires = 0; //in milliseconds, steady clock
+                    bool pending = false;
+                    std::vector<handler> waiting;
+                };
+                using entries = std::unordered_map<std::string, entry>;
+
+            private:
+                boost::asio::ip::udp::resolver _resolver;
+                size_t _ttl;
+                size_t _failure_ttl;
+                entries _cache;
+                size_t _pruned_size = 0;
+                std::mutex _mutex;
+        };
+    }
+}
+
+#endif
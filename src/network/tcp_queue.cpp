@@ -37,6 +37,8 @@
 #include "util/log.hpp"
 
 #include <stdexcept>
+#include <limits>
+#include <future>
 #include <sstream>
 #include <algorithm>
 #include <functional>
@@ -60,44 +62,79 @@ namespace fire
         namespace
         {
             const size_t BLOCK_SLEEP = 10;
-            const size_t THREAD_SLEEP = 40;
-            const size_t KEEP_ALIVE_SLEEP = 2000;
-            const size_t KEEP_ALIVE_THRESH = 30;
             const u::bytes KEEP_ALIVE_MSG {'%', 'k'};
             const u::bytes KEEP_ALIVE_ACK_MSG {'%', 'a'};
-            const int RETRIES = 0;
+            const int RETRIES = 2;
+
+            //in milliseconds
+            const size_t KEEP_ALIVE_INTERVAL = 60000; //quiet time before we probe
+            const size_t KEEP_ALIVE_TIMEOUT = 60000; //wait for a probe answer
+            const size_t IDLE_TIMEOUT = 3 * KEEP_ALIVE_INTERVAL; //incoming connections
+            const size_t RECONNECT_BACKOFF = 1000; //doubles every retry
+
+            int64_t now_ms()
+            {
+                using namespace std::chrono;
+                return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+            }
+            const size_t DEFAULT_WRITE_CAP = 64*1024; //in bytes
+            const size_t MAX_WRITE_MESSAGES = 256;
+
+            //binary frames are magic, version, flags and a big endian u32 size
+            const char FRAME_MAGIC = static_cast<char>(0xFB);
+            const char FRAME_VERSION = 1;
+            const size_t MAX_TEXT_HEADER = 32;
+
+            //larger frames come from a broken or hostile peer
+            const size_t MAX_FRAME_SIZE = 64*1024*1024; //in bytes
+
+            //a text frame old peers drop because its size does not parse.
+            //tells new peers they can send us binary frames
+            const std::string BINARY_HELLO_TAG = "bin1";
+            const std::string BINARY_HELLO = "!" + BINARY_HELLO_TAG + ":";
         }
 
         tcp_connection::tcp_connection(
-                ba::io_service& io, 
+                tcp_reactor& reactor, 
                 byte_queue& in,
                 tcp_connection_ptr_queue& last_in,
                 std::mutex& in_mutex,
+                inbound_queue* sink,
                 bool track,
                 bool con) :
             _state{ con ? connected : disconnected},
-            _io(io),
+            _io(reactor.io()),
+            _strand{_io},
+            _wheel(reactor.wheel()),
             _in_queue(in),
             _in_mutex(in_mutex),
+            _sink(sink),
             _last_in_socket(last_in),
             _track{track},
-            _socket{new tcp::socket{io}},
+            _write_timer{_io},
+            _write_cap{DEFAULT_WRITE_CAP},
+            _write_delay{0},
+            _socket{new tcp::socket{_io}},
             _writing{false},
-            _retries{RETRIES}
+            _retries{RETRIES},
+            _heartbeat{!con},
+            _liveness{live},
+            _last_in{now_ms()}
         {
             INVARIANT(_socket);
         }
 
         tcp_connection::~tcp_connection()
         {
-            close();
+            //handlers hold a reference so none can be waiting here
+            do_close();
         }
 
         void tcp_connection::close()
         {
             _state = disconnected;
             _writing = false;
-            _io.post(boost::bind(&tcp_connection::do_close, this));
+            _strand.post(boost::bind(&tcp_connection::do_close, shared_from_this()));
         }
 
         void tcp_connection::do_close()
@@ -105,13 +142,21 @@ namespace fire
             u::mutex_scoped_lock l(_mutex);
             _state = disconnected;
             _writing = false;
+            _liveness = dead;
+            _write_timer.cancel();
+            if(_liveness_timer) _wheel.cancel(_liveness_timer);
+            if(_retry_timer) _wheel.cancel(_retry_timer);
+            _liveness_timer = _retry_timer = 0;
+            _liveness_generation++;
             if(_socket && _socket->is_open())
             {
                 boost::system::error_code se;
+                auto local = _socket->local_endpoint(se);
+                auto remote = _socket->remote_endpoint(se);
                 _socket->shutdown(ba::ip::tcp::socket::shutdown_both, se);
-                _socket->close();
+                _socket->close(se);
                 if(se) _error = se;
-                LOG << "tcp_connection closed " << _socket->local_endpoint() << " + " << _socket->remote_endpoint() << " error: " << _error.message() << std::endl;
+                LOG << "tcp_connection closed " << local << " + " << remote << " error: " << _error.message() << std::endl;
             }
             else
             {
@@ -119,6 +164,19 @@ namespace fire
             }
         }
 
+        void tcp_connection::close_and_wait()
+        {
+            //after this, handlers still queued see we are disconnected
+            //and do not touch the queues owned by the tcp_queue
+            std::promise<void> closed;
+            _strand.dispatch([&]() 
+            { 
+                do_close(); 
+                closed.set_value(); 
+            });
+            closed.get_future().wait();
+        }
+
         bool tcp_connection::is_connected() const
         {
             u::mutex_scoped_lock l(_mutex);
@@ -131,6 +189,11 @@ namespace fire
             return _state == disconnected;
         }
 
+        size_t tcp_connection::backlog() const
+        {
+            return _out_queue.size();
+        }
+
         bool tcp_connection::is_connecting() const
         {
             u::mutex_scoped_lock l(_mutex);
@@ -167,6 +230,16 @@ namespace fire
             }
         }
 
+        void tcp_connection::set_write_limits(size_t cap, double delay)
+        {
+            REQUIRE_GREATER_EQUAL(delay, 0);
+
+            _write_cap = cap > 0 ? cap : DEFAULT_WRITE_CAP;
+            _write_delay = delay;
+
+            ENSURE_GREATER(_write_cap, 0);
+        }
+
         void tcp_connection::connect(tcp::endpoint endpoint)
         {
             INVARIANT(_socket);
@@ -174,17 +247,61 @@ namespace fire
             {
                 u::mutex_scoped_lock l(_mutex);
                 if(_state != disconnected) return;
-                if(!_socket->is_open())
-                    _socket.reset(new tcp::socket{_io});
+                _state = connecting;
+            }
+            do_connect(endpoint);
+        }
 
+        void tcp_connection::connect(name_resolver& resolver)
+        {
+            {
+                u::mutex_scoped_lock l(_mutex);
+                if(_state != disconnected) return;
                 _state = connecting;
             }
 
+            //messages sent meanwhile wait in the out queue
+            auto self = shared_from_this();
+            std::string address;
+            auto r = resolver.resolve(_ep.address, address, [self](const std::string& a)
+                    {
+                        self->_strand.dispatch(boost::bind(&tcp_connection::handle_resolve, self, a));
+                    });
+            if(r == name_resolver::pending) return;
+
+            _strand.dispatch(boost::bind(&tcp_connection::handle_resolve, self, address));
+        }
+
+        void tcp_connection::handle_resolve(const std::string& address)
+        {
+            if(_state != connecting) return;
+
+            boost::system::error_code error;
+            auto ip = ba::ip::address::from_string(address, error);
+            if(address.empty() || error)
+            {
+                LOG << "error connecting to `" << _ep.address << ":" << _ep.port << "' : unable to resolve host" << std::endl;
+                close();
+                return;
+            }
+
+            do_connect(tcp::endpoint{ip, _ep.port});
+        }
+
+        void tcp_connection::do_connect(tcp::endpoint endpoint)
+        {
+            INVARIANT(_socket);
+            {
+                u::mutex_scoped_lock l(_mutex);
+                if(!_socket->is_open())
+                    _socket.reset(new tcp::socket{_io});
+            }
+
              LOG << "tcp connecting to " << _ep.address << ":" << _ep.port << " (" << endpoint << ")" <<std::endl;
 
             _socket->async_connect(endpoint,
-                    boost::bind(&tcp_connection::handle_connect, this,
-                        ba::placeholders::error, endpoint));
+                    _strand.wrap(boost::bind(&tcp_connection::handle_connect, shared_from_this(),
+                        ba::placeholders::error, endpoint)));
         }
 
         void tcp_connection::start_read()
@@ -192,11 +309,29 @@ namespace fire
             INVARIANT(_socket);
             if(!_socket->is_open()) { close(); return; }
 
-            //read message header
-            ba::async_read_until(*_socket, _in_buffer, ':',
-                    boost::bind(&tcp_connection::handle_header, this,
+            if(_in_binary) 
+            {
+                read_binary_header();
+                return;
+            }
+
+            //parse what was read past the last frame first
+            if(_in_buffer.size() > 0)
+            {
+                _strand.post(boost::bind(&tcp_connection::handle_header, shared_from_this(),
+                            boost::system::error_code(), 0));
+                return;
+            }
+
+            read_more();
+        }
+
+        void tcp_connection::read_more()
+        {
+            ba::async_read(*_socket, _in_buffer, ba::transfer_at_least(1),
+                    _strand.wrap(boost::bind(&tcp_connection::handle_header, shared_from_this(),
                         ba::placeholders::error,
-                        ba::placeholders::bytes_transferred));
+                        ba::placeholders::bytes_transferred)));
         }
 
         void tcp_connection::handle_connect(
@@ -215,27 +350,25 @@ namespace fire
                     _state = connected;
                 }
                 LOG << "new out tcp_connection " << _socket->local_endpoint() << " -> " << _socket->remote_endpoint() << ": " << error.message() << std::endl;
-                start_read();
-
-                //if we have called send already before we connected,
-                //send the data
-                if(!_out_queue.empty()) 
-                    do_send(false);
+                _retries = RETRIES;
+                on_connected();
             }
             else 
             {
                 if(_retries > 0)
                 {
-                    LOG << "retrying (" << (RETRIES - _retries) << "/" << RETRIES << ")..." << std::endl;
+                    //stay connecting while we wait so nobody else picks us up
+                    const size_t backoff = RECONNECT_BACKOFF << (RETRIES - _retries);
+                    LOG << "retrying (" << (RETRIES - _retries) << "/" << RETRIES << ") in " << backoff << "ms..." << std::endl;
+                    _retries--;
+
+                    std::weak_ptr<tcp_connection> w = shared_from_this();
+                    u::mutex_scoped_lock l(_mutex);
+                    _retry_timer = _wheel.schedule(backoff, [w, endpoint]()
                     {
-                        {
-                            u::mutex_scoped_lock l(_mutex);
-                            _retries--;
-                            _state = disconnected;
-                        }
-                        u::sleep_thread(2000);
-                    }
-                    connect(endpoint);
+                        auto c = w.lock();
+                        if(c) c->_strand.post(boost::bind(&tcp_connection::retry_connect, c, endpoint));
+                    });
                 }
                 else
                 {
@@ -249,14 +382,23 @@ namespace fire
             }
         }
 
-        u::bytes encode_tcp_wire(const u::bytes data)
+        //text headers are the same as u::encode of the bytes with a '!' 
+        //in front, without the payload
+        std::string tcp_wire_header(size_t size, bool binary)
         {
-            auto m = u::encode(data);
-            u::bytes encoded;
-            encoded.resize(m.size() + 1);
-            encoded[0] = '!';
-            std::copy(m.begin(), m.end(), encoded.begin() + 1);
-            return encoded;
+            if(!binary) return "!" + lexical_cast<std::string>(size) + ":";
+
+            REQUIRE_LESS_EQUAL(size, std::numeric_limits<uint32_t>::max());
+
+            std::string h(TCP_FRAME_HEADER_SIZE, 0);
+            h[0] = FRAME_MAGIC;
+            h[1] = FRAME_VERSION;
+            h[2] = 0; //flags
+            for(size_t i = 0; i < 4; i++)
+                h[3 + i] = static_cast<char>((size >> (8 * (3 - i))) & 0xFF);
+
+            ENSURE_EQUAL(h.size(), TCP_FRAME_HEADER_SIZE);
+            return h;
         }
 
         bool tcp_connection::send(const u::bytes& b, bool block)
@@ -266,10 +408,10 @@ namespace fire
 
             //do send if we are connected
             if(is_connected())
-                _io.post(boost::bind(&tcp_connection::do_send, this, false));
+                _strand.post(boost::bind(&tcp_connection::do_send, shared_from_this(), false));
 
             //if we are blocking, block until all messages are sent
-            while(block && !_out_queue.empty()) u::sleep_thread(BLOCK_SLEEP);
+            while(block && (!_out_queue.empty() || _writing)) u::sleep_thread(BLOCK_SLEEP);
 
             return is_connected();
         }
@@ -284,53 +426,223 @@ namespace fire
             send(KEEP_ALIVE_ACK_MSG);
         }
 
-        bool tcp_connection::is_alive() 
+        tcp_connection::liveness tcp_connection::get_liveness() const
         {
-            return _alive;
+            return _liveness;
         }
 
-        void tcp_connection::reset_alive() 
+        size_t tcp_connection::idle_time() const
         {
-            _alive = false;
+            return static_cast<size_t>(std::max<int64_t>(0, now_ms() - _last_in));
+        }
+
+        void tcp_connection::start()
+        {
+            //accepted connections get here from the tcp_queue strand 
+            auto self = shared_from_this();
+            _strand.dispatch([self]() { self->on_connected(); });
+        }
+
+        void tcp_connection::on_connected()
+        {
+            //a reconnect talks to a new socket, which starts with text
+            //frames until each side says hello again
+            _in_binary = false;
+            _out_binary = false;
+            _in_buffer.consume(_in_buffer.size());
+
+            touch();
+            start_read();
+
+            //also sends the data if we have called send already 
+            //before we connected
+            _hello_pending = true;
+            do_send(false);
+
+            //outgoing connections probe the peer, incoming ones only 
+            //expect the peer to probe us
+            schedule_liveness(_heartbeat ? KEEP_ALIVE_INTERVAL : IDLE_TIMEOUT);
+        }
+
+        void tcp_connection::touch()
+        {
+            _last_in = now_ms();
+            _liveness = live;
+        }
+
+        void tcp_connection::schedule_liveness(size_t delay)
+        {
+            std::weak_ptr<tcp_connection> w = shared_from_this();
+
+            u::mutex_scoped_lock l(_mutex);
+            if(_liveness_timer) _wheel.cancel(_liveness_timer);
+
+            const auto generation = ++_liveness_generation;
+            _liveness_timer = _wheel.schedule(delay, [w, generation]()
+            {
+                auto c = w.lock();
+                if(c) c->_strand.post(boost::bind(&tcp_connection::check_liveness, c, generation));
+            });
+        }
+
+        void tcp_connection::check_liveness(uint64_t generation)
+        {
+            {
+                //a newer timer replaced the one that fired
+                u::mutex_scoped_lock l(_mutex);
+                if(generation != _liveness_generation) return;
+                _liveness_timer = 0;
+            }
+            if(_state != connected) return;
+
+            const size_t idle = idle_time();
+            if(!_heartbeat)
+            {
+                if(idle < IDLE_TIMEOUT) 
+                {
+                    schedule_liveness(IDLE_TIMEOUT - idle);
+                    return;
+                }
+
+                LOG << "tcp connection " << _ep.address << ":" << _ep.port << " idle for " << idle << "ms, closing" << std::endl;
+                close();
+                return;
+            }
+
+            //real traffic counts as a heartbeat, so only probe quiet peers
+            if(idle < KEEP_ALIVE_INTERVAL)
+            {
+                _liveness = live;
+                schedule_liveness(KEEP_ALIVE_INTERVAL - idle);
+                return;
+            }
+
+            if(_liveness == probing)
+            {
+                LOG << "tcp connection " << _ep.address << ":" << _ep.port << " did not answer keep alive, closing" << std::endl;
+                close();
+                return;
+            }
+
+            _liveness = probing;
+            send_keep_alive();
+            schedule_liveness(KEEP_ALIVE_TIMEOUT);
+        }
+
+        void tcp_connection::retry_connect(tcp::endpoint endpoint)
+        {
+            {
+                u::mutex_scoped_lock l(_mutex);
+                _retry_timer = 0;
+                if(_state != connecting) return;
+                _state = disconnected;
+            }
+            connect(endpoint);
         }
 
         void tcp_connection::do_send(bool force)
         {
             ENSURE(_socket);
             if(_state == disconnected) return;
-            if(_out_queue.empty()) return;
+            if(_out_queue.empty() && !_hello_pending) return;
 
             //check to see if a write is in progress
             if(!force && _writing) return;
 
-            REQUIRE_FALSE(_out_queue.empty());
             _writing = true;
 
-            //encode bytes to wire format
-            _out_buffer = encode_tcp_wire(_out_queue.front());
+            //a new write can wait a little so messages sent back to back
+            //share it. Writes that follow another one already have had
+            //the whole previous write to gather messages.
+            if(!force && _write_delay > 0)
+            {
+                _write_timer.expires_from_now(std::chrono::microseconds(static_cast<int64_t>(_write_delay)));
+                _write_timer.async_wait(_strand.wrap(boost::bind(&tcp_connection::handle_write_delay, shared_from_this(), ba::placeholders::error)));
+                return;
+            }
 
+            write_batch();
             ENSURE(_writing);
+        }
+
+        void tcp_connection::handle_write_delay(const boost::system::error_code& error)
+        {
+            if(_state == disconnected) return;
+            if(error) return;
+            write_batch();
+        }
+
+        void tcp_connection::write_batch()
+        {
+            REQUIRE(_writing);
+
+            //a write from before a reconnect has not finished yet
+            if(!_out_batch.empty()) return;
+
+            //take everything queued up to the write cap
+            size_t total = 0;
+            u::bytes b;
+            while(total < _write_cap 
+                    && _out_batch.size() < MAX_WRITE_MESSAGES
+                    && _out_queue.pop(b))
+            {
+                total += b.size();
+                _out_headers.emplace_back(tcp_wire_header(b.size(), _out_binary));
+                _out_batch.emplace_back(std::move(b));
+            }
+
+            if(_out_batch.empty() && !_hello_pending) 
+            {
+                _writing = false;
+                return;
+            }
+
+            //headers and payloads are written in place, buffers are only
+            //made once both vectors stopped growing
+            CHECK_EQUAL(_out_headers.size(), _out_batch.size());
+            _out_buffers.reserve(_out_batch.size() * 2 + 1);
+            if(_hello_pending) 
+            {
+                _out_buffers.emplace_back(ba::buffer(BINARY_HELLO));
+                _hello_pending = false;
+            }
+            for(size_t i = 0; i < _out_batch.size(); i++)
+            {
+                const auto& h = _out_headers[i];
+                const auto& m = _out_batch[i];
+                _out_buffers.emplace_back(ba::buffer(h));
+                if(!m.empty()) _out_buffers.emplace_back(ba::buffer(m));
+            }
+
             ba::async_write(*_socket,
-                    ba::buffer(&_out_buffer[0], _out_buffer.size()),
-                        boost::bind(&tcp_connection::handle_write, this,
+                    _out_buffers,
+                        _strand.wrap(boost::bind(&tcp_connection::handle_write, shared_from_this(),
                             ba::placeholders::error,
-                            ba::placeholders::bytes_transferred));
+                            ba::placeholders::bytes_transferred)));
+
+            ENSURE_FALSE(_out_buffers.empty());
         }
 
         void tcp_connection::handle_write(const boost::system::error_code& error, size_t transferred)
         {
+            _out_buffers.clear();
+            _out_headers.clear();
+
+            //messages that did not make it go back in front of the queue 
+            //so they are sent again if we reconnect
+            if(_state == disconnected || error || !_socket->is_open())
+                for(auto m = _out_batch.rbegin(); m != _out_batch.rend(); m++)
+                    _out_queue.emplace_front(*m);
+            _out_batch.clear();
+
             if(_state == disconnected) { CHECK_FALSE(_writing); return;}
             if(error) { _error = error; close(); return; }
             if(!_socket->is_open()) { close(); return; }
 
             INVARIANT(_socket);
-            REQUIRE_FALSE(_out_queue.empty());
-
-            //remove sent message
-            _out_queue.pop_front();
 
             //if we are done sending finish the async write chain
-            if(_out_queue.empty()) 
+            if(_out_queue.empty() && !_hello_pending) 
             {
                 _writing = false;
                 return;
@@ -348,34 +660,56 @@ namespace fire
             if(error) { _error = error; close(); return; }
             if(!_socket->is_open()) { close(); return; }
 
-            //read header 
-            size_t o_size = _in_buffer.size();
-            std::istream in(&_in_buffer);
-            std::string size_buf;
-            size_buf.reserve(64);
-            int c = in.get();
-            size_t garbage = 1;
+            auto d = ba::buffer_cast<const char*>(_in_buffer.data());
+            const size_t n = _in_buffer.size();
 
             //find start of message
-            while(c != '!' && in.good()) 
+            size_t s = 0;
+            while(s < n && d[s] != '!' && d[s] != FRAME_MAGIC) s++;
+            if(s == n) 
             { 
-                c = in.get(); 
-                garbage++;
+                _in_buffer.consume(n); 
+                read_more(); 
+                return;
             }
-            if(!in.good()) { start_read(); return;}
 
-            //read size
-            c = in.get();
-            size_t rc = 1;
-            while(c != ':' && in.good())
+            //peer moved to binary frames, they are read straight from the socket
+            if(d[s] == FRAME_MAGIC) 
             {
-                size_buf.push_back(c);
-                c = in.get();
-                rc++;
+                _in_buffer.consume(s);
+                _in_binary = true;
+                read_binary_header();
+                return;
+            }
+
+            //find end of size
+            size_t e = s + 1;
+            while(e < n && d[e] != ':' && e - s < MAX_TEXT_HEADER) e++;
+            if(e == n) 
+            { 
+                _in_buffer.consume(s); 
+                read_more(); 
+                return;
+            }
+
+            //too long to be a header, skip the '!'
+            if(d[e] != ':')
+            {
+                _in_buffer.consume(s + 1);
+                start_read();
+                return;
             }
-            if(!in.good()) { start_read(); return;}
 
-            CHECK_EQUAL(_in_buffer.size(), o_size - rc - garbage);
+            const std::string size_buf(d + s + 1, d + e);
+            _in_buffer.consume(e + 1);
+
+            if(size_buf == BINARY_HELLO_TAG) 
+            {
+                touch();
+                _out_binary = true;
+                start_read();
+                return;
+            }
 
             //otherwise we got a generic message and need to read the body.
             size_t size = 0; 
@@ -387,61 +721,142 @@ namespace fire
                 return;
             }
 
-            if(_in_buffer.size() >= size) 
-                handle_body(boost::system::error_code(), 0, size);
-            else
+            if(size > MAX_FRAME_SIZE)
             {
-                //read body
-                ba::async_read(*_socket,
-                        _in_buffer,
-                        ba::transfer_at_least(size - _in_buffer.size()),
-                        boost::bind(&tcp_connection::handle_body, this,
-                            ba::placeholders::error,
-                            ba::placeholders::bytes_transferred,
-                            size));
+                LOG << "tcp frame of " << size << " bytes from " << _ep.address << ":" << _ep.port << " is too large, closing" << std::endl;
+                close();
+                return;
+            }
+
+            read_body(size);
+        }
+
+        void tcp_connection::read_binary_header()
+        {
+            const size_t have = take_buffered(&_in_header[0], _in_header.size());
+            if(have == _in_header.size())
+            {
+                _strand.post(boost::bind(&tcp_connection::handle_binary_header, shared_from_this(),
+                            boost::system::error_code(), 0));
+                return;
             }
+
+            ba::async_read(*_socket,
+                    ba::buffer(&_in_header[have], _in_header.size() - have),
+                    _strand.wrap(boost::bind(&tcp_connection::handle_binary_header, shared_from_this(),
+                        ba::placeholders::error,
+                        ba::placeholders::bytes_transferred)));
         }
 
-        void tcp_connection::handle_body(const boost::system::error_code& error, size_t transferred, size_t size)
+        void tcp_connection::handle_binary_header(const boost::system::error_code& error, size_t transferred)
         {
             INVARIANT(_socket);
-            REQUIRE_GREATER(size, 0);
             if(_state == disconnected) return;
             if(error) { _error = error; close(); return; }
             if(!_socket->is_open()) { close(); return; }
 
-            if(_in_buffer.size() < size) 
+            if(_in_header[0] != FRAME_MAGIC || _in_header[1] != FRAME_VERSION)
             {
-                ba::async_read(*_socket,
-                        _in_buffer,
-                        ba::transfer_at_least(size - _in_buffer.size()),
-                        boost::bind(&tcp_connection::handle_body, this,
-                            ba::placeholders::error,
-                            ba::placeholders::bytes_transferred,
-                            size));
+                LOG << "bad tcp frame from " << _ep.address << ":" << _ep.port << ", closing" << std::endl;
+                close();
+                return;
+            }
+
+            size_t size = 0;
+            for(size_t i = 3; i < TCP_FRAME_HEADER_SIZE; i++)
+                size = (size << 8) | static_cast<unsigned char>(_in_header[i]);
+
+            if(size == 0) 
+            {
+                start_read();
+                return;
+            }
+
+            if(size > MAX_FRAME_SIZE)
+            {
+                LOG << "tcp frame of " << size << " bytes from " << _ep.address << ":" << _ep.port << " is too large, closing" << std::endl;
+                close();
+                return;
+            }
+
+            read_body(size);
+        }
+
+        void tcp_connection::read_body(size_t size)
+        {
+            REQUIRE_GREATER(size, 0);
+            REQUIRE_LESS_EQUAL(size, MAX_FRAME_SIZE);
+
+            //the body is read into the bytes handed to the in queue
+            _in_body.resize(size);
+            const size_t have = take_buffered(&_in_body[0], size);
+            if(have == size)
+            {
+                _strand.post(boost::bind(&tcp_connection::handle_body, shared_from_this(),
+                            boost::system::error_code(), 0));
                 return;
             }
 
-            u::bytes data;
-            data.resize(size);
-            std::istream in(&_in_buffer);
-            in.read(&data[0], size);
+            ba::async_read(*_socket,
+                    ba::buffer(&_in_body[have], size - have),
+                    _strand.wrap(boost::bind(&tcp_connection::handle_body, shared_from_this(),
+                        ba::placeholders::error,
+                        ba::placeholders::bytes_transferred)));
+        }
+
+        size_t tcp_connection::take_buffered(char* dest, size_t size)
+        {
+            REQUIRE(dest);
+
+            const size_t n = std::min(size, _in_buffer.size());
+            if(n == 0) return 0;
+
+            auto d = ba::buffer_cast<const char*>(_in_buffer.data());
+            std::copy(d, d + n, dest);
+            _in_buffer.consume(n);
+
+            ENSURE_LESS_EQUAL(n, size);
+            return n;
+        }
+
+        void tcp_connection::handle_body(const boost::system::error_code& error, size_t transferred)
+        {
+            INVARIANT(_socket);
+            if(_state == disconnected) return;
+            if(error) { _error = error; close(); return; }
+            if(!_socket->is_open()) { close(); return; }
+
+            REQUIRE_FALSE(_in_body.empty());
+            u::bytes data = std::move(_in_body);
+            _in_body.clear();
+
+            //any message, keep alives too, shows the peer is alive
+            touch();
 
             //got keepalive or ack
             if(data == KEEP_ALIVE_MSG) send_keep_alive_ack();
-            else if (data == KEEP_ALIVE_ACK_MSG) _alive = true;
             //otherwise add message to in queue
-            else
-            {
-                u::mutex_scoped_lock l(_in_mutex);
-                _in_queue.emplace_push(data);
-                if(_track) _last_in_socket.push(this);
-            }
+            else if(data != KEEP_ALIVE_ACK_MSG) deliver(data);
 
             //read next message
             start_read();
         }
 
+        void tcp_connection::deliver(u::bytes& data)
+        {
+            if(_sink)
+            {
+                inbound_message m{_ep, std::move(data)};
+                if(_track) m.socket = shared_from_this();
+                _sink->push(tcp_lane, m);
+                return;
+            }
+
+            u::mutex_scoped_lock l(_in_mutex);
+            _in_queue.emplace_push(data);
+            if(_track) _last_in_socket.push(shared_from_this());
+        }
+
         tcp::socket& tcp_connection::socket()
         {
             INVARIANT(_socket);
@@ -479,11 +894,12 @@ namespace fire
             ENSURE_GREATER(_ep.port, 0);
         }
 
-        void tcp_run_thread(tcp_queue*);
-        void keep_alive_thread(tcp_queue*);
-        tcp_queue::tcp_queue(const asio_params& p) : 
+        tcp_queue::tcp_queue(const asio_params& p, inbound_queue* sink, tcp_reactor_ptr reactor) : 
             _p(p), 
-            _io{new ba::io_service},
+            _reactor{reactor ? reactor : std::make_shared<tcp_reactor>(1)},
+            _io(_reactor->io()),
+            _strand{_io},
+            _sink(sink),
             _done{false}
         {
             switch(_p.mode)
@@ -494,32 +910,27 @@ namespace fire
                 default: CHECK(false && "missed case");
             }
 
-            if(_p.mode != asio_params::delayed_connect)
-            {
-                _run_thread.reset(new std::thread{tcp_run_thread, this});
-                _keep_alive_thread.reset(new std::thread{keep_alive_thread, this});
-            }
-
-            INVARIANT(_io);
-            INVARIANT(_p.mode == asio_params::delayed_connect || (_run_thread && _keep_alive_thread));
+            INVARIANT(_reactor);
         }
 
         tcp_queue::~tcp_queue() 
         {
-            INVARIANT(_io);
-            if(_out) _out->close();
+            INVARIANT(_reactor);
 
             _done = true;
-            _io->stop();
             if(_p.block) _in_queue.done();
             if(_p.wait > 0) u::sleep_thread(_p.wait);
-            if(_run_thread) _run_thread->join();
-            if(_keep_alive_thread) _keep_alive_thread->join();
+
+            //the reactor outlives us, so nothing it runs later may use this
+            //queue or the in queue the connections write to
+            stop_accepting();
+            if(_out) _out->close_and_wait();
+            for(auto& c : _in_connections) c->close_and_wait();
         }
 
         bool tcp_queue::send(const u::bytes& b)
         {
-            INVARIANT(_io);
+            INVARIANT(_reactor);
             REQUIRE(_p.mode != asio_params::bind);
             CHECK(_out);
 
@@ -539,8 +950,6 @@ namespace fire
         {
             REQUIRE(_p.mode == asio_params::delayed_connect);
             REQUIRE_FALSE(host.empty());
-            REQUIRE_FALSE(_run_thread);
-            INVARIANT(_io);
             REQUIRE(!_out || _out->state() == tcp_connection::disconnected);
 
             _p.uri = make_tcp_address(host, port);
@@ -548,12 +957,6 @@ namespace fire
             _p.port = port;
             _p.mode = asio_params::connect;
             connect();
-
-            //start up engine
-            _run_thread.reset(new std::thread{tcp_run_thread, this});
-            _keep_alive_thread.reset(new std::thread{keep_alive_thread, this});
-            ENSURE(_run_thread);
-            ENSURE(_keep_alive_thread);
         }
 
         bool tcp_queue::is_connected()
@@ -574,10 +977,10 @@ namespace fire
         void tcp_queue::delayed_connect()
         try
         {
-            INVARIANT(_io);
             REQUIRE(!_out);
 
-            _out.reset(new tcp_connection{*_io, _in_queue, _last_in_socket, _mutex});
+            _out.reset(new tcp_connection{*_reactor, _in_queue, _last_in_socket, _mutex, _sink});
+            _out->set_write_limits(_p.write_cap, _p.write_delay);
             if(_p.local_port > 0) _out->bind(_p.local_port);
 
             ENSURE(_out);
@@ -594,23 +997,16 @@ namespace fire
         void tcp_queue::connect()
         try
         {
-            INVARIANT(_io);
             REQUIRE(!_out || _out->state() == tcp_connection::disconnected);
-
-            //init resolver if it does not exist
-            if(!_resolver) _resolver.reset(new tcp::resolver{*_io}); 
-
-            tcp::resolver::query query{_p.host, port_to_string(_p.port)}; 
-            auto ei = _resolver->resolve(query);
-            auto endpoint = *ei;
+            INVARIANT(_reactor);
 
             if(!_out) delayed_connect();
 
+            //the host is resolved off this thread
             _out->update_endpoint(_p.host, _p.port);
-            _out->connect(endpoint);
+            _out->connect(_reactor->resolver());
 
             ENSURE(_out);
-            ENSURE(_resolver);
         }
         catch(std::exception& e)
         {
@@ -623,11 +1019,9 @@ namespace fire
 
         void tcp_queue::accept()
         {
-            INVARIANT(_io);
-
             if(!_acceptor) 
             {
-                _acceptor.reset(new tcp::acceptor{*_io});
+                _acceptor.reset(new tcp::acceptor{_io});
 
                 auto port = boost::lexical_cast<short unsigned int>(_p.port);
                 tcp::endpoint endpoint{tcp::v4(), port}; 
@@ -643,130 +1037,115 @@ namespace fire
             }
 
             //prepare incoming tcp_connection
-            tcp_connection_ptr new_connection{new tcp_connection{*_io, _in_queue, _last_in_socket, _mutex, _p.track_incoming, true}};
+            tcp_connection_ptr new_connection{new tcp_connection{*_reactor, _in_queue, _last_in_socket, _mutex, _sink, _p.track_incoming, true}};
+            {
+                u::mutex_scoped_lock l(_accept_mutex);
+                _accept_pending = true;
+            }
             _acceptor->async_accept(new_connection->socket(),
-                    bind(&tcp_queue::handle_accept, this, new_connection,
-                        ba::placeholders::error));
+                    _strand.wrap(boost::bind(&tcp_queue::handle_accept, this, new_connection,
+                        ba::placeholders::error)));
 
             ENSURE(_acceptor);
         }
 
+        void tcp_queue::stop_accepting()
+        {
+            if(!_acceptor) return;
+
+            //close on the strand so handle_accept cannot start another
+            //accept after, then wait for the aborted one to finish
+            _strand.dispatch([this]() 
+            { 
+                boost::system::error_code e;
+                _acceptor->close(e); 
+            });
+
+            std::unique_lock<std::mutex> l(_accept_mutex);
+            while(_accept_pending) _accept_done.wait(l);
+        }
+
         void tcp_queue::handle_accept(tcp_connection_ptr nc, const boost::system::error_code& error)
         {
             REQUIRE(nc);
             INVARIANT(_acceptor);
 
-            if(error) 
+            if(error || _done) 
             {
                 nc->_state = tcp_connection::disconnected;
-                LOG << "error accept " << nc->socket().local_endpoint() << " -> " << nc->socket().remote_endpoint() << ": " << error.message() << std::endl;
+                if(error != ba::error::operation_aborted)
+                    LOG << "error accept: " << error.message() << std::endl;
+
+                //nothing may touch this queue after stop_accepting is woken up
+                u::mutex_scoped_lock l(_accept_mutex);
+                _accept_pending = false;
+                _accept_done.notify_all();
                 return;
             }
             LOG << "new in tcp_connection " << nc->socket().remote_endpoint() << " " << error.message() << std::endl;
 
+            //drop closed connections once the list doubled since the last sweep
+            if(_in_connections.size() >= 2 * _in_swept)
+            {
+                _in_connections.erase(
+                        std::remove_if(_in_connections.begin(), _in_connections.end(),
+                            [](const tcp_connection_ptr& c) { return c->is_disconnected();}),
+                        _in_connections.end());
+                _in_swept = std::max<size_t>(_in_connections.size(), 64);
+            }
             _in_connections.push_back(nc);
             nc->update_endpoint();
-            nc->start_read();
+            nc->set_write_limits(_p.write_cap, _p.write_delay);
+            nc->start();
 
             //prepare next incoming tcp_connection
-            tcp_connection_ptr new_connection{new tcp_connection{*_io, _in_queue, _last_in_socket, _mutex, _p.track_incoming, true}};
+            tcp_connection_ptr new_connection{new tcp_connection{*_reactor, _in_queue, _last_in_socket, _mutex, _sink, _p.track_incoming, true}};
             _acceptor->async_accept(new_connection->socket(),
-                    boost::bind(&tcp_queue::handle_accept, this, new_connection,
-                        ba::placeholders::error));
+                    _strand.wrap(boost::bind(&tcp_queue::handle_accept, this, new_connection,
+                        ba::placeholders::error)));
 
             ENSURE(new_connection);
         }
 
-        connection* tcp_queue::get_socket() const
+        connection_ptr tcp_queue::get_socket() const
         {
-            tcp_connection* p = nullptr;
+            connection_ptr p;
+            tcp_connection_wptr w;
             switch(_p.mode)
             {
-                case asio_params::bind: if(_p.track_incoming) _last_in_socket.pop(p); break;
+                case asio_params::bind: if(_p.track_incoming && _last_in_socket.pop(w)) p = w.lock(); break;
                 case asio_params::delayed_connect:
-                case asio_params::connect: p = _out.get(); break;
+                case asio_params::connect: p = _out; break;
                 default:
                     CHECK(false && "missed case");
             }
             return p;
         }
 
-        void tcp_run_thread(tcp_queue* q)
+        size_t tcp_queue::backlog() const
         {
-            CHECK(q);
-            CHECK(q->_io);
-            if(q->_out) q->_out->send_keep_alive();
-
-            while(!q->_done) 
-            try
-            {
-                q->_io->run();
-                u::sleep_thread(THREAD_SLEEP);
-                if(q->_out && q->_out->is_disconnected())
-                    break;
-            }
-            catch(std::exception& e)
-            {
-                LOG << "error in tcp thread. " << e.what() << std::endl;
-                if(q->_out) q->_out->close();
-            }
-            catch(...)
-            {
-                LOG << "unknown error in tcp thread." << std::endl;
-                if(q->_out) q->_out->close();
-            }
+            return _out ? _out->backlog() : 0;
         }
 
-        void keep_alive_thread(tcp_queue* q)
+        tcp_connection::liveness tcp_queue::get_liveness()
         {
-            CHECK(q);
-            size_t ticks = 0;
-            if(q->_out) q->_out->send_keep_alive();
-
-            while(!q->_done) 
-            try
-            {
-                //do keepalive
-                if(q->_out && !q->_out->is_disconnected() && ticks > KEEP_ALIVE_THRESH)
-                {
-                    if(q->_out->is_alive()) 
-                    {
-                        q->_out->send_keep_alive();
-                        q->_out->reset_alive();
-                    }
-                    else q->_out->close();
-                    ticks = 0;
-                }
-                ticks++;
-                u::sleep_thread(KEEP_ALIVE_SLEEP);
-
-                if(q->_out && q->_out->is_disconnected())
-                    break;
-            }
-            catch(std::exception& e)
-            {
-                LOG << "error in tcp thread. " << e.what() << std::endl;
-                if(q->_out) q->_out->close();
-            }
-            catch(...)
-            {
-                LOG << "unknown error in tcp thread." << std::endl;
-                if(q->_out) q->_out->close();
-            }
+            return _out ? _out->get_liveness() : tcp_connection::dead;
         }
 
-        tcp_queue_ptr create_tcp_queue(const address_components& c)
+        tcp_queue_ptr create_tcp_queue(const address_components& c, inbound_queue* sink, tcp_reactor_ptr reactor)
         {
             auto p = parse_params(c);
-            return tcp_queue_ptr{new tcp_queue{p}};
+            return tcp_queue_ptr{new tcp_queue{p, sink, reactor}};
         }
 
         tcp_queue_ptr create_tcp_queue(
                 const std::string& address, 
-                const queue_options& defaults)
+                const queue_options& defaults,
+                inbound_queue* sink,
+                tcp_reactor_ptr reactor)
         {
             auto c = parse_address(address, defaults); 
-            tcp_queue_ptr p = create_tcp_queue(c);
+            tcp_queue_ptr p = create_tcp_queue(c, sink, reactor);
             ENSURE(p);
             return p;
         }
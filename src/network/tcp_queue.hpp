@@ -33,32 +33,51 @@
 
 #include "network/util.hpp"
 #include "network/connection.hpp"
+#include "network/inbound_queue.hpp"
 #include "network/message_queue.hpp"
+#include "network/tcp_reactor.hpp"
 #include "util/thread.hpp"
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <string>
+#include <vector>
+
+#include <boost/asio/steady_timer.hpp>
+
 namespace fire
 {
     namespace network
     {
-        using tcp_resolver_ptr = std::unique_ptr<boost::asio::ip::tcp::resolver>;
         using tcp_acceptor_ptr = std::unique_ptr<boost::asio::ip::tcp::acceptor>;
         using tcp_socket_ptr = std::unique_ptr<boost::asio::ip::tcp::socket>;
 
         class tcp_connection;
         class tcp_queue;
-        using tcp_connection_ptr_queue = util::queue<tcp_connection*>;
+        //weak so closed connections can be freed while still queued
+        using tcp_connection_wptr = std::weak_ptr<tcp_connection>;
+        using tcp_connection_ptr_queue = util::queue<tcp_connection_wptr>;
         using connection_ptr_queue = util::queue<connection*>;
+        using const_buffers = std::vector<boost::asio::const_buffer>;
+
+        const size_t TCP_FRAME_HEADER_SIZE = 7;
+        using tcp_frame_header = std::array<char, TCP_FRAME_HEADER_SIZE>;
 
-        class tcp_connection : public connection
+        //handlers run on the connection strand and hold a reference to it, 
+        //so connections must be owned by a tcp_connection_ptr
+        class tcp_connection : public connection, public std::enable_shared_from_this<tcp_connection>
         {
             public:
                 enum con_state{connecting, connected, disconnected};
+                enum liveness{live, probing, dead};
 
                 tcp_connection(
-                        boost::asio::io_service& io, 
+                        tcp_reactor& reactor, 
                         byte_queue& in,
                         tcp_connection_ptr_queue& last_in,
                         std::mutex& in_mutex,
+                        inbound_queue* sink = nullptr,
                         bool track = false,
                         bool con = false);
                 ~tcp_connection();
@@ -66,15 +85,17 @@ namespace fire
                 virtual bool send(const fire::util::bytes& b, bool block = false);
                 virtual endpoint get_endpoint() const;
                 virtual bool is_disconnected() const;
-
+                virtual size_t backlog() const;
 
             public:
                 void send_keep_alive();
                 void send_keep_alive_ack();
-                bool is_alive(); 
-                void reset_alive(); 
+                liveness get_liveness() const;
+                size_t idle_time() const; //in milliseconds since the peer sent anything
                 void bind(port_type port);
+                void set_write_limits(size_t cap, double delay);
                 void connect(boost::asio::ip::tcp::endpoint);
+                void connect(name_resolver&);
                 void start_read();
                 void close();
                 bool is_connected() const;
@@ -88,35 +109,79 @@ namespace fire
 
             private:
                 void do_close();
+                void close_and_wait();
+                void start();
+                void on_connected();
+                void touch();
+                void schedule_liveness(size_t delay);
+                void check_liveness(uint64_t generation);
+                void retry_connect(boost::asio::ip::tcp::endpoint);
+                void do_connect(boost::asio::ip::tcp::endpoint);
+                void handle_resolve(const std::string& address);
                 void handle_connect(
                         const boost::system::error_code& error, 
                         boost::asio::ip::tcp::endpoint e);
                 void handle_punch(const boost::system::error_code& error);
                 void do_send(bool);
+                void write_batch();
+                void handle_write_delay(const boost::system::error_code& error);
                 void handle_write(const boost::system::error_code& error, size_t);
+                void read_more();
                 void handle_header(const boost::system::error_code& error, size_t);
-                void handle_body(const boost::system::error_code& error, size_t, size_t);
+                void read_binary_header();
+                void handle_binary_header(const boost::system::error_code& error, size_t);
+                void read_body(size_t size);
+                void handle_body(const boost::system::error_code& error, size_t);
+                size_t take_buffered(char* dest, size_t size);
+                void deliver(util::bytes& data);
             private:
 
                 con_state _state;
                 boost::asio::io_service& _io;
+                boost::asio::io_service::strand _strand;
+                util::timer_wheel& _wheel;
                 byte_queue& _in_queue;
                 std::mutex& _in_mutex;
+                inbound_queue* _sink; //when set, messages go here instead
                 byte_queue _out_queue;
                 tcp_connection_ptr_queue& _last_in_socket;
                 bool _track;
-                util::bytes _out_buffer;
+
+                //messages queued when a write starts all go out in one 
+                //gathered write, headers are kept next to their payloads
+                std::vector<util::bytes> _out_batch;
+                std::vector<std::string> _out_headers;
+                const_buffers _out_buffers;
+                boost::asio::steady_timer _write_timer;
+                size_t _write_cap; //bytes taken from the out queue per write
+                double _write_delay; //in microseconds a new write waits for more messages
                 endpoint _ep;
-                boost::asio::streambuf _in_buffer;
+                boost::asio::streambuf _in_buffer; //text headers and bytes read past a frame
+                tcp_frame_header _in_header;
+                util::bytes _in_body;
+                bool _in_binary = false; //peer sends binary frames
+                bool _out_binary = false; //peer can read binary frames
+                bool _hello_pending = false;
                 tcp_socket_ptr _socket;
                 mutable std::mutex _mutex;
                 boost::system::error_code _error;
                 bool _writing;
                 int _retries;
-                bool _alive = false;
+
+                //keep alives and idle timeouts, only touched on the strand 
+                //except for the atomics which can be queried from anywhere
+                bool _heartbeat; //outgoing connections probe the peer
+                std::atomic<liveness> _liveness;
+                std::atomic<int64_t> _last_in; //in milliseconds, steady clock
+
+                //wheel handles are guarded by _mutex. A timer can fire while
+                //it is replaced, so each check carries the generation it was 
+                //scheduled for and stale ones are dropped.
+                util::timer_wheel::timer_id _liveness_timer = 0;
+                util::timer_wheel::timer_id _retry_timer = 0;
+                uint64_t _liveness_generation = 0;
             private:
                 friend class tcp_queue;
-                friend void tcp_run_thread(tcp_queue*);
         };
 
         using tcp_connection_ptr = std::shared_ptr<tcp_connection>;
@@ -125,7 +190,10 @@ namespace fire
         class tcp_queue : public message_queue
         {
             public:
-                tcp_queue(const asio_params& p);
+                tcp_queue(
+                        const asio_params& p, 
+                        inbound_queue* sink = nullptr, 
+                        tcp_reactor_ptr reactor = nullptr);
                 virtual ~tcp_queue();
 
             public:
@@ -133,45 +201,56 @@ namespace fire
                 virtual bool receive(util::bytes& b);
 
             public:
-                connection* get_socket() const;
+                connection_ptr get_socket() const;
                 void connect(const std::string& host, port_type port);
                 bool is_connected();
                 bool is_connecting();
                 bool is_disconnected();
+                size_t backlog() const;
+                tcp_connection::liveness get_liveness();
 
             private:
                 void connect();
                 void delayed_connect();
                 void accept();
+                void stop_accepting();
 
             private:
                 void handle_accept(tcp_connection_ptr nc, const boost::system::error_code& error);
 
             private:
                 asio_params _p;
-                asio_service_ptr _io;
-                tcp_resolver_ptr _resolver;
+                tcp_reactor_ptr _reactor; //shared with other queues, created if none given
+                boost::asio::io_service& _io;
+                boost::asio::io_service::strand _strand;
                 tcp_acceptor_ptr _acceptor;
-                util::thread_uptr _run_thread;
-                util::thread_uptr _keep_alive_thread;
+                bool _accept_pending = false;
+                std::mutex _accept_mutex;
+                std::condition_variable _accept_done;
 
                 tcp_connection_ptr _out;
                 mutable tcp_connection_ptr_queue _last_in_socket;
                 tcp_connections _in_connections;
+                size_t _in_swept = 0; //live incoming connections after the last sweep
                 byte_queue _in_queue;
+                inbound_queue* _sink;
                 mutable std::mutex _mutex;
 
-                bool _done;
+                std::atomic<bool> _done;
 
-            private:
-                friend void tcp_run_thread(tcp_queue*);
-                friend void keep_alive_thread(tcp_queue*);
         };
 
         using tcp_queue_ptr = std::shared_ptr<tcp_queue>;
 
-        tcp_queue_ptr create_tcp_queue(const address_components& c);
-        tcp_queue_ptr create_tcp_queue(const std::string& address, const queue_options& defaults);
+        tcp_queue_ptr create_tcp_queue(
+                const address_components& c, 
+                inbound_queue* sink = nullptr, 
+                tcp_reactor_ptr reactor = nullptr);
+        tcp_queue_ptr create_tcp_queue(
+                const std::string& address, 
+                const queue_options& defaults, 
+                inbound_queue* sink = nullptr,
+                tcp_reactor_ptr reactor = nullptr);
     }
 }
 
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+
+#include "network/tcp_reactor.hpp"
+#include "util/dbc.hpp"
+#include "util/log.hpp"
+
+#include <algorithm>
+#include <boost/bind.hpp>
+
+namespace ba = boost::asio;
+
+namespace fire
+{
+    namespace network
+    {
+        namespace
+        {
+            const size_t WHEEL_SLOTS = 256;
+            const size_t WHEEL_TICK = 1000; //in milliseconds
+        }
+
+        void tcp_reactor_thread(tcp_reactor*);
+        tcp_reactor::tcp_reactor(size_t threads) :
+            _wheel{WHEEL_SLOTS, WHEEL_TICK},
+            _resolver{_io},
+            _work{new ba::io_service::work{_io}},
+            _wheel_timer{_io}
+        {
+            if(threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+            _wheel_timer.expires_from_now(std::chrono::milliseconds(WHEEL_TICK));
+            schedule_tick();
+
+            _threads.resize(threads);
+            for(auto& t : _threads) t.reset(new std::thread{tcp_reactor_thread, this});
+
+            ENSURE_EQUAL(_threads.size(), threads);
+        }
+
+        tcp_reactor::~tcp_reactor()
+        {
+            _wheel_timer.cancel();
+            _work.reset();
+            _io.stop();
+            for(auto& t : _threads) t->join();
+        }
+
+        ba::io_service& tcp_reactor::io()
+        {
+            return _io;
+        }
+
+        size_t tcp_reactor::threads() const
+        {
+            return _threads.size();
+        }
+
+        util::timer_wheel& tcp_reactor::wheel()
+        {
+            return _wheel;
+        }
+
+        name_resolver& tcp_reactor::resolver()
+        {
+            return _resolver;
+        }
+
+        void tcp_reactor::schedule_tick()
+        {
+            _wheel_timer.async_wait(boost::bind(&tcp_reactor::handle_tick, this, ba::placeholders::error));
+        }
+
+        void tcp_reactor::handle_tick(const boost::system::error_code& error)
+        {
+            if(error) return;
+
+            try
+            {
+                _wheel.tick();
+            }
+            catch(std::exception& e)
+            {
+                LOG << "error in tcp timer. " << e.what() << std::endl;
+            }
+
+            //from the last deadline so ticks do not drift
+            _wheel_timer.expires_at(_wheel_timer.expires_at() + std::chrono::milliseconds(WHEEL_TICK));
+            schedule_tick();
+        }
+
+        void tcp_reactor_thread(tcp_reactor* r)
+        {
+            CHECK(r);
+
+            //run returns once the work is reset, an error in one handler
+            //should not stop the others
+            while(true)
+            try
+            {
+                r->_io.run();
+                break;
+            }
+            catch(std::exception& e)
+            {
+                LOG << "error in tcp thread. " << e.what() << std::endl;
+            }
+            catch(...)
+            {
+                LOG << "unknown error in tcp thread." << std::endl;
+            }
+        }
+    }
+}
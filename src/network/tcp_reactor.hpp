@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+#ifndef FIRESTR_NETWORK_TCP_REACTOR_H
+#define FIRESTR_NETWORK_TCP_REACTOR_H
+
+#include "network/name_resolver.hpp"
+#include "util/thread.hpp"
+#include "util/timer_wheel.hpp"
+
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+namespace fire
+{
+    namespace network
+    {
+        //one io_service run by a pool of threads that tcp queues share, 
+        //so the thread count does not grow with connections. Keep alives,
+        //idle timeouts and reconnects of all connections share one wheel
+        //driven by a single timer, and host names share one resolver.
+        class tcp_reactor
+        {
+            public:
+                tcp_reactor(size_t threads = 0);
+                ~tcp_reactor();
+
+            public:
+                boost::asio::io_service& io();
+                size_t threads() const;
+                util::timer_wheel& wheel();
+                name_resolver& resolver();
+
+            private:
+                void schedule_tick();
+                void handle_tick(const boost::system::error_code& error);
+
+            private:
+                //connections left in the io_service cancel their timers
+                //when it is destroyed, so the wheel has to outlive it
+                util::timer_wheel _wheel;
+                boost::asio::io_service _io;
+
+                //holds connections waiting on lookups, which have to go
+                //before the io_service does
+                name_resolver _resolver;
+                std::unique_ptr<boost::asio::io_service::work> _work;
+                boost::asio::steady_timer _wheel_timer;
+                std::vector<util::thread_uptr> _threads;
+
+            private:
+                friend void tcp_reactor_thread(tcp_reactor*);
+        };
+
+        using tcp_reactor_ptr = std::shared_ptr<tcp_reactor>;
+    }
+}
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+
+#include "network/tcp_transport.hpp"
+
+#include "util/dbc.hpp"
+#include "util/log.hpp"
+
+namespace u = fire::util;
+
+namespace fire
+{
+    namespace network
+    {
+        namespace
+        {
+            const size_t DEFAULT_SEND_LIMIT = 1024;
+        }
+
+        tcp_transport::tcp_transport(
+                size_t size, 
+                port_type local_port, 
+                bool listen, 
+                inbound_queue* sink) :
+            _sink{sink},
+            _reactor{std::make_shared<tcp_reactor>()},
+            _connections{size},
+            _pool(size),
+            _local_port{local_port},
+            _send_limit{DEFAULT_SEND_LIMIT}
+        {
+            REQUIRE(sink);
+
+            if(listen)
+            {
+                LOG << "creating listening tcp connection and outgoing pool..." << std::endl;
+#ifdef __APPLE__
+                create_tcp_endpoint();
+#endif
+                create_tcp_pool();
+
+#ifndef __APPLE__
+                create_tcp_endpoint();
+#endif
+            }
+
+            ENSURE(!listen || _in);
+            ENSURE(_reactor);
+        }
+
+        void tcp_transport::create_tcp_endpoint()
+        {
+            REQUIRE_FALSE(_in);
+            REQUIRE_GREATER(_local_port, 0);
+
+            auto listen_address = make_tcp_address("*", _local_port);
+
+            queue_options qo = { 
+                {"bnd", "1"},
+                {"block", "0"},
+                {"track_incoming", "1"}};
+
+            _in = create_tcp_queue(listen_address, qo, _sink, _reactor);
+            ENSURE(_in);
+        }
+
+        asio_params tcp_transport::create_tcp_params(port_type local_port)
+        {
+            //create outgoing params
+            asio_params p = {
+                asio_params::tcp, 
+                asio_params::delayed_connect, 
+                "", //uri
+                "", //host
+                0, //port
+                local_port,
+                false, //block;
+                0, // wait;
+                false, //track_incoming;
+                false, //batch_io;
+                0, //fec_group;
+                0, //loss;
+                0, //bundle_delay;
+                0, //write_cap;
+                0, //write_delay;
+                1, //shards;
+            };
+            return p;
+        }
+
+        void tcp_transport::create_tcp_pool()
+        {
+            auto par = create_tcp_params(_local_port); 
+            for(auto& p : _pool) p = std::make_shared<tcp_queue>(par, _sink, _reactor);
+        }
+
+        tcp_queue_ptr tcp_transport::next_available()
+        {
+            {
+                u::mutex_scoped_lock l(_mutex);
+                if(!_pool.empty())
+                {
+                    auto p = _pool.back();
+                    _pool.pop_back();
+                    if(p) return p;
+
+                    //not listening so the pool is filled as it is used
+                    auto par = create_tcp_params(_local_port); 
+                    return std::make_shared<tcp_queue>(par, _sink, _reactor);
+                }
+            }
+
+            //the local port is taken by the pool, let the os pick one
+            auto par = create_tcp_params(0); 
+            return std::make_shared<tcp_queue>(par, _sink, _reactor);
+        }
+
+        tcp_queue_ptr tcp_transport::connect(const std::string& address)
+        try
+        {
+            auto q = _connections.find_out(address);
+            if(q) return q;
+
+            //connect before publishing so nobody else sees the queue 
+            //as disconnected. Made under the table's lock so senders 
+            //racing to a new address share one queue.
+            q = _connections.find_or_add_out(address, [&]()
+            {
+                auto a = parse_address(address);
+                auto n = next_available();
+                CHECK(n);
+                n->connect(a.host, a.port);
+                return n;
+            });
+
+            ENSURE(q);
+            return q;
+        }
+        catch(std::exception& e)
+        {
+            LOG << "error connecting to `" << address << "'. " << e.what() << std::endl; 
+            return tcp_queue_ptr{};
+        }
+        catch(...)
+        {
+            LOG << "unknown error connecting to `" << address << "'." << std::endl; 
+            return tcp_queue_ptr{};
+        }
+
+        send_result tcp_transport::send(const std::string& to, const u::bytes& b, bool)
+        {
+            //each destination has its own queue on its connection and 
+            //connecting never blocks, so a slow peer only holds up itself.
+            //
+            //first check in tcp_connections for matching address and use that to send
+            //otherwise use outgoing tcp_connection.
+            auto in = _connections.find_in(to);
+            if(in) 
+            {
+                if(in->backlog() >= _send_limit) return send_would_block;
+                in->send(b);
+                return send_queued;
+            }
+
+            auto out = connect(to);
+            if(!out) return send_dropped;
+            if(out->backlog() >= _send_limit) return send_would_block;
+
+            out->send(b);
+            return send_queued;
+        }
+
+        bool tcp_transport::is_disconnected(const std::string& address)
+        {
+            return !_connections.find_in(address);
+        }
+
+        void tcp_transport::set_send_limit(size_t limit)
+        {
+            REQUIRE_GREATER(limit, 0);
+            _send_limit = limit;
+        }
+
+        udp_stats tcp_transport::stats() const
+        {
+            return _stats;
+        }
+
+        void tcp_transport::received(const inbound_message& m)
+        {
+            //remember incoming tcp connections so replies go back on them.
+            if(!m.socket.expired()) _connections.set_in(make_address_str(m.ep), m.socket);
+        }
+    }
+}
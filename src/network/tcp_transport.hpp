@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+#ifndef FIRESTR_NETWORK_TCP_TRANSPORT_H
+#define FIRESTR_NETWORK_TCP_TRANSPORT_H
+
+#include "network/connection_table.hpp"
+#include "network/tcp_queue.hpp"
+#include "network/transport.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fire 
+{
+    namespace network 
+    {
+        using tcp_connection_pool = std::vector<tcp_queue_ptr>;
+
+        //tcp over the os. Listens on the local port and keeps one 
+        //outgoing queue per destination, all run on one tcp_reactor.
+        class tcp_transport : public transport
+        {
+            public:
+                tcp_transport(
+                        size_t size, 
+                        port_type local_port, 
+                        bool listen, 
+                        inbound_queue* sink);
+
+            public:
+                virtual send_result send(const std::string& to, const util::bytes& b, bool robust);
+                virtual bool is_disconnected(const std::string& address);
+                virtual void set_send_limit(size_t limit);
+                virtual udp_stats stats() const;
+                virtual void received(const inbound_message&);
+
+            private:
+                tcp_queue_ptr connect(const std::string& address);
+                tcp_queue_ptr next_available();
+                void create_tcp_endpoint();
+                void create_tcp_pool();
+                asio_params create_tcp_params(port_type local_port);
+
+            private:
+                std::mutex _mutex;
+                inbound_queue* _sink;
+
+                //threads all tcp queues run on, sized to the cores
+                tcp_reactor_ptr _reactor;
+
+                //outgoing queues and incoming connections by address
+                connection_table _connections;
+
+                //outgoing queues bound to the local port before it is listened on.
+                //once used up new outgoing queues get any local port
+                tcp_connection_pool _pool;
+                port_type _local_port;
+                tcp_queue_ptr _in;
+                std::atomic<size_t> _send_limit;
+                udp_stats _stats;
+        };
+    }
+}
+
+#endif
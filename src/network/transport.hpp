@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+#ifndef FIRESTR_NETWORK_TRANSPORT_H
+#define FIRESTR_NETWORK_TRANSPORT_H
+
+#include "network/inbound_queue.hpp"
+#include "network/udp_queue.hpp"
+#include "util/bytes.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace fire
+{
+    namespace network
+    {
+        //what send did with a message
+        enum send_result 
+        { 
+            send_queued, //on its way
+            send_would_block, //too many messages wait for the destination, try later
+            send_dropped //bad address or an error
+        };
+
+        //carries messages to the addresses of one protocol. What it
+        //receives is pushed into the inbound_queue it was made with.
+        class transport
+        {
+            public:
+                virtual ~transport() {}
+
+            public:
+                virtual send_result send(const std::string& to, const util::bytes& b, bool robust) = 0;
+
+                //true unless there is an open connection with the address
+                virtual bool is_disconnected(const std::string& address) = 0;
+
+                //messages waiting for one destination before send would block
+                virtual void set_send_limit(size_t limit) = 0;
+
+                //datagram counters, transports without datagrams leave them empty
+                virtual udp_stats stats() const = 0;
+
+                //called with each message this transport delivered once it
+                //is taken from the inbound_queue
+                virtual void received(const inbound_message&) {}
+        };
+
+        using transport_ptr = std::shared_ptr<transport>;
+
+        //makes the transport for a protocol, TCP or UDP
+        using transport_factory = std::function<transport_ptr(const std::string& protocol, inbound_queue*)>;
+    }
+}
+
+#endif
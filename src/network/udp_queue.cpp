@@ -39,26 +39,56 @@
 #include <stdexcept>
 #include <sstream>
 #include <functional>
+#include <cmath>
+#include <cstring>
 #include <boost/bind.hpp>
 
+#ifdef __linux__
+#include <cerrno>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
 namespace u = fire::util;
 namespace ba = boost::asio;
 using namespace boost::asio::ip;
 
+#ifdef SO_REUSEPORT
+namespace so = boost::asio::detail::socket_option; 
+using reuse_port = so::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
 namespace fire
 {
     namespace network
     {
         namespace
         {
-            const size_t MAX_FLIGHT = 4;
+            const size_t MAX_QUEUED = 4; //unreliable chunks queued per message
             const size_t BLOCK_SLEEP = 10;
             const size_t THREAD_SLEEP = 40;
-            const size_t RESEND_THREAD_SLEEP = 1000;
-            const size_t RESEND_TICK_THRESHOLD = 1; //resend after 1 seconds
-            const size_t RESEND_THRESHOLD = 5; //purge message after 5 seconds
-            const size_t UDP_PACKET_SIZE = 512; //in bytes
-            const size_t MAX_UDP_BUFF_SIZE = UDP_PACKET_SIZE*2; 
+            const size_t RESEND_TICK = 10; //check retransmission timers every 10 ms
+            const size_t MESSAGE_TIMEOUT = 5000; //purge message after 5 seconds without an ack
+            const double INITIAL_WINDOW = 4; //in chunks
+            const double MIN_WINDOW = 2;
+            const double MAX_WINDOW = 4096;
+            const double INITIAL_RTO = 1000; //in milliseconds
+            const double MIN_RTO = 20;
+            const double MAX_RTO = 4000;
+            const double MIN_REORDER_WINDOW = 1; //in milliseconds
+            const int SOCKET_BUFFER_SIZE = 1024*1024; //in bytes
+            const size_t ACK_DELAY = 1; //in milliseconds, coalesce acks when not batching
+            const size_t UDP_PACKET_SIZE = 512; //in bytes, safe default before probing
+            const size_t MAX_UDP_BUFF_SIZE = 2048; 
+            const size_t PROBE_SIZES[] = {1200, 1400}; //packet sizes to probe, in order
+            const size_t MAX_PROBE_TRIES = 3;
+            const double MIN_PROBE_TIMEOUT = 250; //in milliseconds
+            const size_t FALLBACK_TIMEOUTS = 3; //step down packet size after this many timeouts
+            const size_t IO_BATCH_SIZE = 32; //datagrams per recvmmsg/sendmmsg call
+            const long PEER_QUANTUM = 4 * 1400; //bytes a peer may send per turn
+            const size_t MAX_BUNDLED_FRAME = 256; //in bytes, bigger frames are sent on their own
+            const size_t MIN_ENDPOINT_PRUNE = 1024; //endpoints known before idle ones are pruned
+            const size_t ENDPOINT_IDLE_EXPIRE = 60 * 1000; //in milliseconds
             const size_t SEQUENCE_BASE = 1;
             const size_t CHUNK_TOTAL_BASE = SEQUENCE_BASE + sizeof(sequence_type);
             const size_t CHUNK_BASE = CHUNK_TOTAL_BASE + sizeof(chunk_total_type);
@@ -68,28 +98,85 @@ namespace fire
             const size_t HEADER_SIZE = MESSAGE_BASE;
             const size_t UDP_CHuNK_SIZE = UDP_PACKET_SIZE - HEADER_SIZE; //in bytes
 
+            //<mark> <sequence num> <message_chunk total> <message_chunk> <chunk size>
+            //used for messages to peers that answered a path mtu probe
+            const size_t CHUNK_SIZE_BASE = MESSAGE_BASE;
+            const size_t EXT_MESSAGE_BASE = CHUNK_SIZE_BASE + sizeof(chunk_size_type);
+            const size_t EXT_HEADER_SIZE = EXT_MESSAGE_BASE;
+            const size_t MAX_CHUNK_SIZE = MAX_UDP_BUFF_SIZE - EXT_HEADER_SIZE;
+
+            //<mark> <sequence num> <message_chunk total> <group start> <chunk size> <group size> <last chunk size>
+            //parity of one group of data chunks of an unreliable message
+            const size_t PARITY_GROUP_BASE = CHUNK_SIZE_BASE + sizeof(chunk_size_type);
+            const size_t PARITY_LAST_BASE = PARITY_GROUP_BASE + sizeof(chunk_id_type);
+            const size_t PARITY_MESSAGE_BASE = PARITY_LAST_BASE + sizeof(chunk_size_type);
+            const size_t PARITY_HEADER_SIZE = PARITY_MESSAGE_BASE;
+
             const size_t MAX_CHUNKS = std::pow(2,sizeof(chunk_total_type)*8);
             const size_t MAX_MESSAGE_SIZE = MAX_CHUNKS * UDP_CHuNK_SIZE;
+
+            const size_t MAX_SACK_BITS = UDP_CHuNK_SIZE * 8;
+            const size_t MAX_SENT_SACK_BITS = CONTROL_PAYLOAD_SIZE * 8; //bitmap is sent inline
+            const size_t COMPLETED_HISTORY = 1024; //completed unreliable messages to remember
+
+            //<mark> [<frame size> <frame>]...
+            //several small frames to the same peer packed in one datagram.
+            //peers announce they can unpack them with a feature bit in the
+            //sequence of probes and probe acks, which old peers leave at 0.
+            const char BUNDLE_MARK = '&';
+            const size_t BUNDLE_FRAME_OVERHEAD = sizeof(uint16_t);
+            const sequence_type FEATURE_BUNDLES = 1;
+
+            //peers that announce this get sack frames for robust messages,
+            //others get one ack per chunk
+            const sequence_type FEATURE_SACKS = 2;
+            const sequence_type FEATURES = FEATURE_BUNDLES | FEATURE_SACKS;
         }
 
-        udp_queue_ptr create_udp_queue(const asio_params& p)
+        udp_queue_ptr create_udp_queue(const asio_params& p, inbound_queue* sink)
         {
-            return udp_queue_ptr{new udp_queue{p}};
+            return udp_queue_ptr{new udp_queue{p, sink}};
         }
 
         udp_connection::udp_connection(
                 endpoint_queue& in,
-                boost::asio::io_service& io) :
+                inbound_queue* sink,
+                boost::asio::io_service& io,
+                bool batch_io,
+                size_t fec_group,
+                double loss,
+                double bundle_delay) :
             _in_buffer(MAX_UDP_BUFF_SIZE),
             _in_queue(in),
+            _sink(sink),
+            _bundle_timer{io},
+            _resend_timer{io},
+            _ack_timer{io},
             _io(io),
             _socket{new udp::socket{io}},
-            _writing{false}
+            _writing{false},
+#ifdef __linux__
+            _batch_io{batch_io},
+#else
+            _batch_io{false},
+#endif
+            _fec_group{fec_group},
+            _loss{loss},
+            _bundle_delay{bundle_delay}
         {
             boost::system::error_code error;
             _socket->open(udp::v4(), error);
 
+            if(_batch_io)
+            {
+                _in_slab.resize(IO_BATCH_SIZE * MAX_UDP_BUFF_SIZE);
+                _in_batch_endpoints.resize(IO_BATCH_SIZE);
+                _out_batch.resize(IO_BATCH_SIZE);
+                _out_batch_endpoints.resize(IO_BATCH_SIZE);
+            }
+
             INVARIANT(_socket);
+            INVARIANT(!_batch_io || _in_slab.size() == IO_BATCH_SIZE * MAX_UDP_BUFF_SIZE);
         }
 
         void udp_connection::close()
@@ -100,10 +187,21 @@ namespace fire
         void udp_connection::do_close()
         {
             INVARIANT(_socket);
+            _resend_timer.cancel();
+            _ack_timer.cancel();
+            _bundle_timer.cancel();
             _socket->close();
             _writing = false;
         }
 
+        //unreliable messages are assumed to be realtime (voice, pings), small
+        //robust messages are control traffic and everything else is bulk
+        priority_class message_priority(const message_chunk& proto)
+        {
+            if(proto.type == message_chunk::qmsg) return realtime;
+            return proto.total_chunks == 1 ? control : bulk;
+        }
+
         void udp_connection::init_working(message_chunk& proto, util::bytes& data)
         {
             REQUIRE_GREATER(proto.total_chunks, 0);
@@ -113,36 +211,348 @@ namespace fire
 
             wm.proto = std::move(proto);
             wm.data = std::move(data);
-            wm.set.resize(proto.total_chunks);
-            wm.sent.resize(proto.total_chunks);
+            wm.set.resize(wm.proto.total_chunks);
+            wm.sent.resize(wm.proto.total_chunks);
+            wm.resent.resize(wm.proto.total_chunks);
+            wm.sent_at.resize(wm.proto.total_chunks);
+            wm.last_progress = udp_clock::now();
+            wm.peer = &peer_state(wm.proto.host, wm.proto.port);
+            wm.priority = message_priority(wm.proto);
+
+            auto& l = wm.peer->messages[wm.priority];
+            wm.ring_pos = l.insert(l.end(), message_ring_item{&wm, chunk_id_queue()});
+            activate_peer(*wm.peer);
+
+            start_resend_timer();
+        }
+
+        endpoint_id udp_connection::intern_endpoint(const std::string& host, port_type port)
+        {
+            const auto now = udp_clock::now();
+            auto key = host + ":" + port_to_string(port);
+            auto i = _endpoint_ids.find(key);
+            if(i != _endpoint_ids.end()) 
+            {
+                _endpoint_seen[i->second] = now;
+                return i->second;
+            }
+
+            //any source address gets an endpoint, forget the quiet ones
+            //each time the table doubles
+            if(_endpoint_ids.size() >= 2 * std::max(_endpoints_pruned_size, MIN_ENDPOINT_PRUNE)) 
+                prune_endpoints(now);
+
+            const udp::endpoint e{address::from_string(host), port};
+            endpoint_id id = 0;
+            if(_free_endpoints.empty())
+            {
+                id = _endpoints.size();
+                _endpoints.push_back(e);
+                _bundle_sizes.push_back(0);
+                _sack_peers.push_back(false);
+                _endpoint_seen.push_back(now);
+            }
+            else
+            {
+                id = _free_endpoints.back();
+                _free_endpoints.pop_back();
+                _endpoints[id] = e;
+                _bundle_sizes[id] = 0;
+                _sack_peers[id] = false;
+                _endpoint_seen[id] = now;
+            }
+            _endpoint_ids[key] = id;
+
+            ENSURE_LESS(id, _endpoints.size());
+            ENSURE_EQUAL(_bundle_sizes.size(), _endpoints.size());
+            ENSURE_EQUAL(_sack_peers.size(), _endpoints.size());
+            ENSURE_EQUAL(_endpoint_seen.size(), _endpoints.size());
+            return id;
+        }
+
+        chunk_ref control_chunk(message_chunk::msg_type type, endpoint_id ep)
+        {
+            chunk_ref c;
+            std::memset(&c, 0, sizeof(c));
+            c.type = type;
+            c.ep = ep;
+            return c;
+        }
+
+        congestion_state& udp_connection::peer_state(const std::string& host, port_type port)
+        {
+            auto key = host + ":" + port_to_string(port);
+            auto p = _peers.find(key);
+            if(p != _peers.end()) 
+            {
+                _endpoint_seen[p->second.ep] = udp_clock::now();
+                return p->second;
+            }
+
+            //interning may prune idle peers, so it goes first
+            const auto ep = intern_endpoint(host, port);
+
+            auto& n = _peers[key];
+            n.host = host;
+            n.port = port;
+            n.ep = ep;
+            n.cwnd = INITIAL_WINDOW;
+            n.ssthresh = MAX_WINDOW;
+            n.rto = INITIAL_RTO;
+            n.packet_size = UDP_PACKET_SIZE;
+
+            //see if the path takes bigger packets
+            probe_path(n, udp_clock::now());
+            return n;
+        }
+
+        size_t next_probe_size(size_t packet_size)
+        {
+            for(auto s : PROBE_SIZES) if(s > packet_size) return s;
+            return 0;
+        }
+
+        size_t prev_probe_size(size_t packet_size)
+        {
+            size_t prev = UDP_PACKET_SIZE;
+            for(auto s : PROBE_SIZES) if(s < packet_size) prev = s;
+            return prev;
+        }
+
+        void udp_connection::probe_path(congestion_state& p, time_point now)
+        {
+            p.probe_size = next_probe_size(p.packet_size);
+            if(p.probe_size == 0) return;
+
+            CHECK_GREATER(p.probe_size, HEADER_SIZE);
+            CHECK_LESS_EQUAL(p.probe_size, MAX_UDP_BUFF_SIZE);
+
+            //the probe is padded to the size we want to try. only
+            //peers that understand extended headers answer it
+            auto probe = control_chunk(message_chunk::probe, p.ep);
+            probe.sequence = FEATURES;
+            probe.chunk = p.probe_size;
+            probe.size = p.probe_size - HEADER_SIZE;
+
+            if(!queue_control(probe)) return;
+
+            p.probe_sent = now;
+            p.probe_tries++;
+        }
+
+        void udp_connection::check_probes(time_point now)
+        {
+            bool sent = false;
+            for(auto& pp : _peers)
+            {
+                auto& p = pp.second;
+                if(p.probe_size == 0) continue;
+
+                auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(now - p.probe_sent).count();
+                if(waited < std::max(p.rto, MIN_PROBE_TIMEOUT)) continue;
+
+                //give up on this size, stay where we are
+                if(p.probe_tries >= MAX_PROBE_TRIES) 
+                {
+                    p.probe_size = 0;
+                    continue;
+                }
+
+                probe_path(p, now);
+                sent = true;
+            }
+            if(sent) post_send();
+        }
+
+        void udp_connection::handle_probe_ack(const message_chunk& c, const endpoint& ep)
+        {
+            auto pi = _peers.find(ep.address + ":" + port_to_string(ep.port));
+            if(pi == _peers.end()) return;
+
+            auto& p = pi->second;
+            if(p.probe_size == 0 || c.chunk != p.probe_size) return;
+
+            //peer can unpack bundles as big as the path takes
+            if(c.sequence & FEATURE_BUNDLES) allow_bundles(p.ep, p.probe_size);
+            if(c.sequence & FEATURE_SACKS) _sack_peers[p.ep] = true;
+
+            //path takes this size, use it for new messages and try the next one
+            p.packet_size = p.probe_size;
+            p.probe_tries = 0;
+            probe_path(p, udp_clock::now());
+        }
+
+        void udp_connection::update_rtt(congestion_state& p, double r)
+        {
+            //RFC 6298 smoothed rtt and variance
+            if(p.srtt == 0)
+            {
+                p.srtt = r;
+                p.rttvar = r / 2;
+            }
+            else
+            {
+                p.rttvar = 0.75 * p.rttvar + 0.25 * std::fabs(p.srtt - r);
+                p.srtt = 0.875 * p.srtt + 0.125 * r;
+            }
+            p.rto = std::min(MAX_RTO, std::max(MIN_RTO, p.srtt + 4 * p.rttvar));
+        }
+
+        void udp_connection::increase_window(congestion_state& p)
+        {
+            //slow start until the first loss, then additive increase
+            if(p.cwnd < p.ssthresh) p.cwnd += 1;
+            else p.cwnd += 1 / p.cwnd;
+            p.cwnd = std::min(p.cwnd, MAX_WINDOW);
+        }
+
+        void udp_connection::decrease_window(congestion_state& p, time_point now)
+        {
+            //only back off once per round trip so one burst of loss
+            //does not collapse the window
+            auto since = std::chrono::duration_cast<std::chrono::milliseconds>(now - p.last_decrease).count();
+            if(since < std::max(p.srtt, MIN_RTO)) return;
+
+            p.ssthresh = std::max(p.cwnd / 2, MIN_WINDOW);
+            p.cwnd = p.ssthresh;
+            p.rto = std::min(p.rto * 2, MAX_RTO);
+            p.last_decrease = now;
+        }
+
+        bool has_messages(const congestion_state& p)
+        {
+            for(const auto& l : p.messages) if(!l.empty()) return true;
+            return false;
+        }
+
+        void udp_connection::activate_peer(congestion_state& p)
+        {
+            if(p.active) return;
+            p.active_pos = _active_peers.insert(_active_peers.end(), &p);
+            p.deficit = 0;
+            p.active = true;
+        }
+
+        void udp_connection::deactivate_peer(congestion_state& p)
+        {
+            if(!p.active) return;
+            _active_peers.erase(p.active_pos);
+            p.deficit = 0;
+            p.active = false;
+        }
+
+        void udp_connection::prune_endpoints(time_point now)
+        {
+            const auto idle = std::chrono::milliseconds(ENDPOINT_IDLE_EXPIRE);
+
+            //peers with nothing to send that went quiet
+            for(auto p = _peers.begin(); p != _peers.end();)
+            {
+                const auto& s = p->second;
+                if(!s.active && !has_messages(s) && now - _endpoint_seen[s.ep] >= idle) p = _peers.erase(p);
+                else p++;
+            }
+
+            //endpoints something still points at stay
+            endpoint_flags used(_endpoints.size(), false);
+            for(const auto& p : _peers) used[p.second.ep] = true;
+            for(const auto& a : _pending_acks) used[a.first.first] = true;
+            for(const auto& c : _out_control) used[c.ep] = true;
+            for(const auto& b : _bundles) used[b.ep] = true;
+            for(const auto& b : _ready_bundles) used[b.ep] = true;
+
+            endpoint_flags freed(_endpoints.size(), false);
+            for(auto i = _endpoint_ids.begin(); i != _endpoint_ids.end();)
+            {
+                const auto id = i->second;
+                if(used[id] || now - _endpoint_seen[id] < idle) 
+                {
+                    i++;
+                    continue;
+                }
+
+                freed[id] = true;
+                _free_endpoints.push_back(id);
+                i = _endpoint_ids.erase(i);
+            }
+
+            //a reused id must not match messages the old endpoint started
+            //or completed
+            for(auto w = _in_working.begin(); w != _in_working.end();)
+                if(freed[w->first.first]) w = _in_working.erase(w);
+                else w++;
+
+            completed_messages kept;
+            for(const auto& k : _in_completed.order)
+            {
+                if(freed[k.first]) continue;
+                kept.set.insert(k);
+                kept.order.push_back(k);
+            }
+            _in_completed = std::move(kept);
 
-            message_ring_item ri = { &wm,  chunk_id_queue()};
-            _message_ring.emplace_back(ri);
+            _endpoints_pruned_size = _endpoint_ids.size();
         }
 
         void udp_connection::cleanup_message(sequence_type s)
         {
-            //cleanup ring buffer
-            auto ring_iter = std::find_if(_message_ring.begin(), _message_ring.end(), 
-                    [s](const message_ring_item& i){ return i.wm->proto.sequence == s;});
-            CHECK(ring_iter != _message_ring.end());
+            auto wmi = _out_working.find(s);
+            CHECK(wmi != _out_working.end());
+
+            auto& wm = wmi->second;
+            CHECK(wm.peer);
+            auto& p = *wm.peer;
+
+            //whatever was still outstanding no longer counts against the window
+            if(wm.proto.type == message_chunk::msg)
+            {
+                auto outstanding = wm.in_flight + wm.queued;
+                p.in_flight = p.in_flight > outstanding ? p.in_flight - outstanding : 0;
+            }
+
+            //remove from the peer's schedule
+            p.messages[wm.priority].erase(wm.ring_pos);
+            if(!has_messages(p)) deactivate_peer(p);
+
+            //no longer holds up sends to the destination
+            {
+                std::lock_guard<std::mutex> l(_waiting_mutex);
+                auto w = _waiting.find(wm.proto.host + ":" + port_to_string(wm.proto.port));
+                if(w != _waiting.end() && --w->second == 0) _waiting.erase(w);
+            }
 
-            _message_ring.erase(ring_iter);
-            _out_working.erase(s);
+            _out_working.erase(wmi);
         }
 
         bool all_sent(working_message& wm)
         {
-            return wm.sent.count() == wm.proto.total_chunks;
+            return wm.sent.count() == wm.proto.total_chunks && wm.parity_sent == wm.parity.size();
+        }
+
+        bool is_control(const chunk_ref& c)
+        {
+            return c.type != message_chunk::msg && 
+                c.type != message_chunk::qmsg && 
+                c.type != message_chunk::parity;
         }
 
-        void udp_connection::sent_chunk(const message_chunk& c)
+        void udp_connection::sent_chunk(working_message& wm, const chunk_ref& c)
         {
-            REQUIRE(c.type != message_chunk::ack);
+            REQUIRE_FALSE(is_control(c));
             REQUIRE_FALSE(c.resent);
+            REQUIRE_EQUAL(wm.proto.sequence, c.sequence);
+
+            if(c.type == message_chunk::parity)
+            {
+                wm.parity_sent++;
+                _stats.parity_sent++;
+                if(wm.queued > 0) wm.queued--;
+                if(all_sent(wm)) cleanup_message(c.sequence);
+                return;
+            }
 
-            auto& wm = _out_working[c.sequence];
             wm.sent[c.chunk] = 1;
+            wm.sent_at[c.chunk] = udp_clock::now();
             if(wm.queued > 0) wm.queued--;
 
             bool robust = wm.proto.type == message_chunk::msg;
@@ -150,82 +560,268 @@ namespace fire
             else if(all_sent(wm)) cleanup_message(c.sequence);
         }
 
-        void udp_connection::validate_chunk(const message_chunk& c)
+        bool udp_connection::ack_chunk(working_message& wm, size_t chunk_n, time_point now)
         {
-            REQUIRE(c.type == message_chunk::ack);
+            REQUIRE_LESS(chunk_n, wm.proto.total_chunks);
+            if(wm.set[chunk_n] || !wm.sent[chunk_n]) return false;
 
-            auto& w = _out_working;
+            wm.set[chunk_n] = 1;
+            if(wm.in_flight > 0 ) wm.in_flight--;
+            while(wm.first_unacked < wm.proto.total_chunks && wm.set[wm.first_unacked]) 
+                wm.first_unacked++;
 
-            auto chunk_n = c.chunk;
-            auto sequence_n = c.sequence;
+            wm.last_progress = now;
 
-            auto wmi = w.find(sequence_n);
-            if(wmi == w.end()) return;
+            CHECK(wm.peer);
+            auto& p = *wm.peer;
+            if(p.in_flight > 0) p.in_flight--;
+            p.timeouts = 0;
 
-            auto& wm = wmi->second;
+            if(wm.sent_at[chunk_n] > p.newest_acked) p.newest_acked = wm.sent_at[chunk_n];
 
-            if(chunk_n >= wm.proto.total_chunks) return;
-            if(c.total_chunks != wm.proto.total_chunks) return;
-            if(wm.set[chunk_n]) return;
+            //Karn's algorithm, only sample rtt from chunks sent once
+            if(!wm.resent[chunk_n])
+            {
+                auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(now - wm.sent_at[chunk_n]).count();
+                update_rtt(p, rtt / 1000.0);
+            }
+            increase_window(p);
 
-            wm.set[chunk_n] = 1;
-            wm.ticks = 0;
-            if(wm.in_flight > 0 ) wm.in_flight--;
+            _stats.cwnd = p.cwnd;
+            _stats.srtt = p.srtt;
+            _stats.rto = p.rto;
+            _stats.packet_size = p.packet_size;
+            return true;
+        }
 
+        void udp_connection::finish_acked(working_message& wm)
+        {
             //if message is not complete yet, return 
-            if(wm.set.count() != wm.proto.total_chunks) return;
+            if(wm.first_unacked != wm.proto.total_chunks) return;
 
             CHECK_EQUAL(wm.sent.count(), wm.proto.total_chunks);
             CHECK_EQUAL(wm.in_flight, 0);
             CHECK_EQUAL(wm.queued, 0);
 
             //remove message from working
-            cleanup_message(sequence_n);
+            cleanup_message(wm.proto.sequence);
+        }
+
+        void udp_connection::validate_chunk(const message_chunk& c)
+        {
+            REQUIRE(c.type == message_chunk::ack);
+
+            auto wmi = _out_working.find(c.sequence);
+            if(wmi == _out_working.end()) return;
+
+            auto& wm = wmi->second;
+
+            if(c.chunk >= wm.proto.total_chunks) return;
+            if(c.total_chunks != wm.proto.total_chunks) return;
+
+            if(!ack_chunk(wm, c.chunk, udp_clock::now())) return;
+            finish_acked(wm);
+        }
+
+        void udp_connection::validate_sack(const message_chunk& c)
+        {
+            REQUIRE(c.type == message_chunk::sack);
+
+            auto wmi = _out_working.find(c.sequence);
+            if(wmi == _out_working.end()) return;
+
+            auto& wm = wmi->second;
+            const size_t total = wm.proto.total_chunks;
+            if(c.total_chunks != total) return;
+
+            //everything below the cumulative ack was received
+            auto now = udp_clock::now();
+            const size_t cumulative = std::min<size_t>(c.chunk, total);
+            for(size_t n = wm.first_unacked; n < cumulative; n++)
+                ack_chunk(wm, n, now);
+
+            //bit i of the bitmap is chunk cumulative + 1 + i
+            const size_t bits = std::min(c.size * 8, MAX_SACK_BITS);
+            for(size_t i = 0; i < bits; i++)
+            {
+                const size_t n = cumulative + 1 + i;
+                if(n >= total) break;
+
+                const auto b = static_cast<unsigned char>(c.data[i / 8]);
+                if(b & (1 << (i % 8))) ack_chunk(wm, n, now);
+            }
+
+            finish_acked(wm);
+        }
+
+        void udp_connection::queue_ack(const message_chunk& c, endpoint_id ep)
+        {
+            auto ack = control_chunk(message_chunk::ack, ep);
+            ack.sequence = c.sequence;
+            ack.total_chunks = c.total_chunks;
+            ack.chunk = c.chunk;
+
+            //a dropped ack is recovered by the sender resending the chunk
+            if(queue_control(ack)) _stats.acks_sent++;
+        }
+
+        void udp_connection::add_pending_ack(const message_chunk& c, endpoint_id ep)
+        {
+            auto& p = _pending_acks[peer_sequence{ep, c.sequence}];
+            p.total_chunks = c.total_chunks;
+        }
+
+        void udp_connection::flush_acks()
+        {
+            for(const auto& pa : _pending_acks)
+            {
+                const auto& p = pa.second;
+
+                auto sack = control_chunk(message_chunk::sack, pa.first.first);
+                sack.sequence = pa.first.second;
+                sack.total_chunks = p.total_chunks;
+
+                auto wmi = _in_working.find(pa.first);
+                if(p.complete) sack.chunk = p.total_chunks;
+                else if(wmi == _in_working.end() || wmi->second.proto.total_chunks != p.total_chunks) 
+                {
+                    //the chunk was not taken, the sender resends it
+                    continue;
+                }
+                else
+                {
+                    const auto& wm = wmi->second;
+                    sack.chunk = wm.first_unacked;
+
+                    //selective bits for whatever was received past the first gap
+                    const size_t start = wm.first_unacked + 1;
+                    if(wm.received_end > start)
+                    {
+                        const size_t bits = std::min(wm.received_end - start, MAX_SENT_SACK_BITS);
+                        sack.size = (bits + 7) / 8;
+                        for(size_t i = 0; i < bits; i++)
+                            if(wm.set[start + i]) sack.payload[i / 8] |= (1 << (i % 8));
+                    }
+                }
+
+                if(queue_control(sack)) _stats.acks_sent++;
+            }
+            _pending_acks.clear();
+        }
+
+        void udp_connection::start_ack_timer()
+        {
+            if(_ack_timer_running) return;
+            _ack_timer_running = true;
+
+            _ack_timer.expires_from_now(std::chrono::milliseconds(ACK_DELAY));
+            _ack_timer.async_wait(
+                    boost::bind(&udp_connection::handle_ack_timer, this,
+                        boost::asio::placeholders::error));
         }
 
-        void udp_connection::send_right_away(message_chunk& c)
+        void udp_connection::handle_ack_timer(const boost::system::error_code& error)
         {
-            _out_queue.emplace_push(c);
+            _ack_timer_running = false;
+            if(error == ba::error::operation_aborted) return;
+            if(_pending_acks.empty()) return;
+
+            flush_acks();
             post_send();
         }
 
 
-        message_chunk nth_chunk(size_t n, const message_chunk& prototype, const util::bytes& data)
+        chunk_ref nth_chunk(size_t n, const working_message& wm)
         {
+            const auto& prototype = wm.proto;
             REQUIRE_LESS(n, prototype.total_chunks);
+            REQUIRE(wm.peer);
 
-            size_t start = n * UDP_CHuNK_SIZE;
-            size_t end = std::min(data.size(), start + UDP_CHuNK_SIZE);
+            const size_t chunk_size = prototype.chunk_size > 0 ? prototype.chunk_size : UDP_CHuNK_SIZE;
+            size_t start = n * chunk_size;
+            size_t end = std::min(wm.data.size(), start + chunk_size);
             size_t size = end - start; 
 
             CHECK_GREATER(size, 0);
 
-            message_chunk c = prototype;
+            chunk_ref c;
+            c.sequence = prototype.sequence;
+            c.total_chunks = prototype.total_chunks;
             c.chunk = n;
-            c.write_size = size;
-            c.write_data = data.data() + start;
+            c.chunk_size = prototype.chunk_size;
+            c.group_size = 0;
+            c.last_size = 0;
+            c.type = prototype.type;
+            c.resent = false;
+            c.ep = wm.peer->ep;
+            c.data = wm.data.data() + start;
+            c.size = size;
 
             ENSURE_EQUAL(c.chunk, n);
-            ENSURE(c.write_data);
-            ENSURE_GREATER(c.write_size, 0);
+            ENSURE(c.data);
+            ENSURE_GREATER(c.size, 0);
+            return c;
+        }
+
+        size_t group_end(size_t group, const working_message& wm)
+        {
+            return std::min<size_t>((group + 1) * wm.group_size, wm.proto.total_chunks);
+        }
+
+        chunk_ref parity_chunk(size_t group, const working_message& wm)
+        {
+            REQUIRE_LESS(group, wm.parity.size());
+            REQUIRE(wm.peer);
+
+            const auto& b = wm.parity[group];
+
+            chunk_ref c;
+            c.sequence = wm.proto.sequence;
+            c.total_chunks = wm.proto.total_chunks;
+            c.chunk = group * wm.group_size;
+            c.chunk_size = wm.proto.chunk_size;
+            c.group_size = wm.group_size;
+            c.last_size = wm.last_size;
+            c.type = message_chunk::parity;
+            c.resent = false;
+            c.ep = wm.peer->ep;
+            c.data = b.data();
+            c.size = b.size();
+
+            ENSURE(c.data);
+            ENSURE_GREATER(c.size, 0);
             return c;
         }
 
-        bool udp_connection::get_next_chunk(working_message& wm, message_chunk& queued_chunk)
+        bool udp_connection::get_next_chunk(working_message& wm, chunk_ref& queued_chunk)
         {
             REQUIRE_GREATER(wm.proto.total_chunks, 0);
-            bool robust = wm.proto.type == message_chunk::msg;
+            REQUIRE(wm.peer);
+
+            //parity goes out right after the last data chunk of its group
+            if(wm.next_parity < wm.parity.size() && wm.next_send >= group_end(wm.next_parity, wm))
+            {
+                if(wm.queued >= MAX_QUEUED) return false;
 
-            auto in_flight = robust ? wm.in_flight : 0;
+                queued_chunk = parity_chunk(wm.next_parity, wm);
+                wm.next_parity++;
+                wm.queued++;
+                return true;
+            }
 
-            if(in_flight + wm.queued > MAX_FLIGHT) return false;
+            if(wm.next_send >= wm.proto.total_chunks) return false;
 
-            auto t = MAX_FLIGHT - (in_flight + wm.queued);
-            CHECK_GREATER_EQUAL(t, 0);
-            if(t == 0 || wm.next_send >= wm.proto.total_chunks) 
-                return false;
+            //robust chunks are limited by the peer's congestion window.
+            bool robust = wm.proto.type == message_chunk::msg;
+            if(robust)
+            {
+                auto& p = *wm.peer;
+                if(p.in_flight >= static_cast<size_t>(p.cwnd)) return false;
+                p.in_flight++;
+            }
+            else if(wm.queued >= MAX_QUEUED) return false;
 
-            queued_chunk = nth_chunk(wm.next_send, wm.proto, wm.data);
+            queued_chunk = nth_chunk(wm.next_send, wm);
 
             wm.next_send++;
             wm.queued++;
@@ -234,79 +830,106 @@ namespace fire
 
         void udp_connection::queue_resend(message_ring_item& r, chunk_id_type nth)
         {
-            r.resends.emplace_push(nth);
+            r.resends.push_back(nth);
             post_send();
         }
 
-        bool udp_connection::incr_next_message()
+        using exhausted_messages = std::vector<sequence_type>;
+
+        bool udp_connection::next_peer_chunk(congestion_state& p, chunk_ref& c)
         {
-            if(_message_ring.empty())
+            //strict priority between classes, round robin between
+            //the messages of a class
+            for(auto& l : p.messages)
             {
-                _next_message = 0;
-                return false;
-            }
+                for(size_t n = l.size(); n > 0; n--)
+                {
+                    auto& r = l.front();
+                    CHECK(r.wm != nullptr);
+                    auto& wm = *r.wm;
 
-            //if at end, go to beginning
-            _next_message = (_next_message + 1) % _message_ring.size();
-            ENSURE_RANGE(_next_message, 0, _message_ring.size());
-            return true;
-        }
+                    //resends go first so lost chunks are recovered quickly
+                    bool got = false;
+                    if(!r.resends.empty())
+                    {
+                        c = nth_chunk(r.resends.front(), wm);
+                        c.resent = true;
+                        r.resends.pop_front();
+                        got = true;
+                    }
+                    else got = get_next_chunk(wm, c);
 
-        using exhausted_messages = std::vector<sequence_type>;
+                    //move the message to the back of its class
+                    l.splice(l.end(), l, l.begin());
+                    if(got) return true;
+                }
+            }
+            return false;
+        }
 
         void udp_connection::queue_next_chunk()
         {
-            //do round robin
-            if(!incr_next_message()) return;
-            auto end = _next_message;
+            if(_out_ring.full()) return;
 
-            message_chunk c;
-            chunk_id_type resend_id;
-            do
+            //deficit round robin over peers with messages. a peer keeps
+            //its turn until it spends its quantum or has nothing it can send
+            for(size_t n = _active_peers.size(); n > 0; n--)
             {
-                auto& r = _message_ring[_next_message];
-                CHECK(r.wm != nullptr);
-                auto& wm = *r.wm;
-                if(get_next_chunk(wm, c))
-                {
-                    _out_queue.emplace_push(c);
-                    break;
-                }
-                //check to see if there are resends
-                else if(r.resends.pop(resend_id))
+                auto& p = *_active_peers.front();
+                CHECK(p.active);
+
+                if(p.deficit <= 0) p.deficit += PEER_QUANTUM;
+
+                chunk_ref c;
+                if(next_peer_chunk(p, c))
                 {
-                    message_chunk mc = nth_chunk(resend_id, wm.proto, wm.data);
-                    mc.resent = true;
-                    _out_queue.emplace_push(mc);
-                    break;
+                    p.deficit -= c.size;
+                    bool pushed = _out_ring.push(c);
+                    CHECK(pushed);
+
+                    if(p.deficit <= 0) _active_peers.splice(_active_peers.end(), _active_peers, p.active_pos);
+                    return;
                 }
-                incr_next_message();
+
+                //blocked peers don't get to save up
+                p.deficit = 0;
+                _active_peers.splice(_active_peers.end(), _active_peers, p.active_pos);
             }
-            while(_next_message != end);
         }
 
-        chunk_total_type total_chunks(size_t data_size)
+        chunk_total_type total_chunks(size_t data_size, size_t chunk_size)
         {
             REQUIRE_GREATER(data_size, 0);
+            REQUIRE_GREATER(chunk_size, 0);
 
-            chunk_total_type r = (data_size / UDP_CHuNK_SIZE);
-            if(data_size % UDP_CHuNK_SIZE) r += 1;
+            chunk_total_type r = (data_size / chunk_size);
+            if(data_size % chunk_size) r += 1;
 
             ENSURE_GREATER(r, 0);
             return r;
         }
 
-        message_chunk create_prototype(sequence_type sequence, const endpoint_message& m)
+        message_chunk create_prototype(sequence_type sequence, const endpoint_message& m, size_t packet_size, bool fec)
         {
+            REQUIRE_GREATER_EQUAL(packet_size, UDP_PACKET_SIZE);
+
             message_chunk c;
             c.valid = true;
             c.type = m.robust ? message_chunk::msg : message_chunk::qmsg;
             c.host = m.ep.address;
             c.port = m.ep.port;
             c.sequence = sequence;
-            c.total_chunks = total_chunks(m.data.size());
             c.chunk = 0;
 
+            //bigger packets carry their chunk size in an extended header.
+            //with fec the chunks leave room for the bigger parity header
+            if(packet_size > UDP_PACKET_SIZE)
+            {
+                c.chunk_size = packet_size - (fec ? PARITY_HEADER_SIZE : EXT_HEADER_SIZE);
+                c.total_chunks = total_chunks(m.data.size(), c.chunk_size);
+            }
+            else c.total_chunks = total_chunks(m.data.size(), UDP_CHuNK_SIZE);
+
             return c;
         }
 
@@ -322,8 +945,48 @@ namespace fire
             //update sequence
             _sequence++;
 
-            message_chunk proto = create_prototype(_sequence, m);
+            auto& peer = peer_state(m.ep.address, m.ep.port);
+
+            //only peers that answered an mtu probe understand parity chunks
+            const bool fec = _fec_group > 0 && !m.robust && peer.packet_size > UDP_PACKET_SIZE;
+
+            const auto sequence = _sequence;
+            message_chunk proto = create_prototype(sequence, m, peer.packet_size, fec);
+
+            //a single chunk is its own parity, size it to the message so 
+            //the copy is no bigger than the data
+            if(fec && proto.total_chunks == 1) proto.chunk_size = m.data.size();
             init_working(proto, m.data);
+
+            if(fec) add_parity(_out_working[sequence]);
+        }
+
+        void udp_connection::add_parity(working_message& wm)
+        {
+            REQUIRE_GREATER(_fec_group, 0);
+            REQUIRE_GREATER(wm.proto.total_chunks, 0);
+            REQUIRE_GREATER(wm.proto.chunk_size, 0);
+            REQUIRE(wm.parity.empty());
+
+            const size_t chunk_size = wm.proto.chunk_size;
+            const size_t total = wm.proto.total_chunks;
+
+            wm.group_size = _fec_group;
+            wm.last_size = wm.data.size() - (total - 1) * chunk_size;
+
+            //xor the chunks of each group, the short last chunk is zero padded
+            const size_t groups = (total + wm.group_size - 1) / wm.group_size;
+            wm.parity.resize(groups, u::bytes(chunk_size, 0));
+            for(size_t n = 0; n < total; n++)
+            {
+                auto& b = wm.parity[n / wm.group_size];
+                const size_t start = n * chunk_size;
+                const size_t size = std::min(chunk_size, wm.data.size() - start);
+                for(size_t i = 0; i < size; i++) b[i] ^= wm.data[start + i];
+            }
+
+            ENSURE_EQUAL(wm.parity.size(), groups);
+            ENSURE_GREATER(wm.last_size, 0);
         }
 
         bool udp_connection::send(const endpoint_message& m, bool block)
@@ -336,15 +999,29 @@ namespace fire
                 return false;
             }
 
+            {
+                std::lock_guard<std::mutex> l(_waiting_mutex);
+                _waiting[m.ep.address + ":" + port_to_string(m.ep.port)]++;
+            }
+
             _io.post(boost::bind(&udp_connection::add_to_working_set, this, m));
             _io.post(boost::bind(&udp_connection::do_send, this));
 
-            //if we are blocking, block until all messages are sent
-            while(block && !_out_queue.empty()) u::sleep_thread(BLOCK_SLEEP);
+            //if we are blocking, block until all messages to the peer are 
+            //done. The chunk ring belongs to the io thread, so the count 
+            //under _waiting_mutex is what is polled here.
+            while(block && backlog(m.ep) > 0) u::sleep_thread(BLOCK_SLEEP);
 
             return true;
         }
 
+        size_t udp_connection::backlog(const endpoint& ep) const
+        {
+            std::lock_guard<std::mutex> l(_waiting_mutex);
+            auto w = _waiting.find(ep.address + ":" + port_to_string(ep.port));
+            return w != _waiting.end() ? w->second : 0;
+        }
+
         void write_be_u64(u::bytes& b, size_t offset, uint64_t v)
         {
             REQUIRE_GREATER_EQUAL(b.size() - offset, sizeof(uint64_t));
@@ -387,9 +1064,10 @@ namespace fire
             b[offset + 1] =  v        & 0xFF;
         }
 
-        void read_be_u64(const u::bytes& b, size_t offset, uint64_t& v)
+        void read_be_u64(const char* b, size_t size, size_t offset, uint64_t& v)
         {
-            REQUIRE_GREATER_EQUAL(b.size() - offset, sizeof(uint64_t));
+            REQUIRE(b);
+            REQUIRE_GREATER_EQUAL(size - offset, sizeof(uint64_t));
 
             uint64_t v8 = static_cast<unsigned char>(b[offset]);
             uint64_t v7 = static_cast<unsigned char>(b[offset + 1]);
@@ -439,25 +1117,34 @@ namespace fire
                 v1;
         }
 
-        void read_be_u16(const u::bytes& b, size_t offset, uint16_t& v)
+        void read_be_u16(const char* b, size_t size, size_t offset, uint16_t& v)
         {
-            REQUIRE_GREATER_EQUAL(b.size() - offset, sizeof(uint16_t));
+            REQUIRE(b);
+            REQUIRE_GREATER_EQUAL(size - offset, sizeof(uint16_t));
             uint16_t v2 = static_cast<unsigned char>(b[offset]);
             uint16_t v1 = static_cast<unsigned char>(b[offset + 1]);
 
             v = (v2 <<  8) | v1;
         }
 
-        void encode_udp_wire(u::bytes& r, const message_chunk& ch)
+        void encode_udp_wire(u::bytes& r, const chunk_ref& ch)
         {
-            r.resize(HEADER_SIZE + ch.write_size);
+            const bool parity = ch.type == message_chunk::parity;
+            const bool extended = ch.chunk_size > 0;
+            const size_t base = parity ? PARITY_MESSAGE_BASE : extended ? EXT_MESSAGE_BASE : MESSAGE_BASE;
+            REQUIRE(!parity || extended);
+            r.resize(base + ch.size);
 
             //set mark
             switch(ch.type)
             {
-                case message_chunk::msg: r[0] = '!'; break;
-                case message_chunk::qmsg: r[0] = '='; break;
+                case message_chunk::msg: r[0] = extended ? '+' : '!'; break;
+                case message_chunk::qmsg: r[0] = extended ? '-' : '='; break;
                 case message_chunk::ack: r[0] = '@'; break;
+                case message_chunk::sack: r[0] = '#'; break;
+                case message_chunk::probe: r[0] = '?'; break;
+                case message_chunk::probe_ack: r[0] = '~'; break;
+                case message_chunk::parity: r[0] = '^'; break;
                 default: CHECK(false && "missed case");
             }
 
@@ -470,14 +1157,32 @@ namespace fire
             //write message_chunk number
             write_be_u16(r, CHUNK_BASE, ch.chunk);
 
+            //write chunk size
+            if(extended) write_be_u16(r, CHUNK_SIZE_BASE, ch.chunk_size);
+
+            //write parity group
+            if(parity)
+            {
+                write_be_u16(r, PARITY_GROUP_BASE, ch.group_size);
+                write_be_u16(r, PARITY_LAST_BASE, ch.last_size);
+            }
+
             //write message
-            if(ch.write_size > 0 && ch.write_data != nullptr) 
-                std::copy(ch.write_data, ch.write_data + ch.write_size, r.begin() + MESSAGE_BASE);
+            if(ch.data != nullptr) 
+                std::copy(ch.data, ch.data + ch.size, r.begin() + base);
+            else
+            {
+                const size_t inline_size = std::min<size_t>(ch.size, CONTROL_PAYLOAD_SIZE);
+                std::copy(ch.payload, ch.payload + inline_size, r.begin() + base);
+                std::fill(r.begin() + base + inline_size, r.end(), 0);
+            }
         }
 
-        message_chunk decode_udp_wire(const u::bytes& b)
+        //the decoded chunk points into b for its payload
+        message_chunk decode_udp_wire(const char* b, size_t size)
         {
-            REQUIRE_GREATER_EQUAL(b.size(), HEADER_SIZE);
+            REQUIRE(b);
+            REQUIRE_GREATER_EQUAL(size, HEADER_SIZE);
 
             message_chunk ch;
             ch.valid = false;
@@ -488,37 +1193,63 @@ namespace fire
             {
                 case '!': ch.type = message_chunk::msg; break;
                 case '=': ch.type = message_chunk::qmsg; break;
+                case '+': ch.type = message_chunk::msg; break;
+                case '-': ch.type = message_chunk::qmsg; break;
                 case '@': ch.type = message_chunk::ack; break;
+                case '#': ch.type = message_chunk::sack; break;
+                case '?': ch.type = message_chunk::probe; break;
+                case '~': ch.type = message_chunk::probe_ack; break;
+                case '^': ch.type = message_chunk::parity; break;
                 default: return ch;
             }
+            const bool parity = mark == '^';
+            const bool extended = mark == '+' || mark == '-' || parity;
 
             //read sequence number
-            if(b.size() < SEQUENCE_BASE + sizeof(sequence_type)) return ch;
-            read_be_u64(b, SEQUENCE_BASE, ch.sequence);
+            if(size < SEQUENCE_BASE + sizeof(sequence_type)) return ch;
+            read_be_u64(b, size, SEQUENCE_BASE, ch.sequence);
 
             //write total chunks 
-            if(b.size() < CHUNK_TOTAL_BASE + sizeof(chunk_total_type)) return ch;
-            read_be_u16(b, CHUNK_TOTAL_BASE, ch.total_chunks);
+            if(size < CHUNK_TOTAL_BASE + sizeof(chunk_total_type)) return ch;
+            read_be_u16(b, size, CHUNK_TOTAL_BASE, ch.total_chunks);
 
             //cannot be more than max chunks, this should be impossible because
             //total_chunks should be a unsigned short
             CHECK_LESS_EQUAL(ch.total_chunks, MAX_CHUNKS);
 
             //read message_chunk number
-            if(b.size() < CHUNK_BASE + sizeof(chunk_id_type)) return ch;
-            read_be_u16(b, CHUNK_BASE, ch.chunk);
+            if(size < CHUNK_BASE + sizeof(chunk_id_type)) return ch;
+            read_be_u16(b, size, CHUNK_BASE, ch.chunk);
 
-            //copy message
-            CHECK_GREATER_EQUAL(b.size(), HEADER_SIZE);
-            const size_t data_size = b.size() - HEADER_SIZE;
+            //read chunk size
+            size_t base = MESSAGE_BASE;
+            if(extended)
+            {
+                if(size < CHUNK_SIZE_BASE + sizeof(chunk_size_type)) return ch;
+                read_be_u16(b, size, CHUNK_SIZE_BASE, ch.chunk_size);
+                if(ch.chunk_size == 0 || ch.chunk_size > MAX_CHUNK_SIZE) return ch;
+                base = EXT_MESSAGE_BASE;
+            }
 
-            if(data_size > 0)
+            //read parity group
+            if(parity)
             {
-                if(data_size > MAX_UDP_BUFF_SIZE) return ch;
-                ch.data.resize(data_size);
-                std::copy(b.begin() + MESSAGE_BASE, b.end(), ch.data.begin());
+                if(size < PARITY_MESSAGE_BASE) return ch;
+                read_be_u16(b, size, PARITY_GROUP_BASE, ch.group_size);
+                read_be_u16(b, size, PARITY_LAST_BASE, ch.last_size);
+                if(ch.group_size == 0 || ch.last_size == 0 || ch.last_size > ch.chunk_size) return ch;
+                if(size - PARITY_MESSAGE_BASE != ch.chunk_size) return ch;
+                base = PARITY_MESSAGE_BASE;
             }
 
+            //point at message, it gets copied once into its final spot
+            CHECK_GREATER_EQUAL(size, base);
+            const size_t data_size = size - base;
+
+            if(data_size > MAX_UDP_BUFF_SIZE) return ch;
+            ch.data = b + base;
+            ch.size = data_size;
+
             ch.valid = true;
 
             return ch;
@@ -527,27 +1258,222 @@ namespace fire
         void udp_connection::do_send()
         {
             ENSURE(_socket);
+            if(_batch_io) 
+            {
+                do_batch_send();
+                publish_stats();
+                return;
+            }
 
-            if(_out_queue.empty()) queue_next_chunk();
-            if(_out_queue.empty()) return;
+            udp::endpoint to;
+            if(!next_frame(_out_buffer, to)) 
+            {
+                publish_stats();
+                return;
+            }
 
-            //encode bytes to wire format
-            message_chunk message_chunk;
-            bool got = _out_queue.pop(message_chunk);
-            CHECK(got);
-
-            encode_udp_wire(_out_buffer, message_chunk);
             _stats.bytes_sent += _out_buffer.size();
+            _stats.packets_sent++;
+            _stats.send_calls++;
+            publish_stats();
 
             //async send message_chunk
-            udp::endpoint ep(address::from_string(message_chunk.host), message_chunk.port);
-            _socket->async_send_to(ba::buffer(_out_buffer.data(), _out_buffer.size()), ep,
+            _socket->async_send_to(ba::buffer(_out_buffer.data(), _out_buffer.size()), to,
                     boost::bind(&udp_connection::handle_write, this, ba::placeholders::error));
+        }
+
+        bool udp_connection::next_frame(u::bytes& r, udp::endpoint& to)
+        {
+            //bundles that filled up go first
+            if(pop_ready_bundle(r, to)) return true;
+
+            chunk_ref c;
+            working_message* wm = nullptr;
+            while(next_datagram(c, wm))
+            {
+                //pretend the network lost it
+                if(simulate_loss())
+                {
+                    if(wm && !c.resent) sent_chunk(*wm, c);
+                    continue;
+                }
+
+                //encode bytes to wire format
+                encode_udp_wire(r, c);
+                if(c.resent) _stats.retransmits++;
+
+                //ignore acks or resends
+                if(wm && !c.resent) sent_chunk(*wm, c);
+
+                //small frames wait for others to the same peer
+                if(add_to_bundle(c.ep, r))
+                {
+                    if(pop_ready_bundle(r, to)) return true;
+                    continue;
+                }
+
+                //bundles past their deadline go right after this frame
+                flush_bundles(udp_clock::now());
+
+                CHECK_LESS(c.ep, _endpoints.size());
+                to = _endpoints[c.ep];
+                return true;
+            }
+
+            //nothing left queued, bundles go out when their deadline is up
+            flush_bundles(udp_clock::now());
+            return pop_ready_bundle(r, to);
+        }
+
+        bool udp_connection::add_to_bundle(endpoint_id ep, const u::bytes& frame)
+        {
+            REQUIRE_LESS(ep, _bundle_sizes.size());
+            REQUIRE_FALSE(frame.empty());
+
+            const size_t limit = _bundle_sizes[ep];
+            if(limit == 0 || frame.size() > MAX_BUNDLED_FRAME) return false;
+            if(1 + BUNDLE_FRAME_OVERHEAD + frame.size() > limit) return false;
+
+            auto b = std::find_if(_bundles.begin(), _bundles.end(),
+                    [ep](const frame_bundle& f) { return f.ep == ep;});
+
+            //full bundles are ready to go, start a new one
+            if(b != _bundles.end() && b->data.size() + BUNDLE_FRAME_OVERHEAD + frame.size() > limit)
+            {
+                _ready_bundles.emplace_back(std::move(*b));
+                _bundles.erase(b);
+                b = _bundles.end();
+            }
+
+            if(b == _bundles.end())
+            {
+                _bundles.emplace_back();
+                b = _bundles.end() - 1;
+                b->ep = ep;
+                b->data.assign(1, BUNDLE_MARK);
+                b->started = udp_clock::now();
+            }
+
+            const size_t offset = b->data.size();
+            b->data.resize(offset + BUNDLE_FRAME_OVERHEAD + frame.size());
+            write_be_u16(b->data, offset, frame.size());
+            std::copy(frame.begin(), frame.end(), b->data.begin() + offset + BUNDLE_FRAME_OVERHEAD);
+            b->frames++;
+
+            ENSURE_LESS_EQUAL(b->data.size(), limit);
+            return true;
+        }
+
+        bool udp_connection::pop_ready_bundle(u::bytes& r, udp::endpoint& to)
+        {
+            if(_ready_bundles.empty()) return false;
+
+            auto& b = _ready_bundles.front();
+            CHECK_GREATER(b.frames, 0);
+            CHECK_LESS(b.ep, _endpoints.size());
+
+            //a bundle of one goes out as the plain frame
+            if(b.frames == 1) r.assign(b.data.begin() + 1 + BUNDLE_FRAME_OVERHEAD, b.data.end());
+            else
+            {
+                r.swap(b.data);
+                _stats.bundled += b.frames;
+            }
+
+            to = _endpoints[b.ep];
+            _ready_bundles.pop_front();
+            return true;
+        }
+
+        void udp_connection::flush_bundles(time_point now)
+        {
+            using namespace std::chrono;
+
+            //bundles that waited long enough are ready, the rest wait for the timer
+            auto next = now;
+            for(auto b = _bundles.begin(); b != _bundles.end();)
+            {
+                auto deadline = b->started + duration_cast<udp_clock::duration>(duration<double, std::micro>(_bundle_delay));
+                if(deadline <= now)
+                {
+                    _ready_bundles.emplace_back(std::move(*b));
+                    b = _bundles.erase(b);
+                    continue;
+                }
+                if(next == now || deadline < next) next = deadline;
+                ++b;
+            }
+
+            if(_bundles.empty() || _bundle_timer_running) return;
+
+            _bundle_timer_running = true;
+            _bundle_timer.expires_at(next);
+            _bundle_timer.async_wait(boost::bind(&udp_connection::handle_bundle_timer, this, ba::placeholders::error));
+        }
+
+        void udp_connection::handle_bundle_timer(const boost::system::error_code& error)
+        {
+            _bundle_timer_running = false;
+            if(error) return;
+
+            post_send();
+        }
+
+        void udp_connection::allow_bundles(endpoint_id ep, size_t size)
+        {
+            REQUIRE_LESS(ep, _bundle_sizes.size());
+            _bundle_sizes[ep] = std::max(_bundle_sizes[ep], std::min(size, MAX_UDP_BUFF_SIZE));
+        }
+
+        bool udp_connection::simulate_loss()
+        {
+            if(_loss <= 0) return false;
+
+            std::uniform_real_distribution<double> percent(0, 100);
+            if(percent(_loss_rand) >= _loss) return false;
+
+            _stats.simulated_drops++;
+            return true;
+        }
 
-            //ignore acks or resends
-            if(!message_chunk.resent && message_chunk.type != message_chunk::ack)
-                sent_chunk(message_chunk);
+        bool udp_connection::queue_control(const chunk_ref& c)
+        {
+            REQUIRE(is_control(c));
 
+            //the peer recovers lost control frames, same as lost datagrams
+            if(_out_control.size() >= CONTROL_QUEUE_SIZE)
+            {
+                _stats.dropped++;
+                return false;
+            }
+
+            _out_control.push_back(c);
+            return true;
+        }
+
+        bool udp_connection::next_datagram(chunk_ref& c, working_message*& wm)
+        {
+            wm = nullptr;
+            if(!_out_control.empty())
+            {
+                c = _out_control.front();
+                _out_control.pop_front();
+                return true;
+            }
+
+            while(true)
+            {
+                if(_out_ring.empty()) queue_next_chunk();
+                if(!_out_ring.pop(c)) return false;
+                CHECK_FALSE(is_control(c));
+
+                //skip chunks of messages that finished while the chunk was queued
+                auto wmi = _out_working.find(c.sequence);
+                if(wmi == _out_working.end()) continue;
+
+                wm = &wmi->second;
+                return true;
+            }
         }
 
         void udp_connection::handle_write(const boost::system::error_code& error)
@@ -556,13 +1482,108 @@ namespace fire
             do_send();
         }
 
-        void udp_connection::bind(port_type port)
+        bool udp_connection::fill_send_batch()
+        {
+            REQUIRE_EQUAL(_out_batch.size(), IO_BATCH_SIZE);
+
+            //encode queued chunks into the free slots of the batch
+            while(_out_batch_end < IO_BATCH_SIZE)
+            {
+                if(!next_frame(_out_batch[_out_batch_end], _out_batch_endpoints[_out_batch_end])) break;
+                _out_batch_end++;
+            }
+
+            ENSURE_LESS_EQUAL(_out_batch_start, _out_batch_end);
+            return _out_batch_start < _out_batch_end;
+        }
+
+        void udp_connection::do_batch_send()
+        {
+#ifdef __linux__
+            REQUIRE(_batch_io);
+
+            //wait for the socket to be writable if the last call would have blocked
+            if(_out_batch_waiting) return;
+
+            if(_out_batch_start == _out_batch_end) 
+                _out_batch_start = _out_batch_end = 0;
+
+            if(!fill_send_batch()) return;
+
+            mmsghdr msgs[IO_BATCH_SIZE];
+            iovec iovs[IO_BATCH_SIZE];
+
+            const size_t total = _out_batch_end - _out_batch_start;
+            for(size_t i = 0; i < total; i++)
+            {
+                auto& b = _out_batch[_out_batch_start + i];
+                auto& ep = _out_batch_endpoints[_out_batch_start + i];
+
+                iovs[i].iov_base = b.data();
+                iovs[i].iov_len = b.size();
+
+                std::memset(&msgs[i], 0, sizeof(mmsghdr));
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                msgs[i].msg_hdr.msg_name = ep.data();
+                msgs[i].msg_hdr.msg_namelen = ep.size();
+            }
+
+            int sent = ::sendmmsg(_socket->native_handle(), msgs, total, MSG_DONTWAIT);
+            _stats.send_calls++;
+
+            if(sent < 0)
+            {
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    _out_batch_waiting = true;
+                    _socket->async_send(ba::null_buffers(),
+                            boost::bind(&udp_connection::handle_batch_write, this, ba::placeholders::error));
+                    return;
+                }
+
+                //skip the datagram that failed so the rest of the batch can go out
+                _error = boost::system::error_code(errno, boost::system::system_category());
+                sent = 1;
+            }
+            else
+            {
+                for(int i = 0; i < sent; i++) _stats.bytes_sent += msgs[i].msg_len;
+                _stats.packets_sent += sent;
+            }
+
+            _out_batch_start += sent;
+            CHECK_LESS_EQUAL(_out_batch_start, _out_batch_end);
+
+            //keep the send chain going, like handle_write does
+            post_send();
+#endif
+        }
+
+        void udp_connection::handle_batch_write(const boost::system::error_code& error)
+        {
+            _out_batch_waiting = false;
+            _error = error;
+            do_send();
+        }
+
+        void udp_connection::bind(port_type port, bool shared)
         {
             LOG << "bind udp port " << port << std::endl;
             INVARIANT(_socket);
 
             _socket->open(udp::v4(), _error);
             _socket->set_option(udp::socket::reuse_address(true),_error);
+#ifdef SO_REUSEPORT
+            if(shared) _socket->set_option(reuse_port(true),_error);
+#endif
+            _socket->set_option(udp::socket::receive_buffer_size(SOCKET_BUFFER_SIZE),_error);
+            _socket->set_option(udp::socket::send_buffer_size(SOCKET_BUFFER_SIZE),_error);
+#ifdef __linux__
+            //don't fragment so mtu probes that are too big get dropped
+            using mtu_discover = boost::asio::detail::socket_option::integer<IPPROTO_IP, IP_MTU_DISCOVER>;
+            _socket->set_option(mtu_discover(IP_PMTUDISC_DO), _error);
+#endif
             _socket->bind(udp::endpoint(udp::v4(), port), _error);
 
             if(_error)
@@ -573,6 +1594,16 @@ namespace fire
 
         void udp_connection::start_read()
         {
+            //in batch mode we wait for the socket to be readable and
+            //drain it with recvmmsg ourselves
+            if(_batch_io)
+            {
+                _socket->async_receive(ba::null_buffers(),
+                        boost::bind(&udp_connection::handle_batch_read, this,
+                            boost::asio::placeholders::error));
+                return;
+            }
+
             _socket->async_receive_from(
                    ba::buffer(_in_buffer, MAX_UDP_BUFF_SIZE), _in_endpoint,
                     boost::bind(&udp_connection::handle_read, this,
@@ -580,19 +1611,173 @@ namespace fire
                         boost::asio::placeholders::bytes_transferred));
         }
 
-        bool insert_chunk(const message_chunk& c, working_messages& w, u::bytes& complete_message)
+        void udp_connection::start_resend_timer()
+        {
+            if(_resend_timer_running) return;
+            _resend_timer_running = true;
+
+            _resend_timer.expires_from_now(std::chrono::milliseconds(RESEND_TICK));
+            _resend_timer.async_wait(
+                    boost::bind(&udp_connection::handle_resend_timer, this,
+                        boost::asio::placeholders::error));
+        }
+
+        void udp_connection::handle_resend_timer(const boost::system::error_code& error)
         {
-            REQUIRE(c.type == message_chunk::msg || c.type == message_chunk::qmsg);
+            _resend_timer_running = false;
+            if(error == ba::error::operation_aborted) return;
+
+            resend();
+
+            //the timer only runs while there are messages to watch
+            if(!_out_working.empty()) start_resend_timer();
+        }
+
+        //false if the message was already completed
+        bool remember_completed(completed_messages& d, const peer_sequence& k)
+        {
+            if(!d.set.insert(k).second) return false;
+            d.order.push_back(k);
+            if(d.order.size() <= COMPLETED_HISTORY) return true;
+
+            d.set.erase(d.order.front());
+            d.order.pop_front();
+            return true;
+        }
+
+        //place one data chunk in its spot of the working message
+        bool place_chunk(working_message& wm, size_t chunk_n, const char* data, size_t size, size_t chunk_size)
+        {
+            REQUIRE(data);
+            if(chunk_n >= wm.proto.total_chunks) return false;
+            if(wm.set[chunk_n]) return false;
+
+            //potentially resize if we get the last message_chunk
+            if(chunk_n == wm.proto.total_chunks - 1u)
+            {
+                auto extra = chunk_size - size; 
+
+                //should only shrink
+                wm.data.resize(wm.data.size() - extra);
+            }
+            //only the last message_chunk can be less than the chunk size. Otherwise something is wrong
+            else if(size != chunk_size) return false;
+            
+            //copy straight from the receive buffer into the message
+            const size_t insert_spot = chunk_n * chunk_size; 
+            std::copy(data, data + size, wm.data.begin() + insert_spot); 
+            wm.set[chunk_n] = 1;
+
+            //track the first gap and the end of what we have for sack frames
+            while(wm.first_unacked < wm.proto.total_chunks && wm.set[wm.first_unacked]) 
+                wm.first_unacked++;
+            wm.received_end = std::max<size_t>(wm.received_end, chunk_n + 1);
+            return true;
+        }
+
+        bool insert_parity(const message_chunk& c, working_message& wm, size_t chunk_size)
+        {
+            REQUIRE(c.type == message_chunk::parity);
+            if(wm.proto.type != message_chunk::qmsg) return false;
+            if(c.size != chunk_size || c.group_size == 0) return false;
+            if(c.chunk % c.group_size != 0) return false;
+
+            if(wm.group_size == 0)
+            {
+                wm.group_size = c.group_size;
+                wm.last_size = c.last_size;
+                wm.parity.resize((wm.proto.total_chunks + wm.group_size - 1) / wm.group_size);
+            }
+            else if(wm.group_size != c.group_size || wm.last_size != c.last_size) return false;
+
+            const size_t group = c.chunk / wm.group_size;
+            if(group >= wm.parity.size() || !wm.parity[group].empty()) return false;
+
+            wm.parity[group].assign(c.data, c.data + c.size);
+            return true;
+        }
+
+        //rebuild the data chunk of a group from its parity if it is the only one missing
+        bool recover_chunk(working_message& wm, size_t group, size_t chunk_size)
+        {
+            if(wm.group_size == 0 || group >= wm.parity.size() || wm.parity[group].empty()) return false;
+
+            const size_t start = group * wm.group_size;
+            const size_t end = group_end(group, wm);
+
+            size_t missing = end;
+            for(size_t n = start; n < end; n++)
+            {
+                if(wm.set[n]) continue;
+                if(missing != end) return false;
+                missing = n;
+            }
+            if(missing == end) return false;
+
+            auto b = wm.parity[group];
+            for(size_t n = start; n < end; n++)
+            {
+                if(n == missing) continue;
+                const size_t offset = n * chunk_size;
+                const size_t size = std::min(chunk_size, wm.data.size() - offset);
+                for(size_t i = 0; i < size; i++) b[i] ^= wm.data[offset + i];
+            }
+
+            const bool last = missing == wm.proto.total_chunks - 1u;
+            return place_chunk(wm, missing, b.data(), last ? wm.last_size : chunk_size, chunk_size);
+        }
+
+        bool insert_chunk(
+                const message_chunk& c, 
+                endpoint_id from,
+                in_working_messages& w, 
+                completed_messages& done, 
+                u::bytes& complete_message, 
+                size_t& recovered)
+        {
+            REQUIRE(
+                    c.type == message_chunk::msg || 
+                    c.type == message_chunk::qmsg || 
+                    c.type == message_chunk::parity);
             if(c.total_chunks == 0) return false;
 
-            auto& wm = w[c.sequence];
+            const bool parity = c.type == message_chunk::parity;
+            const size_t chunk_size = c.chunk_size > 0 ? c.chunk_size : UDP_CHuNK_SIZE;
+            if(c.size == 0 || c.size > chunk_size) return false;
+
+            const peer_sequence key{from, c.sequence};
+
+            //single chunk messages skip the working set. With fec their 
+            //parity is a copy sized to the message, the first copy wins.
+            if(c.total_chunks == 1)
+            {
+                if(c.chunk != 0 || w.count(key)) return false;
+
+                const bool twin = parity || (c.type == message_chunk::qmsg && c.size == c.chunk_size);
+                if(twin && !remember_completed(done, key)) return false;
+
+                const size_t size = parity ? c.last_size : c.size;
+                complete_message.assign(c.data, c.data + size);
+                return true;
+            }
+
+            //late parity for a message that was already completed
+            if(done.set.count(key)) return false;
+
+            auto& wm = w[key];
             if(wm.proto.total_chunks == 0)
             {
-                const size_t max_size = c.total_chunks * UDP_CHuNK_SIZE;
-                if(max_size > MAX_MESSAGE_SIZE) return false;
+                const size_t max_size = c.total_chunks * chunk_size;
+                if(max_size > MAX_MESSAGE_SIZE + chunk_size) 
+                {
+                    w.erase(key);
+                    return false;
+                }
 
                 wm.proto = c;
-                wm.proto.data.clear();
+                wm.proto.type = parity ? message_chunk::qmsg : c.type;
+                wm.proto.data = nullptr;
+                wm.proto.size = 0;
                 wm.data.resize(max_size);
                 wm.set.resize(c.total_chunks);
             }
@@ -600,39 +1785,194 @@ namespace fire
             CHECK_GREATER(wm.proto.total_chunks, 0);
 
             const auto chunk_n = c.chunk;
-            const auto sequence_n = c.sequence;
 
             if(chunk_n >= wm.proto.total_chunks) return false;
             if(c.total_chunks != wm.proto.total_chunks) return false;
-            if(wm.set[chunk_n]) return false;
+            if(c.chunk_size != wm.proto.chunk_size) return false;
+            if(!parity && c.type != wm.proto.type) return false;
 
-            //potentially resize if we get the last message_chunk
-            if(c.chunk == wm.proto.total_chunks - 1)
+            if(parity)
             {
-                auto extra = UDP_CHuNK_SIZE - c.data.size(); 
-
-                //should only shrink
-                CHECK_GREATER_EQUAL(extra, 0);
-                wm.data.resize(wm.data.size() - extra);
+                if(!insert_parity(c, wm, chunk_size)) return false;
             }
-            //only the last message_chunk can be less than the UDP_CHUNK_SIZE. Otherwise something is wrong
-            else if(c.data.size() != UDP_CHuNK_SIZE) return false;
-            
-            const size_t insert_spot = c.chunk * UDP_CHuNK_SIZE; 
-            std::copy(c.data.begin(), c.data.end(), wm.data.begin() + insert_spot); 
-            wm.set[chunk_n] = 1;
+            else if(!place_chunk(wm, chunk_n, c.data, c.size, chunk_size)) return false;
+
+            if(wm.group_size > 0 && recover_chunk(wm, chunk_n / wm.group_size, chunk_size)) 
+                recovered++;
 
             //if message is not complete yet, return 
-            if(wm.set.count() != wm.proto.total_chunks) return false;
+            if(wm.first_unacked != wm.proto.total_chunks) return false;
 
             //return message
             complete_message = std::move(wm.data);
 
+            //parity may still be on its way
+            if(wm.proto.type == message_chunk::qmsg && wm.proto.chunk_size > 0) 
+                remember_completed(done, key);
+
             //remove message from working
-            w.erase(sequence_n);
+            w.erase(key);
             return true;
         }
 
+        //shard owning a peer, the same for sending and receiving so a peer's
+        //acks are handled where its messages were sent from
+        size_t udp_shard(const udp::endpoint& e, size_t shards)
+        {
+            REQUIRE_GREATER(shards, 0);
+
+            size_t h = e.port();
+            const auto a = e.address();
+            if(a.is_v4()) h ^= a.to_v4().to_ulong() * 2654435761u;
+            else for(auto c : a.to_v6().to_bytes()) h = h * 31 + c;
+            return h % shards;
+        }
+
+        bool udp_connection::handle_datagram(const char* b, size_t size, const udp::endpoint& from)
+        {
+            REQUIRE(b);
+
+            //endpoint ids are per shard, so all of a peer's chunks have to
+            //land in the same shard's working and pending ack maps
+            REQUIRE(_shards.size() < 2 || udp_shard(from, _shards.size()) == _shard);
+
+            //several frames packed together
+            if(size > 0 && b[0] == BUNDLE_MARK) return handle_bundle(b, size, from);
+
+            //decode message
+            message_chunk c;
+
+            if(size >= HEADER_SIZE) 
+                c = decode_udp_wire(b, size);
+
+            if(!c.valid) return false;
+
+            if(c.type == message_chunk::ack)
+            {
+                _stats.acks_recv++;
+                validate_chunk(c);
+                return true;
+            }
+            else if(c.type == message_chunk::sack)
+            {
+                _stats.acks_recv++;
+                validate_sack(c);
+                return true;
+            }
+
+            //add message to in queue if we got complete message
+            endpoint ep = { UDP, from.address().to_string(), from.port()};
+
+            //answer path mtu probes that arrived whole
+            if(c.type == message_chunk::probe)
+            {
+                //features hold even if the probe was cut short
+                auto id = intern_endpoint(ep.address, ep.port);
+                if(c.sequence & FEATURE_SACKS) _sack_peers[id] = true;
+                if(size != c.chunk) return false;
+
+                //the peer unpacks bundles, keep ours to the safe size until our own probe answers
+                if(c.sequence & FEATURE_BUNDLES) allow_bundles(id, UDP_PACKET_SIZE);
+
+                auto ack = control_chunk(message_chunk::probe_ack, id);
+                ack.sequence = FEATURES;
+                ack.chunk = c.chunk;
+                return queue_control(ack);
+            }
+            else if(c.type == message_chunk::probe_ack)
+            {
+                handle_probe_ack(c, ep);
+                return true;
+            }
+
+            //peers that understand sack frames get coalesced acks,
+            //old peers get one ack per chunk
+            const auto id = intern_endpoint(ep.address, ep.port);
+            const bool robust = c.type == message_chunk::msg;
+            if(robust)
+            {
+                if(_sack_peers[id]) add_pending_ack(c, id);
+                else queue_ack(c, id);
+            }
+
+            //insert message_chunk to message buffer
+            endpoint_message em{ep, u::bytes(), robust};
+            if(insert_chunk(c, id, _in_working, _in_completed, em.data, _stats.fec_recovered))
+            {
+                //the working message is gone, the ack has to know it finished
+                if(robust)
+                {
+                    auto pa = _pending_acks.find(peer_sequence{id, c.sequence});
+                    if(pa != _pending_acks.end()) pa->second.complete = true;
+                }
+
+                if(_sink) 
+                {
+                    inbound_message im{ep, std::move(em.data)};
+                    _sink->push(udp_lane, im);
+                }
+                else _in_queue.emplace_push(em);
+            }
+
+            return robust;
+        }
+
+        void udp_connection::set_shards(const std::vector<udp_connection*>& shards, size_t shard)
+        {
+            REQUIRE_LESS(shard, shards.size());
+            REQUIRE(shards[shard] == this);
+
+            _shards = shards;
+            _shard = shard;
+        }
+
+        bool udp_connection::hand_off(const char* b, size_t size, const udp::endpoint& from)
+        {
+            REQUIRE(b);
+            if(_shards.size() < 2) return false;
+
+            const auto home = udp_shard(from, _shards.size());
+            if(home == _shard) return false;
+
+            auto c = _shards[home];
+            CHECK(c);
+            c->_io.post(boost::bind(&udp_connection::handle_hand_off, c, u::bytes(b, b + size), from));
+            return true;
+        }
+
+        void udp_connection::handle_hand_off(const u::bytes& b, const udp::endpoint& from)
+        {
+            if(handle_datagram(b.data(), b.size(), from)) post_send();
+            if(!_pending_acks.empty()) start_ack_timer();
+            publish_stats();
+        }
+
+        bool udp_connection::handle_bundle(const char* b, size_t size, const udp::endpoint& from)
+        {
+            REQUIRE(b);
+            REQUIRE_GREATER(size, 0);
+            REQUIRE_EQUAL(b[0], BUNDLE_MARK);
+
+            //hand each frame to handle_datagram as if it came alone.
+            //stop at the first frame that runs past the datagram.
+            bool queued = false;
+            size_t offset = 1;
+            while(size - offset >= BUNDLE_FRAME_OVERHEAD)
+            {
+                uint16_t frame_size = 0;
+                read_be_u16(b, size, offset, frame_size);
+                offset += BUNDLE_FRAME_OVERHEAD;
+                if(frame_size == 0 || frame_size > size - offset) break;
+
+                //bundles don't nest
+                const char* frame = b + offset;
+                if(frame[0] != BUNDLE_MARK && handle_datagram(frame, frame_size, from)) queued = true;
+                offset += frame_size;
+            }
+
+            return queued;
+        }
+
         void udp_connection::handle_read(const boost::system::error_code& error, size_t transferred)
         {
             if(error)
@@ -643,199 +1983,313 @@ namespace fire
                 return;
             }
 
-            //get bytes
             CHECK_LESS_EQUAL(transferred, _in_buffer.size());
-            _work_buffer.resize(transferred);
-            std::copy(_in_buffer.begin(), _in_buffer.begin() + transferred, _work_buffer.begin());
-
             _stats.bytes_recv += transferred;
+            _stats.packets_recv++;
+            _stats.recv_calls++;
 
-            //decode message
-            message_chunk c;
+            //peers owned by another shard are handled there
+            if(hand_off(_in_buffer.data(), transferred, _in_endpoint)) 
+            {
+                start_read();
+                return;
+            }
 
-            if(_work_buffer.size() >= HEADER_SIZE) 
-                c = decode_udp_wire(_work_buffer);
+            //send ack or anything an ack unblocked
+            if(handle_datagram(_in_buffer.data(), transferred, _in_endpoint)) post_send();
 
-            if(c.valid)
-            {
-                //add message to in queue if we got complete message
-                endpoint ep = { UDP, _in_endpoint.address().to_string(), _in_endpoint.port()};
+            //wait a moment for more chunks before acking
+            if(!_pending_acks.empty()) start_ack_timer();
 
-                if(c.type != message_chunk::ack)
-                { 
-                    const bool robust = c.type == message_chunk::msg;
-                    if(robust)
-                    {
-                        message_chunk ack;
-                        ack.type = message_chunk::ack;
-                        ack.host = ep.address;
-                        ack.port = ep.port;
-                        ack.sequence = c.sequence;
-                        ack.total_chunks = c.total_chunks;
-                        ack.chunk = c.chunk;
-                        CHECK(ack.data.empty());
-
-                        //send ack
-                        send_right_away(ack);
-                    }
+            publish_stats();
+            start_read();
+        }
 
-                    //insert message_chunk to message buffer
-                    bool inserted = insert_chunk(c, _in_working, _work_buffer);
-                    //message_chunk is no longer valid after insert_chunk call because a move is done.
+        void udp_connection::handle_batch_read(const boost::system::error_code& error)
+        {
+            if(error)
+            {
+                _error = error;
+                LOG << "error waiting for udp messages. " << error.message() << std::endl;
+                start_read();
+                return;
+            }
 
-                    if(inserted)
-                    {
-                        endpoint_message em{ep, _work_buffer, robust};
-                        _in_queue.emplace_push(em);
-                    }
+#ifdef __linux__
+            INVARIANT(_socket);
+            REQUIRE_EQUAL(_in_slab.size(), IO_BATCH_SIZE * MAX_UDP_BUFF_SIZE);
+            REQUIRE_EQUAL(_in_batch_endpoints.size(), IO_BATCH_SIZE);
 
-                }
-                else 
+            mmsghdr msgs[IO_BATCH_SIZE];
+            iovec iovs[IO_BATCH_SIZE];
+
+            bool queued = false;
+            int got = 0;
+            do
+            {
+                for(size_t i = 0; i < IO_BATCH_SIZE; i++)
                 {
-                    validate_chunk(c);
-                    post_send();
+                    iovs[i].iov_base = _in_slab.data() + i * MAX_UDP_BUFF_SIZE;
+                    iovs[i].iov_len = MAX_UDP_BUFF_SIZE;
+
+                    std::memset(&msgs[i], 0, sizeof(mmsghdr));
+                    msgs[i].msg_hdr.msg_iov = &iovs[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                    msgs[i].msg_hdr.msg_name = _in_batch_endpoints[i].data();
+                    msgs[i].msg_hdr.msg_namelen = _in_batch_endpoints[i].capacity();
                 }
 
+                got = ::recvmmsg(_socket->native_handle(), msgs, IO_BATCH_SIZE, MSG_DONTWAIT, nullptr);
+                if(got <= 0) break;
+
+                _stats.recv_calls++;
+
+                for(int i = 0; i < got; i++)
+                {
+                    const size_t transferred = msgs[i].msg_len;
+                    CHECK_LESS_EQUAL(transferred, MAX_UDP_BUFF_SIZE);
+
+                    _stats.bytes_recv += transferred;
+                    _stats.packets_recv++;
+
+                    auto& from = _in_batch_endpoints[i];
+                    from.resize(msgs[i].msg_hdr.msg_namelen);
+
+                    const char* b = _in_slab.data() + i * MAX_UDP_BUFF_SIZE;
+                    if(hand_off(b, transferred, from)) continue;
+                    if(handle_datagram(b, transferred, from)) queued = true;
+                }
             }
+            while(got == static_cast<int>(IO_BATCH_SIZE));
+
+            //acks for the whole batch go out together
+            if(!_pending_acks.empty()) flush_acks();
+            if(queued) post_send();
+            publish_stats();
+#endif
             start_read();
         }
 
-        size_t udp_connection::resend(message_ring_item& r)
+        size_t udp_connection::resend(message_ring_item& r, time_point now)
         {
             REQUIRE(r.wm);
             auto &wm = *r.wm;
             
             REQUIRE_GREATER(wm.proto.total_chunks, 0);
             REQUIRE_GREATER(wm.data.size(), 0);
+            REQUIRE(wm.peer);
 
             if(wm.set.count() == wm.proto.total_chunks) return 0;
 
+            auto& p = *wm.peer;
+            const auto rto = std::chrono::microseconds(static_cast<int64_t>(p.rto * 1000));
+            bool timed_out = false;
+            const auto reorder = std::chrono::microseconds(
+                    static_cast<int64_t>(std::max(p.srtt / 4, MIN_REORDER_WINDOW) * 1000));
+
+            //walk the unacked chunks and resend the ones whose
+            //retransmission timer has expired or that were overtaken by 
+            //chunks sent well after them
             size_t resent_m = 0;
-            size_t cnt = 0;
-            for(chunk_id_type c = 0; c < wm.proto.total_chunks; c++)
+            for(size_t c = wm.first_unacked; c < wm.next_send; c++)
             {
-                if(cnt >= wm.next_send) break;
-                cnt++;
                 //skip validated or not sent
                 if(wm.set[c] || !wm.sent[c]) continue;
+
+                const auto& sent = wm.sent_at[c];
+                bool expired = now - sent >= rto;
+                bool overtaken = sent + reorder < p.newest_acked;
+                if(!expired && !overtaken) continue;
+                if(expired) timed_out = true;
+
+                wm.sent_at[c] = now;
+                wm.resent[c] = 1;
                 resent_m++;
-                if(resent_m > MAX_FLIGHT) break;
 
                 _stats.dropped++;
+                p.retransmits++;
                 queue_resend(r, c);
             }
+
+            if(resent_m > 0) decrease_window(p, now);
+
+            //repeated timeouts with no acks may mean the path stopped
+            //taking our packet size, step down for new messages
+            if(timed_out && ++p.timeouts >= FALLBACK_TIMEOUTS && p.packet_size > UDP_PACKET_SIZE)
+            {
+                p.packet_size = prev_probe_size(p.packet_size);
+                p.probe_size = 0;
+                p.timeouts = 0;
+            }
             return resent_m;
         }
 
         void udp_connection::resend()
         {
             bool resent = false;
-            exhausted_messages em;
-            for(auto& r : _message_ring)
-            {
-                CHECK(r.wm);
-                auto& wm = *r.wm;
-                CHECK_GREATER(wm.proto.total_chunks, 0);
+            auto now = udp_clock::now();
+            const auto timeout = std::chrono::milliseconds(MESSAGE_TIMEOUT);
 
-                wm.ticks++;
-
-                sequence_type sequence = wm.proto.sequence;
+            exhausted_messages em;
+            for(auto pp : _active_peers)
+                for(auto& l : pp->messages)
+                    for(auto& r : l)
+                    {
+                        CHECK(r.wm);
+                        auto& wm = *r.wm;
+                        CHECK_GREATER(wm.proto.total_chunks, 0);
 
-                //check if we should try to resend
-                bool skip = wm.ticks <= RESEND_TICK_THRESHOLD;
-                bool robust = wm.proto.type == message_chunk::msg;
+                        sequence_type sequence = wm.proto.sequence;
+                        bool robust = wm.proto.type == message_chunk::msg;
 
-                //walk working message and resend all chunks that never got
-                //acked
-                if(robust && !skip && resend(r) > 0) 
-                    resent = true;
+                        //walk working message and resend all chunks whose
+                        //retransmission timer expired
+                        if(robust && resend(r, now) > 0) 
+                            resent = true;
 
-                bool erase = robust ?  wm.ticks >= RESEND_THRESHOLD : all_sent(wm);
-                if(erase) em.insert(em.end(), sequence);
-            }
+                        bool erase = robust ?  now - wm.last_progress >= timeout : all_sent(wm);
+                        if(erase) em.insert(em.end(), sequence);
+                    }
 
             for(auto sequence : em) cleanup_message(sequence);
 
+            check_probes(now);
+
             if(resent) post_send();
         }
 
-        const udp_stats& udp_connection::stats() const 
+        void udp_connection::publish_stats()
         {
-            return _stats;
+            std::lock_guard<std::mutex> l(_stats_mutex);
+            _published_stats = _stats;
         }
 
-        void udp_run_thread(udp_queue*);
-        void resend_thread(udp_queue*);
-        udp_queue::udp_queue(const asio_params& p) :
+        udp_stats udp_connection::stats() const 
+        {
+            std::lock_guard<std::mutex> l(_stats_mutex);
+            return _published_stats;
+        }
+
+        void udp_run_thread(udp_queue*, size_t);
+        udp_queue::udp_queue(const asio_params& p, inbound_queue* sink) :
             _p(p), 
-            _io{new ba::io_service},
+            _sink(sink),
             _done{false}
         {
             REQUIRE_GREATER(_p.local_port, 0);
-            _resolver.reset(new udp::resolver{*_io});
+
+#ifndef SO_REUSEPORT
+            _p.shards = 1;
+#endif
+            _io.resize(std::max<size_t>(_p.shards, 1));
+            for(auto& io : _io) io.reset(new ba::io_service);
+
+            _resolver.reset(new name_resolver{*_io.front()});
             bind();
-            _run_thread.reset(new std::thread{udp_run_thread, this});
-            _resend_thread.reset(new std::thread{resend_thread, this});
 
-            INVARIANT(_io);
-            INVARIANT(_con);
+            _run_threads.resize(_io.size());
+            for(size_t s = 0; s < _run_threads.size(); s++)
+                _run_threads[s].reset(new std::thread{udp_run_thread, this, s});
+
+            INVARIANT_FALSE(_io.empty());
+            INVARIANT_EQUAL(_cons.size(), _io.size());
             INVARIANT(_resolver);
-            INVARIANT(_run_thread);
-            INVARIANT(_resend_thread);
+            INVARIANT_EQUAL(_run_threads.size(), _io.size());
         }
 
         void udp_queue::bind()
         {
-            CHECK_FALSE(_con);
-            INVARIANT(_io);
+            CHECK(_cons.empty());
+            INVARIANT_FALSE(_io.empty());
+
+            //with more than one shard every socket binds the same port
+            //and the kernel spreads incoming datagrams between them
+            const bool shared = _io.size() > 1;
+            std::vector<udp_connection*> shards;
+            for(auto& io : _io)
+            {
+                CHECK(io);
+                udp_connection_ptr c{new udp_connection{_in_queue, _sink, *io, _p.batch_io, _p.fec_group, _p.loss, _p.bundle_delay}};
+                c->bind(_p.local_port, shared);
+                shards.push_back(c.get());
+                _cons.push_back(c);
+            }
 
-            _con = udp_connection_ptr{new udp_connection{_in_queue, *_io}};
-            _con->bind(_p.local_port);
+            for(size_t s = 0; s < _cons.size(); s++) 
+                _cons[s]->set_shards(shards, s);
             
-            ENSURE(_con);
+            ENSURE_EQUAL(_cons.size(), _io.size());
         }
 
         udp_queue::~udp_queue()
         {
-            INVARIANT(_io);
             _done = true;
-            _io->stop();
+            for(auto& io : _io) io->stop();
             if(_p.block) _in_queue.done();
             if(_p.wait > 0) u::sleep_thread(_p.wait);
-            if(_con) _con->close();
-            if(_run_thread) _run_thread->join();
-            if(_resend_thread) _resend_thread->join();
+            for(auto& c : _cons) c->close();
+            for(auto& t : _run_threads) t->join();
+        }
+
+        udp_connection& udp_queue::shard_for(const endpoint& ep)
+        {
+            REQUIRE_FALSE(_cons.empty());
+            if(_cons.size() == 1) return *_cons.front();
+
+            boost::system::error_code error;
+            auto a = ba::ip::address::from_string(ep.address, error);
+            if(error) return *_cons.front();
+
+            auto s = udp_shard(udp::endpoint{a, ep.port}, _cons.size());
+            CHECK_LESS(s, _cons.size());
+            return *_cons[s];
         }
 
         bool udp_queue::send(const endpoint_message& m)
         {
-            INVARIANT(_io);
-            CHECK(_con);
+            INVARIANT(_resolver);
+
+            //messages to names being looked up are sent once the lookup is done.
+            //lookups finish on the first shard's thread, which is joined before
+            //this queue goes away
+            std::string address;
+            auto r = _resolver->resolve(m.ep.address, address, [this, m](const std::string& a)
+                    {
+                        if(a.empty()) return;
+                        endpoint_message cm = m;
+                        cm.ep.address = a;
+                        shard_for(cm.ep).send(cm, false);
+                    });
+
+            switch(r)
+            {
+                case name_resolver::pending: return true;
+                case name_resolver::failed: return false;
+                case name_resolver::resolved: break;
+                default: CHECK(false && "missed case");
+            }
 
-            const auto& address = resolve(m.ep);
             if(address != m.ep.address)
             {
                 endpoint_message cm = m;
                 cm.ep.address = address;
-                return _con->send(cm, _p.block);
+                return shard_for(cm.ep).send(cm, _p.block);
             }
-            return _con->send(m, _p.block);
+            return shard_for(m.ep).send(m, _p.block);
         }
 
-        const std::string& udp_queue::resolve(const endpoint& ep)
+        size_t udp_queue::backlog(const endpoint& ep)
         {
             INVARIANT(_resolver);
 
-            auto resolved = _rmap.find(ep.address);
-            if(resolved != _rmap.end()) return resolved->second;
+            //names still being looked up have nothing sent yet
+            std::string address;
+            auto r = _resolver->resolve(ep.address, address, [](const std::string&) {});
+            if(r != name_resolver::resolved) return 0;
 
-            udp::resolver::query q{ep.address, port_to_string(ep.port)};
-            auto iter = _resolver->resolve(q);
-            udp::endpoint endp = *iter;
-            auto resolved_address = endp.address().to_string();
-            _rmap[ep.address] = resolved_address;
-            _rmap[resolved_address] = resolved_address;
-            return _rmap[ep.address]; 
+            endpoint re = ep;
+            re.address = address;
+            return shard_for(re).backlog(re);
         }
 
         bool udp_queue::receive(endpoint_message& m)
@@ -844,41 +2298,45 @@ namespace fire
             return _in_queue.pop(m, _p.block);
         }
 
-        const udp_stats& udp_queue::stats() const 
+        udp_stats udp_queue::stats() const 
         {
-            CHECK(_con);
-            return _con->stats();
-        }
+            REQUIRE_FALSE(_cons.empty());
 
-        void udp_run_thread(udp_queue* q)
-        {
-            CHECK(q);
-            CHECK(q->_io);
-            while(!q->_done) 
-            try
-            {
-                q->_io->run();
-                u::sleep_thread(THREAD_SLEEP);
-            }
-            catch(std::exception& e)
-            {
-                LOG << "error in udp thread. " << e.what() << std::endl;
-            }
-            catch(...)
+            //congestion state is the first shard's
+            auto t = _cons.front()->stats();
+            for(size_t i = 1; i < _cons.size(); i++)
             {
-                LOG << "unknown error in udp thread." << std::endl;
+                const auto s = _cons[i]->stats();
+                t.dropped += s.dropped;
+                t.bytes_sent += s.bytes_sent;
+                t.bytes_recv += s.bytes_recv;
+                t.packets_sent += s.packets_sent;
+                t.packets_recv += s.packets_recv;
+                t.send_calls += s.send_calls;
+                t.recv_calls += s.recv_calls;
+                t.retransmits += s.retransmits;
+                t.acks_sent += s.acks_sent;
+                t.acks_recv += s.acks_recv;
+                t.parity_sent += s.parity_sent;
+                t.fec_recovered += s.fec_recovered;
+                t.simulated_drops += s.simulated_drops;
+                t.bundled += s.bundled;
             }
+            return t;
         }
 
-        void resend_thread(udp_queue* q)
+        void udp_run_thread(udp_queue* q, size_t shard)
         {
             CHECK(q);
-            CHECK(q->_io);
+            CHECK_LESS(shard, q->_io.size());
+
+            auto& io = q->_io[shard];
+            CHECK(io);
             while(!q->_done) 
             try
             {
-                q->_io->post(boost::bind(&udp_connection::resend, q->_con));
-                u::sleep_thread(RESEND_THREAD_SLEEP);
+                io->run();
+                u::sleep_thread(THREAD_SLEEP);
             }
             catch(std::exception& e)
             {
@@ -33,11 +33,22 @@
 
 #include "network/util.hpp"
 #include "network/connection.hpp"
+#include "network/inbound_queue.hpp"
 #include "network/message_queue.hpp"
+#include "network/name_resolver.hpp"
 #include "util/thread.hpp"
+#include "util/ring.hpp"
 
+#include <chrono>
+#include <deque>
 #include <list>
+#include <mutex>
+#include <random>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+#include <boost/asio/steady_timer.hpp>
 
 namespace fire
 {
@@ -52,11 +63,13 @@ namespace fire
 
         using endpoint_queue = util::queue<endpoint_message>;
 
-        using udp_resolver_ptr = std::unique_ptr<boost::asio::ip::udp::resolver>;
+        using name_resolver_ptr = std::unique_ptr<name_resolver>;
         using udp_socket_ptr = std::unique_ptr<boost::asio::ip::udp::socket>;
         using sequence_type = uint64_t;
         using chunk_total_type = uint16_t;
         using chunk_id_type = uint16_t;
+        using chunk_size_type = uint16_t;
+        using endpoint_id = uint32_t;
 
         struct message_chunk
         {
@@ -66,15 +79,96 @@ namespace fire
             sequence_type sequence = 0;
             chunk_total_type total_chunks = 0;
             chunk_id_type chunk;
-            util::bytes data;
+            chunk_size_type chunk_size = 0; //0 means the default chunk size
+
+            //parity chunks cover the data chunks of one group
+            chunk_id_type group_size = 0;
+            chunk_size_type last_size = 0; //size of the last data chunk of the message
+
+            //payload of a received chunk. points into the receive buffer 
+            //and is only valid while the datagram is handled
+            const char* data = nullptr;
+            size_t size = 0;
+
             bool resent = false;
-            enum msg_type { qmsg, msg, ack} type;
+            enum msg_type { qmsg, msg, ack, sack, probe, probe_ack, parity} type;
+        };
+
+        //outgoing datagram waiting to be sent. Data chunks point into the
+        //working message, control frames carry their payload inline and
+        //anything past the inline payload is zero padding.
+        const size_t CONTROL_PAYLOAD_SIZE = 128;
+        struct chunk_ref
+        {
+            sequence_type sequence;
+            chunk_total_type total_chunks;
+            chunk_id_type chunk;
+            chunk_size_type chunk_size;
+            chunk_id_type group_size;
+            chunk_size_type last_size;
+            message_chunk::msg_type type;
+            bool resent;
+            endpoint_id ep;
+            const char* data;
+            uint16_t size;
+            char payload[CONTROL_PAYLOAD_SIZE];
+        };
+
+
+        using udp_clock = std::chrono::steady_clock;
+        using time_point = udp_clock::time_point;
+        using time_points = std::vector<time_point>;
+
+        //outgoing chunks are scheduled from per peer message lists
+        struct working_message;
+        using chunk_id_queue = std::deque<chunk_id_type>;
+        struct message_ring_item
+        {
+            working_message* wm;
+            chunk_id_queue resends; 
+        };
+        using message_list = std::list<message_ring_item>;
+
+        //strict priority within a peer, lower goes first
+        enum priority_class { realtime, control, bulk, PRIORITY_CLASSES };
+
+        struct congestion_state;
+        using peer_list = std::list<congestion_state*>;
+
+        //congestion control state kept per destination.
+        //window is in chunks and times are in milliseconds.
+        struct congestion_state
+        {
+            std::string host;
+            port_type port = 0;
+            endpoint_id ep = 0;
 
-            //used for writing
-            const char* write_data = nullptr;
-            size_t write_size = 0;
+            double cwnd = 0;
+            double ssthresh = 0;
+            double srtt = 0;
+            double rttvar = 0;
+            double rto = 0;
+            size_t in_flight = 0;
+            size_t retransmits = 0;
+            time_point last_decrease;
+            time_point newest_acked; //send time of the most recently sent chunk that was acked
+            size_t timeouts = 0; //loss events from expired timers since the last ack
+
+            //path mtu probing. packet_size is used for new messages
+            size_t packet_size = 0;
+            size_t probe_size = 0; //size being probed, 0 if not probing
+            size_t probe_tries = 0;
+            time_point probe_sent;
+
+            //scheduling. peers with messages are in the active list and take
+            //turns sending a quantum of bytes (deficit round robin)
+            message_list messages[PRIORITY_CLASSES];
+            long deficit = 0;
+            bool active = false;
+            peer_list::iterator active_pos;
         };
 
+        using congestion_map = std::unordered_map<std::string, congestion_state>;
 
         struct working_message
         {
@@ -82,35 +176,109 @@ namespace fire
             util::bytes data;
             boost::dynamic_bitset<> set;
             boost::dynamic_bitset<> sent;
-            size_t ticks = 0;
+            boost::dynamic_bitset<> resent;
+            time_points sent_at;
+            time_point last_progress;
             size_t in_flight = 0;
             size_t queued = 0;
             size_t next_send = 0;
+            size_t first_unacked = 0;
+            size_t received_end = 0;
+            congestion_state* peer = nullptr;
+            priority_class priority = bulk;
+
+            //forward error correction, one parity chunk per group
+            std::vector<util::bytes> parity;
+            size_t next_parity = 0;
+            size_t parity_sent = 0;
+            size_t group_size = 0;
+            size_t last_size = 0;
+            message_list::iterator ring_pos;
+        };
+
+        //robust chunks received since the last ack flush, per message
+        struct pending_ack
+        {
+            chunk_total_type total_chunks;
+            bool complete = false; //the whole message arrived
+        };
+
+        //sequences are only unique per sender, so incoming messages
+        //are keyed by the peer and the sequence
+        using peer_sequence = std::pair<endpoint_id, sequence_type>;
+        struct peer_sequence_hash
+        {
+            size_t operator()(const peer_sequence& k) const
+            {
+                return std::hash<sequence_type>{}(k.second) * 31 + k.first;
+            }
         };
 
         //working set for both incoming and outgoing messages
         using hash_type = std::size_t;
         using working_messages = std::unordered_map<sequence_type, working_message>;
-        using resolve_map = std::unordered_map<std::string, std::string>;
+        using in_working_messages = std::unordered_map<peer_sequence, working_message, peer_sequence_hash>;
+        using pending_acks = std::unordered_map<peer_sequence, pending_ack, peer_sequence_hash>;
 
-        //outgoing chunks are send round robin in the message_ring
-        using chunk_id_queue = util::queue<chunk_id_type>;
-        struct message_ring_item
+        //recently completed unreliable messages so late parity chunks 
+        //are ignored
+        struct completed_messages
         {
-            working_message* wm;
-            chunk_id_queue resends; 
+            std::unordered_set<peer_sequence, peer_sequence_hash> set;
+            std::deque<peer_sequence> order;
+        };
+        //small frames to one peer waiting to go out together in one datagram
+        struct frame_bundle
+        {
+            endpoint_id ep;
+            util::bytes data;
+            size_t frames = 0;
+            time_point started;
         };
+        using frame_bundles = std::deque<frame_bundle>;
+        using bundle_sizes = std::vector<size_t>;
+        using endpoint_flags = std::vector<bool>;
+        using waiting_counts = std::unordered_map<std::string, size_t>;
 
-        using message_ring = std::vector<message_ring_item>;
+        using endpoint_ids = std::unordered_map<std::string, endpoint_id>;
+        using endpoint_id_list = std::vector<endpoint_id>;
 
         struct udp_stats
         {
             size_t dropped = 0;
             size_t bytes_sent = 0;
             size_t bytes_recv = 0;
+            size_t packets_sent = 0;
+            size_t packets_recv = 0;
+            size_t send_calls = 0;
+            size_t recv_calls = 0;
+
+            //congestion state of the last peer that acked a chunk
+            size_t retransmits = 0;
+            size_t acks_sent = 0;
+            size_t acks_recv = 0;
+            double cwnd = 0;
+            double srtt = 0;
+            double rto = 0;
+            size_t packet_size = 0;
+
+            //forward error correction
+            size_t parity_sent = 0;
+            size_t fec_recovered = 0;
+            size_t simulated_drops = 0;
+
+            //frames that went out packed with others in one datagram
+            size_t bundled = 0;
         };
 
-        using chunk_queue = util::queue<message_chunk>;
+        const size_t OUT_RING_SIZE = 256;
+        using chunk_ring = util::spsc_ring<chunk_ref, OUT_RING_SIZE>;
+
+        //acks and probes wait here and go out ahead of message chunks
+        const size_t CONTROL_QUEUE_SIZE = 1024;
+        using chunk_refs = std::deque<chunk_ref>;
+        using udp_endpoints = std::vector<boost::asio::ip::udp::endpoint>;
+        using byte_batch = std::vector<util::bytes>;
 
         class udp_queue;
         class udp_connection
@@ -118,71 +286,171 @@ namespace fire
             public:
                 udp_connection(
                         endpoint_queue& in,
-                        boost::asio::io_service& io);
+                        inbound_queue* sink,
+                        boost::asio::io_service& io,
+                        bool batch_io = false,
+                        size_t fec_group = 0,
+                        double loss = 0,
+                        double bundle_delay = 0);
             public:
                 bool send(const endpoint_message& m, bool block = false);
 
+                //messages to the endpoint not yet sent, or not yet acked if robust
+                size_t backlog(const endpoint& ep) const;
+
             public:
-                void bind(port_type port);
+                void bind(port_type port, bool shared = false);
+                void set_shards(const std::vector<udp_connection*>& shards, size_t shard);
                 void do_send();
                 void handle_write(const boost::system::error_code& error);
                 void handle_read(const boost::system::error_code& error, size_t transferred);
+                void handle_batch_read(const boost::system::error_code& error);
+                void handle_batch_write(const boost::system::error_code& error);
                 void close();
                 void start_read();
                 void do_close();
-                const udp_stats& stats() const; 
+                udp_stats stats() const; 
 
             private:
                 void add_to_working_set(endpoint_message m);
+                void add_parity(working_message&);
+                bool simulate_loss();
+                void publish_stats();
                 void init_working(message_chunk& proto, util::bytes& data);
-                void send_right_away(message_chunk& c);
-                bool get_next_chunk(working_message&, message_chunk& queued_chunk);
+                endpoint_id intern_endpoint(const std::string& host, port_type port);
+                void prune_endpoints(time_point now);
+                void queue_ack(const message_chunk& c, endpoint_id ep);
+                void add_pending_ack(const message_chunk& c, endpoint_id ep);
+                congestion_state& peer_state(const std::string& host, port_type port);
+                void probe_path(congestion_state&, time_point now);
+                void check_probes(time_point now);
+                void handle_probe_ack(const message_chunk& c, const endpoint& ep);
+                void update_rtt(congestion_state&, double sample);
+                void increase_window(congestion_state&);
+                void decrease_window(congestion_state&, time_point now);
+                void start_resend_timer();
+                void handle_resend_timer(const boost::system::error_code& error);
+                bool handle_datagram(const char* b, size_t size, const boost::asio::ip::udp::endpoint& from);
+                bool hand_off(const char* b, size_t size, const boost::asio::ip::udp::endpoint& from);
+                void handle_hand_off(const util::bytes& b, const boost::asio::ip::udp::endpoint& from);
+                void do_batch_send();
+                bool fill_send_batch();
+                bool next_datagram(chunk_ref& c, working_message*& wm);
+                bool queue_control(const chunk_ref& c);
+                bool next_frame(util::bytes& r, boost::asio::ip::udp::endpoint& to);
+                bool add_to_bundle(endpoint_id ep, const util::bytes& frame);
+                bool pop_ready_bundle(util::bytes& r, boost::asio::ip::udp::endpoint& to);
+                void flush_bundles(time_point now);
+                void handle_bundle_timer(const boost::system::error_code& error);
+                void allow_bundles(endpoint_id ep, size_t size);
+                bool handle_bundle(const char* b, size_t size, const boost::asio::ip::udp::endpoint& from);
+                bool get_next_chunk(working_message&, chunk_ref& queued_chunk);
                 void cleanup_message(sequence_type sequence);
                 void validate_chunk(const message_chunk& c);
+                void validate_sack(const message_chunk& c);
+                bool ack_chunk(working_message&, size_t chunk, time_point now);
+                void finish_acked(working_message&);
+                void flush_acks();
+                void start_ack_timer();
+                void handle_ack_timer(const boost::system::error_code& error);
                 void queue_resend(message_ring_item&, chunk_id_type c);
                 void queue_next_chunk();
-                bool incr_next_message();
-                void sent_chunk(const message_chunk& c);
-                size_t resend(message_ring_item&);
+                bool next_peer_chunk(congestion_state&, chunk_ref& c);
+                void activate_peer(congestion_state&);
+                void deactivate_peer(congestion_state&);
+                void sent_chunk(working_message&, const chunk_ref& c);
+                size_t resend(message_ring_item&, time_point now);
                 void resend();
                 void post_send();
 
             private:
                 //reading
-                util::bytes _work_buffer;
                 util::bytes _in_buffer;
                 util::bytes _out_buffer;
                 boost::asio::ip::udp::endpoint _in_endpoint;
-                working_messages _in_working;
+                util::bytes _in_slab; //one slot of MAX_UDP_BUFF_SIZE per datagram in a batch
+                udp_endpoints _in_batch_endpoints;
+                in_working_messages _in_working;
                 working_messages _out_working;
+                completed_messages _in_completed;
+                pending_acks _pending_acks;
                 endpoint_queue& _in_queue;
+                inbound_queue* _sink; //when set, complete messages go here instead
 
                 //writing
-                size_t _next_message = 0;
-                message_ring _message_ring; //messages get chunked to here
-
-                //queue for chunks ready to go
-                chunk_queue _out_queue; //the queue loop adds next message to here to be sent
+                peer_list _active_peers; //peers with messages, in turn order
+
+                //ring for chunks ready to go
+                chunk_ring _out_ring; //the queue loop adds next message to here to be sent
+                chunk_refs _out_control; //control frames, never wait behind chunks
+                udp_endpoints _endpoints; //interned destinations, indexed by endpoint_id
+                endpoint_ids _endpoint_ids;
+                time_points _endpoint_seen; //per endpoint_id, last sent to or heard from
+
+                //ids of pruned endpoints, reused before the tables grow
+                endpoint_id_list _free_endpoints; 
+                size_t _endpoints_pruned_size = 0;
+
+                //small frames are packed per peer into bundles, only for peers
+                //that told us they can unpack them
+                frame_bundles _bundles;
+                frame_bundles _ready_bundles;
+                bundle_sizes _bundle_sizes; //largest bundle per endpoint_id, 0 if not supported
+                endpoint_flags _sack_peers; //per endpoint_id, peer understands sack frames
+                boost::asio::steady_timer _bundle_timer;
+                bool _bundle_timer_running = false;
+
+                //encoded datagrams waiting for a sendmmsg call
+                byte_batch _out_batch;
+                udp_endpoints _out_batch_endpoints;
+                size_t _out_batch_start = 0;
+                size_t _out_batch_end = 0;
+                bool _out_batch_waiting = false;
+
+                //congestion control
+                congestion_map _peers;
+                boost::asio::steady_timer _resend_timer;
+                bool _resend_timer_running = false;
+                boost::asio::steady_timer _ack_timer;
+                bool _ack_timer_running = false;
+
+                //sockets sharing the port, datagrams are handled by the 
+                //shard owning the peer so its state stays on one thread
+                std::vector<udp_connection*> _shards;
+                size_t _shard = 0;
 
                 //other
                 boost::asio::io_service& _io;
                 udp_socket_ptr _socket;
                 sequence_type _sequence = 0;
                 bool _writing;
+                bool _batch_io;
+                size_t _fec_group;
+                double _loss;
+                double _bundle_delay; //in microseconds
+                std::minstd_rand _loss_rand;
                 boost::system::error_code _error;
-                udp_stats _stats;
+                udp_stats _stats; //only touched on the shard's thread
+
+                //copy of the stats for other threads
+                udp_stats _published_stats;
+                mutable std::mutex _stats_mutex;
+
+                //working messages per destination, counted as they are sent
+                waiting_counts _waiting;
+                mutable std::mutex _waiting_mutex;
             private:
-                friend void udp_run_thread(udp_queue*);
-                friend void resend_thread(udp_queue*);
+                friend void udp_run_thread(udp_queue*, size_t);
         };
 
         using udp_connection_ptr = std::shared_ptr<udp_connection>;
         using udp_connections = std::vector<udp_connection_ptr>;
+        using asio_services = std::vector<asio_service_ptr>;
 
         class udp_queue
         {
             public:
-                udp_queue(const asio_params& p);
+                udp_queue(const asio_params& p, inbound_queue* sink = nullptr);
                 virtual ~udp_queue();
 
             public:
@@ -190,32 +458,31 @@ namespace fire
                 virtual bool receive(endpoint_message& b);
 
             public:
-                const udp_stats& stats() const; 
+                udp_stats stats() const; 
+                size_t backlog(const endpoint& ep);
 
             private:
                 void bind();
-                const std::string& resolve(const endpoint&);
+                udp_connection& shard_for(const endpoint&);
 
             private:
                 asio_params _p;
-                asio_service_ptr _io;
-                util::thread_uptr _run_thread;
-                util::thread_uptr _resend_thread;
+                asio_services _io; //one per shard
+                std::vector<util::thread_uptr> _run_threads;
+                inbound_queue* _sink;
 
-                udp_connection_ptr _con;
+                udp_connections _cons; //one per shard
                 endpoint_queue _in_queue;
-                udp_resolver_ptr _resolver;
-                resolve_map _rmap;
+                name_resolver_ptr _resolver; //runs on the first shard so has to go before it
                 bool _done;
 
             private:
-                friend void udp_run_thread(udp_queue*);
-                friend void resend_thread(udp_queue*);
+                friend void udp_run_thread(udp_queue*, size_t);
         };
 
         using udp_queue_ptr = std::shared_ptr<udp_queue>;
 
-        udp_queue_ptr create_udp_queue(const asio_params& c);
+        udp_queue_ptr create_udp_queue(const asio_params& c, inbound_queue* sink = nullptr);
     }
 }
 
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+
+#include "network/udp_transport.hpp"
+
+#include "util/dbc.hpp"
+
+namespace u = fire::util;
+
+namespace fire
+{
+    namespace network
+    {
+        namespace
+        {
+            const size_t DEFAULT_SEND_LIMIT = 1024;
+        }
+
+        udp_transport::udp_transport(
+                port_type local_port, 
+                const queue_options& options, 
+                inbound_queue* sink) :
+            _send_limit{DEFAULT_SEND_LIMIT}
+        {
+            REQUIRE(sink);
+
+            //create listen socket
+            asio_params udp_p = {
+                asio_params::udp, 
+                asio_params::bind, 
+                "", //uri
+                "", //host
+                0, //port
+                local_port,
+                false, //block;
+                0, // wait;
+                true, //track_incoming;
+                true, //batch_io;
+                get_opt(options, "fec", size_t(0)), //fec_group;
+                get_opt(options, "loss", 0.0), //loss;
+                get_opt(options, "bundle_delay", 0.0), //bundle_delay;
+                0, //write_cap;
+                0, //write_delay;
+                get_opt(options, "shards", size_t(1)), //shards;
+            };
+            _udp_con = create_udp_queue(udp_p, sink);
+
+            ENSURE(_udp_con);
+        }
+
+        send_result udp_transport::send(const std::string& to, const u::bytes& b, bool robust)
+        {
+            INVARIANT(_udp_con);
+
+            auto a = parse_address(to);
+            endpoint ep { UDP, a.host, a.port};
+            if(_udp_con->backlog(ep) >= _send_limit) return send_would_block;
+
+            endpoint_message em{ep, b, robust}; 
+            return _udp_con->send(em) ? send_queued : send_dropped;
+        }
+
+        bool udp_transport::is_disconnected(const std::string&)
+        {
+            //no connections
+            return true;
+        }
+
+        void udp_transport::set_send_limit(size_t limit)
+        {
+            REQUIRE_GREATER(limit, 0);
+            _send_limit = limit;
+        }
+
+        udp_stats udp_transport::stats() const
+        {
+            INVARIANT(_udp_con);
+            return _udp_con->stats();
+        }
+    }
+}
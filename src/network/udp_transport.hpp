@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+#ifndef FIRESTR_NETWORK_UDP_TRANSPORT_H
+#define FIRESTR_NETWORK_UDP_TRANSPORT_H
+
+#include "network/transport.hpp"
+#include "network/udp_queue.hpp"
+
+#include <atomic>
+
+namespace fire 
+{
+    namespace network 
+    {
+        //udp over the os, one udp_queue bound to the local port
+        class udp_transport : public transport
+        {
+            public:
+                udp_transport(
+                        port_type local_port, 
+                        const queue_options& options, 
+                        inbound_queue* sink);
+
+            public:
+                virtual send_result send(const std::string& to, const util::bytes& b, bool robust);
+                virtual bool is_disconnected(const std::string& address);
+                virtual void set_send_limit(size_t limit);
+                virtual udp_stats stats() const;
+
+            private:
+                udp_queue_ptr _udp_con;
+                std::atomic<size_t> _send_limit;
+        };
+    }
+}
+
+#endif
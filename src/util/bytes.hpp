@@ -45,6 +45,13 @@ namespace fire
         using ubytes = std::vector<ubyte>;
         using bytes_ptr = std::shared_ptr<bytes>;
 
+        //bytes owned by someone else, valid while they are around
+        struct bytes_view
+        {
+            const byte* data = nullptr;
+            size_t size = 0;
+        };
+
         bytes to_bytes(const std::string&);
         std::string to_str(const bytes&);
     }
@@ -32,6 +32,10 @@
 #include "util/mencode.hpp"
 
 #include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
 #include <stdexcept>
 #include <boost/lexical_cast.hpp>
 
@@ -44,21 +48,118 @@ namespace fire
             const std::string INT_TYPE = "int";
             const std::string SIZE_TYPE = "size";
             const std::string REAL_TYPE = "real";
+
+            //most dicts and arrays are small, grow the index once
+            const size_t INDEX_RESERVE = 16;
         }
 
         using boost::lexical_cast;
 
-        value::value() : _v{} {}
-        value::value(bool v) : _v{v} {}
-        value::value(int v) : _v{static_cast<int64_t>(v)} {}
-        value::value(int64_t v) : _v{v} {}
-        value::value(size_t v) : _v{v} {}
-        value::value(double v) : _v{v} {}
-        value::value(const std::string& v) : _v{to_bytes(v)} {}
-        value::value(const bytes& v) : _v{v} {}
-        value::value(const dict& v) : _v{v} {}
-        value::value(const array& v) : _v{v} {}
-        value::value(const value& o) : _v{o._v} {}
+        value::value() : _k{empty_kind} {}
+        value::value(bool v) : _k{bool_kind}, _bool{v} {}
+        value::value(int v) : _k{int_kind}, _int{v} {}
+        value::value(int64_t v) : _k{int_kind}, _int{v} {}
+        value::value(size_t v) : _k{size_kind}, _size{v} {}
+        value::value(double v) : _k{double_kind}, _double{v} {}
+        value::value(const std::string& v) : _k{empty_kind} { set(bytes(v.begin(), v.end()));}
+        value::value(const bytes& v) : _k{empty_kind} { set(v);}
+        value::value(const dict& v) : _k{dict_kind}, _dict{new dict(v)} {}
+        value::value(const array& v) : _k{array_kind}, _array{new array(v)} {}
+        value::value(const value& o) : _k{empty_kind} { copy(o);}
+        value::value(bytes&& v) : _k{empty_kind} { set(std::move(v));}
+        value::value(dict&& v) : _k{dict_kind}, _dict{new dict(std::move(v))} {}
+        value::value(array&& v) : _k{array_kind}, _array{new array(std::move(v))} {}
+        value::value(value&& o) noexcept : _k{empty_kind} { move(std::move(o));}
+        value::~value() { clear();}
+
+        void value::set(const bytes& b)
+        {
+            REQUIRE(_k == empty_kind);
+
+            if(b.size() <= SMALL_BYTES) 
+            {
+                new (&_bytes) bytes(b);
+                _k = bytes_kind;
+            }
+            else
+            {
+                new (&_shared) shared_bytes(std::make_shared<const bytes>(b));
+                _k = shared_bytes_kind;
+            }
+        }
+
+        void value::set(bytes&& b)
+        {
+            REQUIRE(_k == empty_kind);
+
+            if(b.size() <= SMALL_BYTES) 
+            {
+                new (&_bytes) bytes(std::move(b));
+                _k = bytes_kind;
+            }
+            else
+            {
+                new (&_shared) shared_bytes(std::make_shared<const bytes>(std::move(b)));
+                _k = shared_bytes_kind;
+            }
+        }
+
+        void value::copy(const value& o)
+        {
+            REQUIRE(_k == empty_kind);
+
+            switch(o._k)
+            {
+                case empty_kind: break;
+                case bool_kind: _bool = o._bool; break;
+                case int_kind: _int = o._int; break;
+                case size_kind: _size = o._size; break;
+                case double_kind: _double = o._double; break;
+                case bytes_kind: new (&_bytes) bytes(o._bytes); break;
+                case shared_bytes_kind: new (&_shared) shared_bytes(o._shared); break;
+                case dict_kind: _dict = new dict(*o._dict); break;
+                case array_kind: _array = new array(*o._array); break;
+            }
+            _k = o._k;
+        }
+
+        void value::move(value&& o)
+        {
+            REQUIRE(_k == empty_kind);
+
+            switch(o._k)
+            {
+                case empty_kind: break;
+                case bool_kind: _bool = o._bool; break;
+                case int_kind: _int = o._int; break;
+                case size_kind: _size = o._size; break;
+                case double_kind: _double = o._double; break;
+                case bytes_kind: new (&_bytes) bytes(std::move(o._bytes)); break;
+                case shared_bytes_kind: new (&_shared) shared_bytes(std::move(o._shared)); break;
+                case dict_kind: _dict = o._dict; o._dict = nullptr; break;
+                case array_kind: _array = o._array; o._array = nullptr; break;
+            }
+            _k = o._k;
+            o.clear();
+        }
+
+        void value::clear()
+        {
+            switch(_k)
+            {
+                case bytes_kind: _bytes.~bytes(); break;
+                case shared_bytes_kind: _shared.~shared_bytes(); break;
+                case dict_kind: delete _dict; break;
+                case array_kind: delete _array; break;
+                default: break;
+            }
+            _k = empty_kind;
+        }
+
+        void value::wrong_type(const char* what) const
+        {
+            throw std::runtime_error(std::string{"value is not "} + what);
+        }
 
         value::operator bool() const { return as_bool();}
         value::operator int() const { return static_cast<int>(as_int());}
@@ -70,155 +171,147 @@ namespace fire
         value::operator dict() const { return as_dict();}
         value::operator array() const { return as_array();}
 
-        value& value::operator=(bool v) { _v = v; return *this;}
-        value& value::operator=(int v) { _v = static_cast<int64_t>(v); return *this;}
-        value& value::operator=(int64_t v) { _v = v; return *this;}
-        value& value::operator=(size_t v) { _v = v; return *this;}
-        value& value::operator=(double v) { _v = v; return *this;}
-        value& value::operator=(const std::string& v) { _v = to_bytes(v); return *this;}
-        value& value::operator=(const bytes& v) { _v = v; return *this;}
-        value& value::operator=(const dict& v) { _v = v; return *this;}
-        value& value::operator=(const array& v) { _v = v; return *this;}
+        //assign through a temporary, the argument may live inside this value
+        value& value::operator=(bool v) { return *this = value{v};}
+        value& value::operator=(int v) { return *this = value{v};}
+        value& value::operator=(int64_t v) { return *this = value{v};}
+        value& value::operator=(size_t v) { return *this = value{v};}
+        value& value::operator=(double v) { return *this = value{v};}
+        value& value::operator=(const std::string& v) { return *this = value{v};}
+        value& value::operator=(const bytes& v) { return *this = value{v};}
+        value& value::operator=(const dict& v) { return *this = value{v};}
+        value& value::operator=(const array& v) { return *this = value{v};}
         value& value::operator=(const value& o) 
         { 
             if(&o == this) return *this;
-            _v = o._v; 
+            return *this = value{o};
+        }
+        value& value::operator=(value&& o) noexcept
+        { 
+            if(&o == this) return *this;
+
+            value t{std::move(o)};
+            clear();
+            move(std::move(t));
             return *this;
         }
 
         bool value::as_bool() const 
-        try
         { 
-            return boost::any_cast<bool>(_v); 
-        }
-        catch (...)
-        {
-            throw std::runtime_error("value is not an boolean");
+            if(_k != bool_kind) wrong_type("an boolean");
+            return _bool;
         }
 
         int64_t value::as_int() const 
-        try
         { 
-            return boost::any_cast<int64_t>(_v); 
-        }
-        catch (...)
-        {
-            throw std::runtime_error("value is not an integer");
+            if(_k != int_kind) wrong_type("an integer");
+            return _int;
         }
 
         size_t value::as_size() const 
-        try
         { 
-            return boost::any_cast<size_t>(_v); 
-        }
-        catch (...)
-        {
-            throw std::runtime_error("value is not an size type");
+            if(_k != size_kind) wrong_type("an size type");
+            return _size;
         }
 
         double value::as_double() const 
-        try
         { 
-            return boost::any_cast<double>(_v); 
-        }
-        catch (...)
-        {
-            throw std::runtime_error("value is not an real");
+            if(_k != double_kind) wrong_type("an real");
+            return _double;
         }
 
         std::string value::as_string() const
-        try
         { 
-            return to_str(boost::any_cast<const bytes&>(_v)); 
-        }
-        catch (...)
-        {
-            throw std::runtime_error("value is not a string");
+            if(!is_bytes()) wrong_type("a string");
+            return to_str(as_bytes());
         }
 
         const bytes& value::as_bytes() const 
-        try
         { 
-            return boost::any_cast<const bytes&>(_v); 
-        }
-        catch (...)
-        {
-            throw std::runtime_error("value is not a byte array");
+            if(_k == bytes_kind) return _bytes;
+            if(_k != shared_bytes_kind) wrong_type("a byte array");
+            return *_shared;
         }
 
         const dict& value::as_dict() const 
-        try
         { 
-            return boost::any_cast<const dict&>(_v); 
-        }
-        catch (...)
-        {
-            throw std::runtime_error("value is not an dictionary");
+            if(_k != dict_kind) wrong_type("an dictionary");
+            return *_dict;
         }
 
         const array& value::as_array() const 
-        try
         { 
-            return boost::any_cast<const array&>(_v); 
-        }
-        catch (...)
-        {
-            throw std::runtime_error("value is not an array");
+            if(_k != array_kind) wrong_type("an array");
+            return *_array;
         }
 
         dict& value::as_dict() 
-        try
         { 
-            return boost::any_cast<dict&>(_v); 
-        }
-        catch (...)
-        {
-            throw std::runtime_error("value is not an dictionary");
+            if(_k != dict_kind) wrong_type("an dictionary");
+            return *_dict;
         }
         
         array& value::as_array() 
-        try
         { 
-            return boost::any_cast<array&>(_v); 
-        }
-        catch (...)
-        {
-            throw std::runtime_error("value is not an array");
+            if(_k != array_kind) wrong_type("an array");
+            return *_array;
         }
                 
-        bool value::is_bool() const { return _v.type() == typeid(bool);}
-        bool value::is_int() const { return _v.type() == typeid(int64_t);}
-        bool value::is_size() const { return _v.type() == typeid(size_t);}
-        bool value::is_double() const { return _v.type() == typeid(double);}
-        bool value::is_bytes() const { return _v.type() == typeid(bytes);}
-        bool value::is_dict() const { return _v.type() == typeid(dict);}
-        bool value::is_array() const { return _v.type() == typeid(array);}
-        bool value::empty() const { return _v.empty();}
+        bool value::is_bool() const { return _k == bool_kind;}
+        bool value::is_int() const { return _k == int_kind;}
+        bool value::is_size() const { return _k == size_kind;}
+        bool value::is_double() const { return _k == double_kind;}
+        bool value::is_bytes() const { return _k == bytes_kind || _k == shared_bytes_kind;}
+        bool value::is_dict() const { return _k == dict_kind;}
+        bool value::is_array() const { return _k == array_kind;}
+        bool value::empty() const { return _k == empty_kind;}
 
         dict::dict() : _m{} {}
         dict::dict(std::initializer_list<kv> s)
         {
-            for(auto v : s) _m[v.first] = v.second; 
+            for(const auto& v : s) (*this)[v.first] = v.second; 
 
             ENSURE_LESS_EQUAL(_m.size(), s.size());
         }
 
+        dict::value_map::iterator dict::lower_bound(const std::string& k)
+        {
+            return std::lower_bound(_m.begin(), _m.end(), k, 
+                    [](const kv& e, const std::string& k) { return e.first < k;});
+        }
+
+        dict::value_map::const_iterator dict::lower_bound(const std::string& k) const
+        {
+            return std::lower_bound(_m.begin(), _m.end(), k, 
+                    [](const kv& e, const std::string& k) { return e.first < k;});
+        }
+
         value& dict::operator[](const std::string& k)
         {
-            return _m[k];
+            //keys usually come in order when decoding or building
+            if(_m.empty() || _m.back().first < k)
+            {
+                _m.emplace_back(k, value{});
+                return _m.back().second;
+            }
+
+            auto p = lower_bound(k);
+            if(p == _m.end() || p->first != k) p = _m.emplace(p, k, value{});
+
+            ENSURE(p != _m.end());
+            return p->second;
         }
 
         const value& dict::operator[] (const std::string& k) const
         {
-            auto p = _m.find(k);
-            if(p == _m.end()) 
+            auto p = lower_bound(k);
+            if(p == _m.end() || p->first != k) 
             {
                 std::stringstream e;
                 e << "unable to find key `" << k << "' in dictionary" << std::endl;
                 throw std::runtime_error{e.str()}; 
             }
 
-            ENSURE(p != _m.end());
             return p->second;
         }
 
@@ -226,12 +319,17 @@ namespace fire
 
         bool dict::has(const std::string& k) const
         {
-            return _m.count(k) > 0;
+            auto p = lower_bound(k);
+            return p != _m.end() && p->first == k;
         }
 
         bool dict::remove(const std::string& k)
         {
-            return _m.erase(k) > 0;
+            auto p = lower_bound(k);
+            if(p == _m.end() || p->first != k) return false;
+
+            _m.erase(p);
+            return true;
         }
 
         dict::const_iterator dict::begin() const { return _m.begin(); }
@@ -266,81 +364,315 @@ namespace fire
         array::iterator array::end() { return _a.end(); }
 
         void array::add(const value& v) { _a.push_back(v); }
+        void array::add(value&& v) { _a.push_back(std::move(v)); }
         void array::resize(size_t size) { _a.resize(size); }
 
-        template <typename t>
-        void enc(std::ostream& o, char s, char e, const t& v)
+        namespace
+        {
+            size_t count_digits(uint64_t v)
+            {
+                size_t n = 1;
+                for(; v >= 10000; v /= 10000) n += 4;
+                if(v >= 1000) return n + 3;
+                if(v >= 100) return n + 2;
+                if(v >= 10) return n + 1;
+                return n;
+            }
+
+            uint64_t magnitude(int64_t v)
+            {
+                return v < 0 ? 0 - static_cast<uint64_t>(v) : static_cast<uint64_t>(v);
+            }
+
+            void format_digits(uint64_t v, size_t digits, char* b)
+            {
+                auto p = b + digits;
+                do
+                {
+                    *--p = '0' + v % 10;
+                    v /= 10;
+                }
+                while(v != 0);
+            }
+
+            //same text lexical_cast produces
+            const size_t REAL_BUFFER = 32;
+            size_t format_real(double v, char* b)
+            {
+                //whole numbers below 1e17 print as plain digits, 
+                //which is much cheaper than going through printf
+                const bool negative_zero = v == 0 && std::signbit(v);
+                if(v > -1e17 && v < 1e17 && !negative_zero && v == static_cast<int64_t>(v))
+                {
+                    const auto i = static_cast<int64_t>(v);
+                    const auto m = magnitude(i);
+                    const auto digits = count_digits(m);
+
+                    size_t n = 0;
+                    if(i < 0) b[n++] = '-';
+                    format_digits(m, digits, b + n);
+                    return n + digits;
+                }
+
+                const auto n = std::snprintf(b, REAL_BUFFER, "%.17g", v);
+                CHECK_BETWEEN(n, 1, static_cast<int>(REAL_BUFFER) - 1);
+                return n;
+            }
+        }
+
+        size_t encoded_size(bool) { return 1; }
+        size_t encoded_size(int64_t v) { return 2 + (v < 0 ? 1 : 0) + count_digits(magnitude(v)); }
+        size_t encoded_size(size_t v) { return 2 + count_digits(v); }
+
+        size_t encoded_size(double v)
         {
-            o << s << lexical_cast<std::string>(v) << e;
+            char b[REAL_BUFFER];
+            return 2 + format_real(v, b);
         }
 
-        void encode(std::ostream& o, bool v) { o << ( v ? 'T' : 'F'); }
-        void encode(std::ostream& o, int64_t v) { enc(o, 'i', ';', v); }
-        void encode(std::ostream& o, size_t v) { enc(o, 's', ';', v); }
-        void encode(std::ostream& o, double v) { enc(o, 'r', ';', v); }
+        size_t encoded_bytes_size(size_t n) { return count_digits(n) + 1 + n; }
+        size_t encoded_size(const std::string& v) { return encoded_bytes_size(v.size()); }
+        size_t encoded_size(const bytes& v) { return encoded_bytes_size(v.size()); }
+        size_t encoded_size(bytes_view v) { return encoded_bytes_size(v.size); }
+
+        size_t encoded_size(const dict& v)
+        {
+            size_t n = 2;
+            for(const auto& p : v) 
+                n += encoded_size(p.first) + encoded_size(p.second);
+            return n;
+        }
+
+        size_t encoded_size(const array& v)
+        {
+            size_t n = 2;
+            for(const auto& e : v) n += encoded_size(e);
+            return n;
+        }
 
-        template<typename b>
-        void encode_b(std::ostream& o, const b& v)
+        size_t encoded_size(const value& v)
         {
-            o << lexical_cast<std::string>(v.size()) << ':';
-            o.write(&v[0], v.size()); 
+            if(v.empty()) return 1;
+            else if(v.is_bool()) return encoded_size(v.as_bool());
+            else if(v.is_int()) return encoded_size(v.as_int());
+            else if(v.is_size()) return encoded_size(v.as_size());
+            else if(v.is_double()) return encoded_size(v.as_double());
+            else if(v.is_bytes()) return encoded_size(v.as_bytes());
+            else if(v.is_dict()) return encoded_size(v.as_dict());
+            else if(v.is_array()) return encoded_size(v.as_array());
+            CHECK(false && "missed case");
+            return 0;
         }
 
-        void encode(std::ostream& o, const bytes& v) { encode_b(o, v); }
-        void encode(std::ostream& o, const std::string& v) { encode_b(o, v); }
+        encoder::encoder(bytes& b) : 
+            _begin{b.data()}, _p{b.data()}, _end{b.data() + b.size()} {}
 
-        void encode(std::ostream& o, const value& v);
-        void encode(std::ostream& o, const dict& v)
+        encoder::encoder(byte* begin, byte* end) : 
+            _begin{begin}, _p{begin}, _end{end} 
         {
-            o << 'd';
+            REQUIRE(begin <= end);
+        }
+
+        void encoder::put(bool v) 
+        { 
+            room(1);
+            *_p++ = v ? 'T' : 'F';
+        }
+
+        void encoder::put(int64_t v)
+        {
+            const auto m = magnitude(v);
+            const auto digits = count_digits(m);
+            room(2 + (v < 0 ? 1 : 0) + digits);
+
+            *_p++ = 'i';
+            if(v < 0) *_p++ = '-';
+            put_digits(m, digits);
+            *_p++ = ';';
+        }
+
+        void encoder::put(size_t v)
+        {
+            const auto digits = count_digits(v);
+            room(2 + digits);
+
+            *_p++ = 's';
+            put_digits(v, digits);
+            *_p++ = ';';
+        }
+
+        void encoder::put(double v)
+        {
+            char b[REAL_BUFFER];
+            const auto n = format_real(v, b);
+            room(2 + n);
+
+            *_p++ = 'r';
+            put_raw(b, n);
+            *_p++ = ';';
+        }
+
+        void encoder::put(const std::string& v) { put_bytes(v.data(), v.size()); }
+        void encoder::put(const bytes& v) { put_bytes(v.data(), v.size()); }
+        void encoder::put(bytes_view v) { put_bytes(v.data, v.size); }
+
+        void encoder::put(const dict& v)
+        {
+            begin_dict();
             for(const auto& p : v)
             {
-                encode(o, p.first);
-                encode(o, p.second);
+                put(p.first);
+                put(p.second);
             }
-            o << ';';
+            end();
         }
 
-        void encode(std::ostream& o, const array& v)
+        void encoder::put(const array& v)
         {
-            o << 'a';
-            for(const auto& e : v) encode(o, e);
-            o << ';';
+            begin_array();
+            for(const auto& e : v) put(e);
+            end();
+        }
+
+        void encoder::put(const value& v)
+        {
+            if(v.empty()) put_empty();
+            else if(v.is_bool()) put(v.as_bool());
+            else if(v.is_int()) put(v.as_int());
+            else if(v.is_size()) put(v.as_size());
+            else if(v.is_double()) put(v.as_double());
+            else if(v.is_bytes()) put(v.as_bytes());
+            else if(v.is_dict()) put(v.as_dict());
+            else if(v.is_array()) put(v.as_array());
+            else CHECK(false && "missed case");
         }
 
-        void encode_empty(std::ostream& o)
+        void encoder::put_empty() 
+        { 
+            room(1);
+            *_p++ = 'n';
+        }
+
+        void encoder::put_bytes_prefix(size_t n)
         {
-            o << 'n';
+            const auto digits = count_digits(n);
+            room(digits + 1);
+
+            put_digits(n, digits);
+            *_p++ = ':';
         }
 
-        void encode(std::ostream& o, const value& v)
+        byte* encoder::reserve(size_t n)
         {
-            if(v.empty()) encode_empty(o);
-            else if(v.is_bool()) encode(o, v.as_bool());
-            else if(v.is_int()) encode(o, v.as_int());
-            else if(v.is_size()) encode(o, v.as_size());
-            else if(v.is_double()) encode(o, v.as_double());
-            else if(v.is_bytes()) encode(o, v.as_bytes());
-            else if(v.is_dict()) encode(o, v.as_dict());
-            else if(v.is_array()) encode(o, v.as_array());
-            else CHECK(false && "missed case");
+            room(n);
+            auto p = _p;
+            _p += n;
+            return p;
+        }
+
+        void encoder::begin_dict() 
+        { 
+            room(1);
+            *_p++ = 'd';
+        }
+
+        void encoder::begin_array() 
+        { 
+            room(1);
+            *_p++ = 'a';
+        }
+
+        void encoder::end() 
+        { 
+            room(1);
+            *_p++ = ';';
+        }
+
+        bool encoder::done() const { return _p == _end; }
+        size_t encoder::position() const { return _p - _begin; }
+
+        void encoder::put_digits(uint64_t v, size_t digits)
+        {
+            format_digits(v, digits, _p);
+            _p += digits;
+        }
+
+        void encoder::put_bytes(const byte* b, size_t n)
+        {
+            put_bytes_prefix(n);
+            room(n);
+            put_raw(b, n);
+        }
+
+        void encoder::put_raw(const byte* b, size_t n)
+        {
+            if(n == 0) return;
+            std::memcpy(_p, b, n);
+            _p += n;
+        }
+
+        void encoder::room(size_t n) const
+        {
+            if(n <= static_cast<size_t>(_end - _p)) return;
+
+            std::stringstream e;
+            e << "encode buffer too small at byte " << position();
+            throw std::runtime_error{e.str()}; 
+        }
+
+        namespace
+        {
+            template <typename t>
+                bytes encode_to_bytes(const t& v)
+                {
+                    bytes b(encoded_size(v));
+                    encoder e{b};
+                    e.put(v);
+
+                    ENSURE(e.done());
+                    return b;
+                }
+
+            template <typename t>
+                void encode_to_stream(std::ostream& o, const t& v)
+                {
+                    const auto b = encode_to_bytes(v);
+                    o.write(b.data(), b.size());
+                }
+        }
+
+        template<> bytes encode<value>(const value& v) { return encode_to_bytes(v); }
+        template<> bytes encode<dict>(const dict& v) { return encode_to_bytes(v); }
+        template<> bytes encode<array>(const array& v) { return encode_to_bytes(v); }
+        template<> bytes encode<bytes>(const bytes& v) { return encode_to_bytes(v); }
+
+        //writes the length prefix and then the bytes, 
+        //so big byte strings are not copied first
+        void encode(std::ostream& o, const bytes& v)
+        {
+            byte prefix[24];
+            encoder e{prefix, prefix + sizeof(prefix)};
+            e.put_bytes_prefix(v.size());
+
+            o.write(prefix, e.position());
+            o.write(v.data(), v.size()); 
         }
 
         std::ostream& operator<<(std::ostream& o, const dict& v)
         {
-            encode(o, v);
+            encode_to_stream(o, v);
             return o;
         }
 
         std::ostream& operator<<(std::ostream& o, const array& v)
         {
-            encode(o, v);
+            encode_to_stream(o, v);
             return o;
         }
 
         std::ostream& operator<<(std::ostream& o, const value& v)
         {
-            encode(o, v);
+            encode_to_stream(o, v);
             return o;
         }
 
@@ -589,6 +921,476 @@ namespace fire
             v = decode_value(i, w);
             return i;
         }
+
+        decoder::decoder(const bytes& b) : 
+            decoder{b.data(), b.data() + b.size()} {}
+
+        decoder::decoder(const byte* begin, const byte* end) :
+            _begin{begin}, _p{begin}, _end{end}
+        {
+            REQUIRE(begin <= end);
+        }
+
+        bool decoder::done() const
+        {
+            return _p == _end;
+        }
+
+        size_t decoder::position() const
+        {
+            return _p - _begin;
+        }
+
+        bool decoder::at_bytes() const
+        {
+            return _p != _end && *_p >= '0' && *_p <= '9';
+        }
+
+        void decoder::fail(const std::string& what) const
+        {
+            std::stringstream e;
+            e << what << " at byte " << position();
+            throw std::runtime_error{e.str()}; 
+        }
+
+        void decoder::expect(char c, const char* type)
+        {
+            if(_p == _end) fail("unexpected end of buffer");
+            if(*_p != c) fail(std::string{"expected "} + type);
+            _p++;
+        }
+
+        uint64_t decoder::next_digits(char end)
+        {
+            const auto start = _p;
+            const auto max = std::numeric_limits<uint64_t>::max();
+
+            uint64_t v = 0;
+            for(; _p != _end && *_p >= '0' && *_p <= '9'; _p++)
+            {
+                const uint64_t d = *_p - '0';
+                if(v > (max - d) / 10) fail("number too large");
+                v = v * 10 + d;
+            }
+
+            if(_p == _end) fail("unexpected end of buffer");
+            if(_p == start || *_p != end) fail("expected a number");
+            _p++;
+            return v;
+        }
+
+        bool decoder::next_bool()
+        {
+            if(_p == _end) return false;
+            if(*_p != 'T' && *_p != 'F') fail("expected boolean");
+            return *_p++ == 'T';
+        }
+
+        int64_t decoder::next_int()
+        {
+            if(_p == _end) return 0;
+            expect('i', INT_TYPE.c_str());
+
+            bool negative = false;
+            if(_p != _end && (*_p == '-' || *_p == '+')) negative = *_p++ == '-';
+
+            const auto max = static_cast<uint64_t>(std::numeric_limits<int64_t>::max());
+            const auto v = next_digits(';');
+            if(v > max + (negative ? 1 : 0)) fail("integer out of range");
+
+            return negative ? static_cast<int64_t>(0 - v) : static_cast<int64_t>(v);
+        }
+
+        size_t decoder::next_size()
+        {
+            if(_p == _end) return 0;
+            expect('s', SIZE_TYPE.c_str());
+
+            const auto v = next_digits(';');
+            if(v > std::numeric_limits<size_t>::max()) fail("size out of range");
+            return v;
+        }
+
+        double decoder::next_double()
+        {
+            if(_p == _end) return 0;
+            expect('r', REAL_TYPE.c_str());
+
+            const auto e = std::find(_p, _end, ';');
+            if(e == _end) fail("unexpected end of buffer");
+
+            double v = 0;
+            if(!boost::conversion::try_lexical_convert(_p, e - _p, v)) fail("expected real");
+            _p = e + 1;
+            return v;
+        }
+
+        bytes_view decoder::next_bytes_view()
+        {
+            if(_p == _end) return {};
+            if(!at_bytes()) fail(std::string{"expected byte string but got `"} + *_p + "'");
+
+            const auto size = next_digits(':');
+            if(size > static_cast<size_t>(_end - _p)) fail("unexpected end of buffer");
+
+            bytes_view v;
+            v.data = _p;
+            v.size = size;
+            _p += size;
+            return v;
+        }
+
+        bytes decoder::next_bytes()
+        {
+            const auto v = next_bytes_view();
+            return bytes(v.data, v.data + v.size);
+        }
+
+        std::string decoder::next_key()
+        {
+            if(!at_bytes()) fail("expected byte key");
+            const auto v = next_bytes_view();
+            return std::string(v.data, v.size);
+        }
+
+        value decoder::next_value()
+        {
+            if(_p == _end) return {};
+
+            switch(*_p)
+            {
+                case 'T': 
+                case 'F': return next_bool();
+                case 'i': return next_int();
+                case 's': return next_size();
+                case 'r': return next_double();
+                case 'd': return next_dict();
+                case 'a': return next_array();
+                case 'n': _p++; return {};
+                default: 
+                      if(at_bytes()) return next_bytes();
+            }
+
+            fail(std::string{"unexpected value type `"} + *_p + "'");
+            return {};
+        }
+
+        dict decoder::next_dict()
+        {
+            dict d;
+            if(_p == _end) return d;
+            expect('d', "dictionary");
+
+            while(true)
+            {
+                if(_p == _end) fail("unexpected end of buffer");
+                if(*_p == ';') break;
+
+                auto k = next_key();
+                d[k] = next_value();
+            }
+            _p++;
+
+            return d;
+        }
+
+        array decoder::next_array()
+        {
+            array a;
+            if(_p == _end) return a;
+            expect('a', "array");
+
+            while(true)
+            {
+                if(_p == _end) fail("unexpected end of buffer");
+                if(*_p == ';') break;
+
+                a.add(next_value());
+            }
+            _p++;
+
+            return a;
+        }
+
+        void decoder::skip()
+        {
+            if(_p == _end) return;
+
+            switch(*_p)
+            {
+                case 'T': 
+                case 'F': 
+                case 'n': _p++; return;
+                case 'i': 
+                case 's': 
+                case 'r': 
+                {
+                    const auto e = std::find(_p, _end, ';');
+                    if(e == _end) fail("unexpected end of buffer");
+                    _p = e + 1;
+                    return;
+                }
+                case 'd':
+                case 'a':
+                {
+                    const bool is_dict = *_p++ == 'd';
+                    while(true)
+                    {
+                        if(_p == _end) fail("unexpected end of buffer");
+                        if(*_p == ';') break;
+
+                        if(is_dict)
+                        {
+                            if(!at_bytes()) fail("expected byte key");
+                            next_bytes_view();
+                        }
+                        skip();
+                    }
+                    _p++;
+                    return;
+                }
+                default: 
+                      if(at_bytes()) 
+                      {
+                          next_bytes_view();
+                          return;
+                      }
+            }
+
+            fail(std::string{"unexpected value type `"} + *_p + "'");
+        }
+
+        value_view decoder::next_view()
+        {
+            const auto start = _p;
+            skip();
+            return value_view{start, _p, true};
+        }
+
+        value_view::value_view() : _b{nullptr}, _e{nullptr} {}
+
+        value_view::value_view(const bytes& b) : 
+            value_view{b.data(), b.data() + b.size()} {}
+
+        value_view::value_view(const byte* begin, const byte* end) :
+            _b{begin}, _e{begin}
+        {
+            REQUIRE(begin <= end);
+
+            //find where the value ends
+            decoder d{begin, end};
+            d.skip();
+            _e = begin + d.position();
+
+            REQUIRE_LESS_EQUAL(static_cast<size_t>(_e - _b), std::numeric_limits<uint32_t>::max());
+        }
+
+        value_view::value_view(const byte* begin, const byte* end, bool) :
+            _b{begin}, _e{end}
+        {
+            REQUIRE(begin <= end);
+            REQUIRE_LESS_EQUAL(static_cast<size_t>(_e - _b), std::numeric_limits<uint32_t>::max());
+        }
+
+        char value_view::type() const
+        {
+            return _b != _e ? *_b : 'n';
+        }
+
+        bool value_view::is_bool() const { return type() == 'T' || type() == 'F';}
+        bool value_view::is_int() const { return type() == 'i';}
+        bool value_view::is_size() const { return type() == 's';}
+        bool value_view::is_double() const { return type() == 'r';}
+        bool value_view::is_bytes() const { return type() >= '0' && type() <= '9';}
+        bool value_view::is_dict() const { return type() == 'd';}
+        bool value_view::is_array() const { return type() == 'a';}
+        bool value_view::empty() const { return type() == 'n';}
+
+        bool value_view::as_bool() const
+        {
+            if(!is_bool()) throw std::runtime_error("value is not an boolean");
+            return type() == 'T';
+        }
+
+        int64_t value_view::as_int() const
+        {
+            if(!is_int()) throw std::runtime_error("value is not an integer");
+            decoder d{_b, _e};
+            return d.next_int();
+        }
+
+        size_t value_view::as_size() const
+        {
+            if(!is_size()) throw std::runtime_error("value is not an size type");
+            decoder d{_b, _e};
+            return d.next_size();
+        }
+
+        double value_view::as_double() const
+        {
+            if(!is_double()) throw std::runtime_error("value is not an real");
+            decoder d{_b, _e};
+            return d.next_double();
+        }
+
+        std::string value_view::as_string() const
+        {
+            if(!is_bytes()) throw std::runtime_error("value is not a string");
+            const auto v = as_bytes_view();
+            return std::string(v.data, v.size);
+        }
+
+        bytes_view value_view::as_bytes_view() const
+        {
+            if(!is_bytes()) throw std::runtime_error("value is not a byte array");
+            decoder d{_b, _e};
+            return d.next_bytes_view();
+        }
+
+        value value_view::decode() const
+        {
+            decoder d{_b, _e};
+            return d.next_value();
+        }
+
+        bytes_view value_view::encoded() const
+        {
+            bytes_view v;
+            v.data = _b;
+            v.size = _e - _b;
+            return v;
+        }
+
+        void value_view::index() const
+        {
+            if(_index) return;
+
+            const bool is_d = is_dict();
+            if(!is_d && !is_array()) throw std::runtime_error("value is not a dictionary or array");
+
+            auto es = std::make_shared<entries>();
+            es->reserve(INDEX_RESERVE);
+
+            //the value was skipped over when the view was made, 
+            //so it is known to be well formed
+            decoder d{_b, _e};
+            d._p++;
+            while(*d._p != ';')
+            {
+                entry e{0, 0, 0, 0};
+                if(is_d)
+                {
+                    const auto k = d.next_bytes_view();
+                    e.key = k.data - _b;
+                    e.key_size = k.size;
+                }
+                e.begin = d.position();
+                d.skip();
+                e.end = d.position();
+                es->push_back(e);
+            }
+
+            _index = es;
+            ENSURE(_index);
+        }
+
+        size_t value_view::size() const
+        {
+            index();
+            return _index->size();
+        }
+
+        value_view value_view::operator[](size_t i) const
+        {
+            if(!is_array()) throw std::runtime_error("value is not an array");
+            index();
+            if(i >= _index->size()) throw std::runtime_error("array index out of range");
+
+            const auto& e = (*_index)[i];
+            return value_view{_b + e.begin, _b + e.end, true};
+        }
+
+        const value_view::entry* value_view::find(const std::string& k) const
+        {
+            if(!is_dict()) throw std::runtime_error("value is not an dictionary");
+            index();
+
+            //the last of repeated keys wins, like when decoding
+            for(auto e = _index->rbegin(); e != _index->rend(); e++)
+                if(e->key_size == k.size() && std::equal(k.begin(), k.end(), _b + e->key)) 
+                    return &*e;
+            return nullptr;
+        }
+
+        value_view value_view::operator[](const std::string& k) const
+        {
+            auto e = find(k);
+            if(!e) throw std::runtime_error{"unable to find key `" + k + "' in dictionary"}; 
+
+            return value_view{_b + e->begin, _b + e->end, true};
+        }
+
+        bool value_view::has(const std::string& k) const
+        {
+            return find(k) != nullptr;
+        }
+
+        bytes_view value_view::key(size_t i) const
+        {
+            if(!is_dict()) throw std::runtime_error("value is not an dictionary");
+            index();
+            if(i >= _index->size()) throw std::runtime_error("dictionary index out of range");
+
+            const auto& e = (*_index)[i];
+            bytes_view v;
+            v.data = _b + e.key;
+            v.size = e.key_size;
+            return v;
+        }
+
+        value_view value_view::value_at(size_t i) const
+        {
+            if(!is_dict()) throw std::runtime_error("value is not an dictionary");
+            index();
+            if(i >= _index->size()) throw std::runtime_error("dictionary index out of range");
+
+            const auto& e = (*_index)[i];
+            return value_view{_b + e.begin, _b + e.end, true};
+        }
+
+        template<> 
+            void decode<value>(const bytes& b, value& v)
+            {
+                decoder d{b};
+                v = d.next_value();
+            }
+
+        template<> 
+            void decode<dict>(const bytes& b, dict& v)
+            {
+                decoder d{b};
+                v = d.next_dict();
+            }
+
+        template<> 
+            void decode<array>(const bytes& b, array& v)
+            {
+                decoder d{b};
+                v = d.next_array();
+            }
+
+        //anything but a byte string decodes to empty bytes
+        template<> 
+            void decode<bytes>(const bytes& b, bytes& v)
+            {
+                decoder d{b};
+                if(d.at_bytes()) v = d.next_bytes();
+                else 
+                {
+                    d.next_value();
+                    v.clear();
+                }
+            }
     }
 }
 
@@ -38,8 +38,7 @@
 #include <map>
 #include <sstream>
 #include <memory>
-
-#include <boost/any.hpp>
+#include <vector>
 
 #include "util/bytes.hpp"
 #include "util/dbc.hpp"
@@ -51,8 +50,15 @@ namespace fire
         class dict;
         class array;
 
+        //a small tagged union. Numbers live in the value, byte strings 
+        //up to SMALL_BYTES are owned by it and longer ones are shared 
+        //between copies since they are never changed in place. Dicts
+        //and arrays are copied deeply like before.
         class value
         {
+            public:
+                static const size_t SMALL_BYTES = 256;
+
             public:
                 value();
                 value(bool v);
@@ -65,6 +71,11 @@ namespace fire
                 value(const dict& v);
                 value(const array& v);
                 value(const value& o);
+                value(bytes&& v);
+                value(dict&& v);
+                value(array&& v);
+                value(value&& o) noexcept;
+                ~value();
 
             public:
                 operator bool() const;
@@ -88,6 +99,7 @@ namespace fire
                 value& operator=(const dict& v);
                 value& operator=(const array& v);
                 value& operator=(const value& o);
+                value& operator=(value&& o) noexcept;
 
             public:
                 bool as_bool() const;
@@ -112,15 +124,53 @@ namespace fire
                 bool empty() const;
 
             private:
-                boost::any _v;
+                enum kind : unsigned char 
+                { 
+                    empty_kind, 
+                    bool_kind, 
+                    int_kind, 
+                    size_kind, 
+                    double_kind, 
+                    bytes_kind, 
+                    shared_bytes_kind, 
+                    dict_kind, 
+                    array_kind
+                };
+                using shared_bytes = std::shared_ptr<const bytes>;
+
+            private:
+                void set(const bytes&);
+                void set(bytes&&);
+                void copy(const value&);
+                void move(value&&);
+                void clear();
+                void wrong_type(const char*) const;
+
+            private:
+                kind _k;
+                union
+                {
+                    bool _bool;
+                    int64_t _int;
+                    size_t _size;
+                    double _double;
+                    bytes _bytes;
+                    shared_bytes _shared;
+                    dict* _dict;
+                    array* _array;
+                };
         };
 
         using kv = std::pair<std::string, value>;
 
+        //entries are kept sorted by key in one vector. Like a vector,
+        //adding a key moves the others, so a value& or iterator from the
+        //dict does not survive it. A value owns its dict or array on the
+        //heap, so what as_dict() and as_array() return does.
         class dict
         {
             private:
-                using value_map = std::map<std::string, value>;
+                using value_map = std::vector<kv>;
 
             public:
                 using value_type = value_map::value_type;
@@ -147,6 +197,10 @@ namespace fire
                 iterator begin();
                 iterator end();
 
+            private:
+                value_map::iterator lower_bound(const std::string& k);
+                value_map::const_iterator lower_bound(const std::string& k) const;
+
             private:
                 value_map _m;
         };
@@ -168,6 +222,7 @@ namespace fire
 
             public:
                 void add(const value&);
+                void add(value&&);
                 void resize(size_t size);
 
             public:
@@ -222,6 +277,193 @@ namespace fire
         std::istream& operator>>(std::istream&, array&);
         std::istream& operator>>(std::istream&, value&);
 
+        class value_view;
+
+        //reads mencoded values straight out of a buffer without copying
+        //it into a stream. At the end of the buffer values come back 
+        //empty, like reading from an exhausted stream. 
+        class decoder
+        {
+            public:
+                decoder(const bytes&);
+                decoder(const byte* begin, const byte* end);
+
+            public:
+                value next_value();
+                dict next_dict();
+                array next_array();
+                bytes next_bytes();
+                bool next_bool();
+                int64_t next_int();
+                size_t next_size();
+                double next_double();
+
+                //byte string pointing into the buffer
+                bytes_view next_bytes_view();
+
+                //next value left encoded in the buffer
+                value_view next_view();
+                void skip();
+
+                bool at_bytes() const;
+                bool done() const;
+                size_t position() const;
+
+            private:
+                std::string next_key();
+                uint64_t next_digits(char end);
+                void expect(char c, const char* type);
+                void fail(const std::string&) const;
+
+            private:
+                const byte* _begin;
+                const byte* _p;
+                const byte* _end;
+
+            private:
+                friend class value_view;
+        };
+
+        //one mencoded value read in place. Dict entries and array 
+        //elements are indexed the first time one is asked for and only
+        //decoded when used. The buffer has to outlive the view. Copies
+        //made before the index is built build their own.
+        class value_view
+        {
+            public:
+                value_view();
+                value_view(const bytes&);
+                value_view(const byte* begin, const byte* end);
+
+            public:
+                bool is_bool() const;
+                bool is_int() const;
+                bool is_size() const;
+                bool is_double() const;
+                bool is_bytes() const;
+                bool is_dict() const;
+                bool is_array() const;
+                bool empty() const;
+
+            public:
+                bool as_bool() const;
+                int64_t as_int() const;
+                size_t as_size() const;
+                double as_double() const;
+                std::string as_string() const;
+                bytes_view as_bytes_view() const;
+
+                //decodes this value and everything in it
+                value decode() const;
+
+                //the value as it is encoded in the buffer
+                bytes_view encoded() const;
+
+            public:
+                //number of elements or entries
+                size_t size() const;
+
+                value_view operator[](size_t) const;
+                value_view operator[](const std::string& k) const;
+                bool has(const std::string& k) const;
+
+                //key of the nth dict entry
+                bytes_view key(size_t) const;
+
+                //value of the nth dict entry
+                value_view value_at(size_t) const;
+
+            private:
+                value_view(const byte* begin, const byte* end, bool exact);
+                char type() const;
+                void index() const;
+
+            private:
+                //offsets from the start of the value
+                struct entry
+                {
+                    uint32_t key;
+                    uint32_t key_size;
+                    uint32_t begin;
+                    uint32_t end;
+                };
+                using entries = std::vector<entry>;
+                using entries_ptr = std::shared_ptr<entries>;
+
+                const entry* find(const std::string& k) const;
+
+            private:
+                const byte* _b;
+                const byte* _e;
+                mutable entries_ptr _index;
+
+            private:
+                friend class decoder;
+        };
+
+        //exact number of bytes a value takes once mencoded
+        size_t encoded_size(bool);
+        size_t encoded_size(int64_t);
+        size_t encoded_size(size_t);
+        size_t encoded_size(double);
+        size_t encoded_size(const std::string&);
+        size_t encoded_size(const bytes&);
+        size_t encoded_size(bytes_view);
+        size_t encoded_size(const dict&);
+        size_t encoded_size(const array&);
+        size_t encoded_size(const value&);
+
+        //a byte string of n bytes with its length prefix
+        size_t encoded_bytes_size(size_t n);
+
+        //writes mencoded values straight into a buffer sized up front
+        //with encoded_size. The buffer is never grown, running past 
+        //its end throws.
+        class encoder
+        {
+            public:
+                encoder(bytes&);
+                encoder(byte* begin, byte* end);
+
+            public:
+                void put(bool);
+                void put(int64_t);
+                void put(size_t);
+                void put(double);
+                void put(const std::string&);
+                void put(const bytes&);
+                void put(bytes_view);
+                void put(const dict&);
+                void put(const array&);
+                void put(const value&);
+                void put_empty();
+
+                //length prefix of a byte string whose n bytes are 
+                //put next. Lets nested encodings be written in place.
+                void put_bytes_prefix(size_t n);
+
+                //hands out the next n bytes for the caller to fill in
+                byte* reserve(size_t n);
+
+                void begin_dict();
+                void begin_array();
+                void end();
+
+                bool done() const;
+                size_t position() const;
+
+            private:
+                void put_digits(uint64_t, size_t digits);
+                void put_bytes(const byte*, size_t);
+                void put_raw(const byte*, size_t);
+                void room(size_t) const;
+
+            private:
+                byte* _begin;
+                byte* _p;
+                byte* _end;
+        };
+
         template <typename type> 
             bytes encode(const type& v)
             {
@@ -230,6 +472,12 @@ namespace fire
                 return to_bytes(s.str());
             }
 
+        //mencode types are sized first and written in one go
+        template<> bytes encode<value>(const value&);
+        template<> bytes encode<dict>(const dict&);
+        template<> bytes encode<array>(const array&);
+        template<> bytes encode<bytes>(const bytes&);
+
         template <typename type> 
             void decode(const bytes& b, type& v)
             {
@@ -237,12 +485,17 @@ namespace fire
                 s >> v;
             }
 
+        //mencode types skip the stream
+        template<> void decode<value>(const bytes&, value&);
+        template<> void decode<dict>(const bytes&, dict&);
+        template<> void decode<array>(const bytes&, array&);
+        template<> void decode<bytes>(const bytes&, bytes&);
+
         template <typename type> 
             type decode(const bytes& b)
             {
                 type v;
-                std::stringstream s{to_str(b)};
-                s >> v;
+                decode(b, v);
                 return v;
             }
 
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+#ifndef FIRESTR_UTIL_RING_H
+#define FIRESTR_UTIL_RING_H
+
+#include <array>
+#include <atomic>
+#include <type_traits>
+
+#include "util/dbc.hpp"
+
+namespace fire 
+{
+    namespace util 
+    {
+        //fixed size lock free ring with one producer thread and one consumer
+        //thread. items are copied in and out, so keep them trivially copyable.
+        template<class t, size_t capacity>
+        class spsc_ring
+        {
+            static_assert(capacity > 0 && (capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+            static_assert(std::is_trivially_copyable<t>::value, "ring items must be trivially copyable");
+
+            public:
+                spsc_ring() : _head{0}, _tail{0} {}
+                spsc_ring(const spsc_ring&) = delete;
+                spsc_ring& operator=(const spsc_ring&) = delete;
+
+                //producer side. returns false if the ring is full
+                bool push(const t& v)
+                {
+                    const auto tail = _tail.load(std::memory_order_relaxed);
+                    const auto head = _head.load(std::memory_order_acquire);
+                    if(tail - head == capacity) return false;
+
+                    _items[tail & MASK] = v;
+                    _tail.store(tail + 1, std::memory_order_release);
+                    return true;
+                }
+
+                //consumer side. returns false if the ring is empty
+                bool pop(t& v)
+                {
+                    const auto head = _head.load(std::memory_order_relaxed);
+                    const auto tail = _tail.load(std::memory_order_acquire);
+                    if(head == tail) return false;
+
+                    v = _items[head & MASK];
+                    _head.store(head + 1, std::memory_order_release);
+                    return true;
+                }
+
+                size_t size() const
+                {
+                    const auto tail = _tail.load(std::memory_order_acquire);
+                    const auto head = _head.load(std::memory_order_acquire);
+
+                    ENSURE_LESS_EQUAL(tail - head, capacity);
+                    return tail - head;
+                }
+
+                bool empty() const { return size() == 0; }
+                bool full() const { return size() == capacity; }
+
+            private:
+                static const size_t MASK = capacity - 1;
+
+                std::array<t, capacity> _items;
+
+                //pad the indices apart so the producer and consumer
+                //don't fight over the same cache line
+                static const size_t CACHE_LINE = 64;
+                char _pad0[CACHE_LINE];
+                std::atomic<size_t> _head;
+                char _pad1[CACHE_LINE - sizeof(std::atomic<size_t>)];
+                std::atomic<size_t> _tail;
+        };
+    }
+}
+
+#endif
@@ -33,10 +33,15 @@
 #ifndef FIRESTR_UTIL_SERIALIZE_H
 #define FIRESTR_UTIL_SERIALIZE_H
 
+#include <algorithm>
 #include <list>
 #include <map>
 #include <set>
+#include <stdexcept>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 #include "util/mencode.hpp"
 
 namespace fire
@@ -329,19 +334,548 @@ namespace fire
                 dict _d;
         };
 
+        /**
+         * Streams f_serialize types straight to and from mencode without 
+         * building a dict first. The bytes are the same mencode_out makes. 
+         * Like a dict, fields go out in key order. So one pass measures 
+         * every field and a second writes each into its place in the buffer.
+         *
+         * Types that only serialize with mencode_in/mencode_out fall back
+         * to them.
+         */
+        class mencode_sizer;
+        class mencode_writer;
+        class mencode_reader;
+
+        namespace detail
+        {
+            template <class T, class Enable = void> struct mencode_traits;
+            template <class T> void read_value(const value_view&, T&);
+
+            template <class T, class A>
+                struct serializes_with
+                {
+                    template <class U>
+                        static auto test(int) -> 
+                        decltype(std::declval<U&>().serialize(std::declval<A&>()), std::true_type{});
+
+                    template <class>
+                        static std::false_type test(...);
+
+                    static const bool value = decltype(test<T>(0))::value;
+                };
+
+            template <class T>
+                using has_fields = std::integral_constant<bool, mencode_traits<T>::fields>;
+
+            //where each field of a type goes once encoded
+            struct field_layout
+            {
+                struct slot
+                {
+                    std::string key;
+                    size_t size; //key and value
+                    size_t uses;
+                    size_t written;
+                    size_t offset;
+                };
+                std::vector<slot> slots;
+
+                //value of a type without keyed fields
+                size_t unkeyed_size = 0;
+                size_t unkeyed_uses = 0;
+                size_t unkeyed_written = 0;
+
+                size_t size = 0;
+
+                field_layout() { slots.reserve(8); }
+
+                //the last use of a key wins, like assigning into a dict
+                void add(const std::string& k, size_t value_size)
+                {
+                    const auto size = encoded_size(k) + value_size;
+                    for(auto& s : slots)
+                        if(s.key == k) 
+                        {
+                            s.size = size;
+                            s.uses++;
+                            return;
+                        }
+
+                    slots.push_back(slot{k, size, 1, 0, 0});
+                }
+
+                void finish()
+                {
+                    if(slots.empty())
+                    {
+                        size = unkeyed_uses ? unkeyed_size : encoded_size(value{});
+                        return;
+                    }
+
+                    std::sort(slots.begin(), slots.end(), 
+                            [](const slot& a, const slot& b) { return a.key < b.key;});
+
+                    size_t offset = 1;
+                    for(auto& s : slots)
+                    {
+                        s.offset = offset;
+                        offset += s.size;
+                    }
+                    size = offset + 1;
+                }
+
+                slot& find(const std::string& k)
+                {
+                    auto s = std::lower_bound(slots.begin(), slots.end(), k, 
+                            [](const slot& s, const std::string& k) { return s.key < k;});
+                    CHECK(s != slots.end() && s->key == k);
+                    return *s;
+                }
+            };
+        }
+
+        class mencode_sizer
+        {
+            public:
+                mencode_sizer(detail::field_layout& l) : _l(l) {}
+
+            public:
+                template <class T>
+                    void operator()(const std::string& k, const T& t)
+                    {
+                        _l.add(k, detail::mencode_traits<T>::size(t));
+                    }
+
+                template <class T>
+                    void operator()(const T& t)
+                    {
+                        unkeyed(t, detail::has_fields<T>{});
+                    }
+
+            private:
+                //fields of a nested type are added to this one
+                template <class T>
+                    void unkeyed(const T& t, std::true_type)
+                    {
+                        const_cast<T&>(t).serialize(*this);
+                    }
+
+                template <class T>
+                    void unkeyed(const T& t, std::false_type)
+                    {
+                        _l.unkeyed_size = detail::mencode_traits<T>::size(t);
+                        _l.unkeyed_uses++;
+                    }
+
+            private:
+                detail::field_layout& _l;
+        };
+
+        class mencode_writer
+        {
+            public:
+                mencode_writer(byte* b, detail::field_layout& l) : _b(b), _l(l) {}
+
+            public:
+                template <class T>
+                    void operator()(const std::string& k, const T& t)
+                    {
+                        auto& s = _l.find(k);
+                        if(++s.written != s.uses) return;
+
+                        encoder e{_b + s.offset, _b + s.offset + s.size};
+                        e.put(k);
+                        detail::mencode_traits<T>::put(e, t);
+                        ENSURE(e.done());
+                    }
+
+                template <class T>
+                    void operator()(const T& t)
+                    {
+                        unkeyed(t, detail::has_fields<T>{});
+                    }
+
+            private:
+                template <class T>
+                    void unkeyed(const T& t, std::true_type)
+                    {
+                        const_cast<T&>(t).serialize(*this);
+                    }
+
+                template <class T>
+                    void unkeyed(const T& t, std::false_type)
+                    {
+                        if(!_l.slots.empty()) return;
+                        if(++_l.unkeyed_written != _l.unkeyed_uses) return;
+
+                        encoder e{_b, _b + _l.size};
+                        detail::mencode_traits<T>::put(e, t);
+                        ENSURE(e.done());
+                    }
+
+            private:
+                byte* _b;
+                detail::field_layout& _l;
+        };
+
+        class mencode_reader
+        {
+            public:
+                mencode_reader(const value_view& v) : _v(v) {}
+
+            public:
+                template <class T>
+                    void operator()(const std::string& k, T& t)
+                    {
+                        detail::mencode_traits<T>::read(has(k) ? _v[k] : value_view{}, t);
+                    }
+
+                template <class T>
+                    void operator()(T& t)
+                    {
+                        unkeyed(t, detail::has_fields<T>{});
+                    }
+
+                bool has(const std::string& k) const { return _v.is_dict() && _v.has(k);}
+                const mencode_reader& dct() const { return *this;}
+
+            private:
+                template <class T>
+                    void unkeyed(T& t, std::true_type)
+                    {
+                        t.serialize(*this);
+                    }
+
+                template <class T>
+                    void unkeyed(T& t, std::false_type)
+                    {
+                        detail::read_value(_v, t);
+                    }
+
+            private:
+                value_view _v;
+        };
+
+        namespace detail
+        {
+            //types a value holds, read the way value converts them
+            template <class T>
+                struct value_traits
+                {
+                    static const bool fields = false;
+                    static size_t size(const T& t) { return encoded_size(t); }
+                    static void put(encoder& e, const T& t) { e.put(t); }
+                };
+
+            template <> struct mencode_traits<bool> : value_traits<bool>
+            {
+                static void read(const value_view& v, bool& t) { t = v.as_bool(); }
+            };
+
+            template <> struct mencode_traits<size_t> : value_traits<size_t>
+            {
+                static void read(const value_view& v, size_t& t) { t = v.as_size(); }
+            };
+
+            template <> struct mencode_traits<double> : value_traits<double>
+            {
+                static void read(const value_view& v, double& t) { t = v.as_double(); }
+            };
+
+            template <> struct mencode_traits<std::string> : value_traits<std::string>
+            {
+                static void read(const value_view& v, std::string& t) { t = v.as_string(); }
+            };
+
+            template <> struct mencode_traits<bytes> : value_traits<bytes>
+            {
+                static void read(const value_view& v, bytes& t) 
+                { 
+                    const auto b = v.as_bytes_view();
+                    t.assign(b.data, b.data + b.size);
+                }
+            };
+
+            template <> struct mencode_traits<dict> : value_traits<dict>
+            {
+                static void read(const value_view& v, dict& t) 
+                { 
+                    auto d = v.decode();
+                    t = std::move(d.as_dict());
+                }
+            };
+
+            template <> struct mencode_traits<array> : value_traits<array>
+            {
+                static void read(const value_view& v, array& t) 
+                { 
+                    auto a = v.decode();
+                    t = std::move(a.as_array());
+                }
+            };
+
+            template <> struct mencode_traits<value> : value_traits<value>
+            {
+                static void read(const value_view& v, value& t) { t = v.decode(); }
+            };
+
+            //int is stored as a 64 bit integer
+            template <> struct mencode_traits<int>
+            {
+                static const bool fields = false;
+                static size_t size(int t) { return encoded_size(static_cast<int64_t>(t)); }
+                static void put(encoder& e, int t) { e.put(static_cast<int64_t>(t)); }
+                static void read(const value_view& v, int& t) { t = static_cast<int>(v.as_int()); }
+            };
+
+            template <class C>
+                struct collection_traits
+                {
+                    using element = mencode_traits<typename C::value_type>;
+                    static const bool fields = false;
+
+                    static size_t size(const C& c)
+                    {
+                        size_t n = 2;
+                        for(const auto& v : c) n += element::size(v);
+                        return n;
+                    }
+
+                    static void put(encoder& e, const C& c)
+                    {
+                        e.begin_array();
+                        for(const auto& v : c) element::put(e, v);
+                        e.end();
+                    }
+
+                    static void read(const value_view& v, C& c)
+                    {
+                        c.clear();
+                        if(!v.is_array()) throw std::runtime_error("value is not an array");
+
+                        const auto size = v.size();
+                        for(size_t i = 0; i < size; i++)
+                        {
+                            typename C::value_type t;
+                            read_value(v[i], t);
+                            c.insert(c.end(), std::move(t));
+                        }
+                    }
+                };
+
+            template <class T> struct mencode_traits<std::vector<T>> : collection_traits<std::vector<T>> {};
+            template <class T> struct mencode_traits<std::list<T>> : collection_traits<std::list<T>> {};
+            template <class T> struct mencode_traits<std::set<T>> : collection_traits<std::set<T>> {};
+
+            template <class M, bool sorted>
+                struct map_traits
+                {
+                    using element = mencode_traits<typename M::mapped_type>;
+                    using entry = typename M::value_type;
+                    static const bool fields = false;
+
+                    static size_t size(const M& m)
+                    {
+                        size_t n = 2;
+                        for(const auto& p : m) n += encoded_size(p.first) + element::size(p.second);
+                        return n;
+                    }
+
+                    static void put(encoder& e, const entry& p)
+                    {
+                        e.put(p.first);
+                        element::put(e, p.second);
+                    }
+
+                    //entries go out in key order, like a dict
+                    static void put(encoder& e, const M& m)
+                    {
+                        e.begin_dict();
+                        if(sorted) for(const auto& p : m) put(e, p);
+                        else
+                        {
+                            std::vector<const entry*> ps;
+                            ps.reserve(m.size());
+                            for(const auto& p : m) ps.push_back(&p);
+                            std::sort(ps.begin(), ps.end(), 
+                                    [](const entry* a, const entry* b) { return a->first < b->first;});
+                            for(auto p : ps) put(e, *p);
+                        }
+                        e.end();
+                    }
+
+                    static void read(const value_view& v, M& m)
+                    {
+                        m.clear();
+                        if(!v.is_dict()) throw std::runtime_error("value is not an dictionary");
+
+                        const auto size = v.size();
+                        for(size_t i = 0; i < size; i++)
+                        {
+                            typename M::mapped_type t;
+                            read_value(v.value_at(i), t);
+
+                            const auto k = v.key(i);
+                            m[std::string(k.data, k.size)] = std::move(t);
+                        }
+                    }
+                };
+
+            template <class T> struct mencode_traits<std::map<std::string, T>> : 
+                map_traits<std::map<std::string, T>, true> {};
+            template <class T> struct mencode_traits<std::unordered_map<std::string, T>> : 
+                map_traits<std::unordered_map<std::string, T>, false> {};
+
+            //types with a serialize method
+            template <class T, class Enable>
+                struct mencode_traits
+                {
+                    static const bool fields = true;
+
+                    using streams = std::integral_constant<bool, 
+                          serializes_with<T, mencode_sizer>::value && 
+                          serializes_with<T, mencode_writer>::value>;
+                    using reads = std::integral_constant<bool, 
+                          serializes_with<T, mencode_reader>::value>;
+
+                    static size_t size(const T& t) { return size(t, streams{}); }
+                    static void put(encoder& e, const T& t) { put(e, t, streams{}); }
+                    static void read(const value_view& v, T& t) { read(v, t, reads{}); }
+                    static bytes encode(const T& t) { return encode(t, streams{}); }
+
+                    static void measure(const T& t, field_layout& l)
+                    {
+                        mencode_sizer s{l};
+                        s(t);
+                        l.finish();
+                    }
+
+                    static void write(byte* b, const T& t, field_layout& l)
+                    {
+                        if(l.slots.empty() && !l.unkeyed_uses) 
+                        {
+                            encoder e{b, b + l.size};
+                            e.put_empty();
+                            return;
+                        }
+
+                        if(!l.slots.empty())
+                        {
+                            b[0] = 'd';
+                            b[l.size - 1] = ';';
+                        }
+
+                        mencode_writer w{b, l};
+                        w(t);
+                    }
+
+                    static size_t size(const T& t, std::true_type)
+                    {
+                        field_layout l;
+                        measure(t, l);
+                        return l.size;
+                    }
+
+                    static void put(encoder& e, const T& t, std::true_type)
+                    {
+                        field_layout l;
+                        measure(t, l);
+                        write(e.reserve(l.size), t, l);
+                    }
+
+                    static bytes encode(const T& t, std::true_type)
+                    {
+                        field_layout l;
+                        measure(t, l);
+
+                        bytes b(l.size);
+                        write(b.data(), t, l);
+                        return b;
+                    }
+
+                    static void read(const value_view& v, T& t, std::true_type)
+                    {
+                        mencode_reader r{v};
+                        r(t);
+                    }
+
+                    static size_t size(const T& t, std::false_type)
+                    {
+                        mencode_out o;
+                        o(t);
+                        return encoded_size(o.val());
+                    }
+
+                    static void put(encoder& e, const T& t, std::false_type)
+                    {
+                        mencode_out o;
+                        o(t);
+                        e.put(o.val());
+                    }
+
+                    static bytes encode(const T& t, std::false_type)
+                    {
+                        mencode_out o;
+                        o(t);
+                        return util::encode(o.val());
+                    }
+
+                    static void read(const value_view& v, T& t, std::false_type)
+                    {
+                        mencode_in in{v.decode()};
+                        in(t);
+                    }
+                };
+
+            template <class T> 
+                void read_value(const value_view& v, T& t, std::true_type)
+                {
+                    mencode_traits<T>::read(v, t);
+                }
+
+            //like mencode_in, a dict only holds keyed fields
+            template <class T> 
+                void read_value(const value_view& v, T& t, std::false_type)
+                {
+                    mencode_traits<T>::read(v.is_dict() ? value_view{} : v, t);
+                }
+
+            //reads a value the way mencode_in reads one on its own
+            template <class T> 
+                void read_value(const value_view& v, T& t)
+                {
+                    read_value(v, t, has_fields<T>{});
+                }
+
+            template <class T> 
+                bytes encode_value(const T& t, std::true_type)
+                {
+                    return mencode_traits<T>::encode(t);
+                }
+
+            template <class T> 
+                bytes encode_value(const T& t, std::false_type)
+                {
+                    bytes b(mencode_traits<T>::size(t));
+                    encoder e{b};
+                    mencode_traits<T>::put(e, t);
+
+                    ENSURE(e.done());
+                    return b;
+                }
+        }
+
         template<class T>
             void deserialize(const bytes& b, T& t)
             {
-                mencode_in in{decode<value>(b)};
-                in(t);
+                detail::read_value(value_view{b}, t);
             }
 
         template<class T>
             void serialize(bytes& b, const T& t)
             {
-                mencode_out out;
-                out(t);
-                b = encode(out.val());
+                b = detail::encode_value(t, detail::has_fields<T>{});
             }
     }
 }
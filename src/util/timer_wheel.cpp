@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+
+#include "util/timer_wheel.hpp"
+#include "util/dbc.hpp"
+
+#include <algorithm>
+#include <iterator>
+
+namespace fire 
+{
+    namespace util 
+    {
+        timer_wheel::timer_wheel(size_t slots, size_t tick_ms) :
+            _slots(slots),
+            _tick_ms{tick_ms}
+        {
+            REQUIRE_GREATER(slots, 0);
+            REQUIRE_GREATER(tick_ms, 0);
+        }
+
+        timer_wheel::timer_id timer_wheel::schedule(size_t delay_ms, callback fn)
+        {
+            REQUIRE(fn);
+
+            //round up so a timer never fires early, and at least one tick
+            //out since the current slot may be running right now
+            const size_t ticks = std::max<size_t>(1, (delay_ms + _tick_ms - 1) / _tick_ms);
+
+            std::lock_guard<std::mutex> l(_mutex);
+            const size_t s = (_cursor + ticks) % _slots.size();
+            const auto id = _next_id++;
+
+            auto& sl = _slots[s];
+            sl.emplace_back(timer{id, (ticks - 1) / _slots.size(), std::move(fn)});
+            _timers[id] = timer_position{s, std::prev(sl.end())};
+
+            ENSURE_GREATER(id, 0);
+            return id;
+        }
+
+        void timer_wheel::cancel(timer_id id)
+        {
+            std::lock_guard<std::mutex> l(_mutex);
+            auto t = _timers.find(id);
+            if(t == _timers.end()) return;
+
+            _slots[t->second.first].erase(t->second.second);
+            _timers.erase(t);
+        }
+
+        void timer_wheel::tick()
+        {
+            std::vector<callback> due;
+            {
+                std::lock_guard<std::mutex> l(_mutex);
+                _cursor = (_cursor + 1) % _slots.size();
+
+                auto& sl = _slots[_cursor];
+                for(auto t = sl.begin(); t != sl.end();)
+                {
+                    if(t->rounds > 0) 
+                    {
+                        t->rounds--;
+                        t++;
+                        continue;
+                    }
+
+                    due.emplace_back(std::move(t->fn));
+                    _timers.erase(t->id);
+                    t = sl.erase(t);
+                }
+            }
+
+            for(auto& fn : due) fn();
+        }
+
+        size_t timer_wheel::tick_ms() const
+        {
+            return _tick_ms;
+        }
+
+        size_t timer_wheel::size() const
+        {
+            std::lock_guard<std::mutex> l(_mutex);
+            return _timers.size();
+        }
+    }
+}
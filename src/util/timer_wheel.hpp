@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2015  Maxim Noah Khailo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give 
+ * permission to link the code of portions of this program with the 
+ * Botan library under certain conditions as described in each 
+ * individual source file, and distribute linked combinations 
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects for 
+ * all of the code used other than Botan. If you modify file(s) with 
+ * this exception, you may extend this exception to your version of the 
+ * file(s), but you are not obligated to do so. If you do not wish to do 
+ * so, delete this exception statement from your version. If you delete 
+ * this exception statement from all source files in the program, then 
+ * also delete it here.
+ */
+#ifndef FIRESTR_UTIL_TIMER_WHEEL_H
+#define FIRESTR_UTIL_TIMER_WHEEL_H
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace fire 
+{
+    namespace util 
+    {
+        //hashed timer wheel. timers hash into a slot by their deadline so
+        //schedule and cancel are O(1) no matter how many are waiting.
+        //tick is called every tick_ms by the owner and runs timers that
+        //are due, outside of the lock so they can schedule again.
+        class timer_wheel
+        {
+            public:
+                using callback = std::function<void()>;
+                using timer_id = uint64_t;
+
+                timer_wheel(size_t slots, size_t tick_ms);
+
+            public:
+                timer_id schedule(size_t delay_ms, callback);
+                void cancel(timer_id);
+                void tick();
+                size_t tick_ms() const;
+                size_t size() const;
+
+            private:
+                struct timer
+                {
+                    timer_id id;
+                    size_t rounds;
+                    callback fn;
+                };
+                using slot = std::list<timer>;
+                using timer_position = std::pair<size_t, slot::iterator>;
+
+            private:
+                std::vector<slot> _slots;
+                std::unordered_map<timer_id, timer_position> _timers;
+                size_t _tick_ms;
+                size_t _cursor = 0;
+                timer_id _next_id = 1;
+                mutable std::mutex _mutex;
+        };
+    }
+}
+
+#endif